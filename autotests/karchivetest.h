@@ -46,6 +46,8 @@ private Q_SLOTS:
     void testTarFileData();
     void testTarCopyTo_data(){ setupData(); };
     void testTarCopyTo();
+    void testTarIndex_data(){ setupData(); };
+    void testTarIndex();
     void testTarReadWrite_data(){ setupData(); };
     void testTarReadWrite();
     void testTarMaxLength_data();
@@ -55,6 +57,7 @@ private Q_SLOTS:
     void testTarDirectoryForgotten();
     void testTarRootDir();
     void testTarDirectoryTwice();
+    void testTarVisit();
 
     void testCreateZip();
     void testCreateZipError();
@@ -65,6 +68,15 @@ private Q_SLOTS:
     void testZipMaxLength();
     void testZipWithNonLatinFileNames();
     void testZipAddLocalDirectory();
+    void testZipCentralDirectory();
+    void testZipZip64();
+    void testZipSequentialDevice();
+    void testZipParallelDeflate();
+    void testZipMemoryMapping();
+
+    void testMimeTypeForHeader_data();
+    void testMimeTypeForHeader();
+    void testArchiveDetection();
 
 #if HAVE_XZ_SUPPORT
     void testCreate7Zip_data(){ setup7ZipData(); };
@@ -75,10 +87,15 @@ private Q_SLOTS:
     void test7ZipFileData();
     void test7ZipCopyTo_data(){ setup7ZipData(); };
     void test7ZipCopyTo();
+    void test7ZipIndex_data(){ setup7ZipData(); };
+    void test7ZipIndex();
     void test7ZipReadWrite_data(){ setup7ZipData(); };
     void test7ZipReadWrite();
     void test7ZipMaxLength_data(){ setup7ZipData(); };
     void test7ZipMaxLength();
+    void test7ZipSolidBlocks_data(){ setup7ZipData(); };
+    void test7ZipSolidBlocks();
+    void test7ZipDuplicateFile();
 #endif
 
     void cleanupTestCase();
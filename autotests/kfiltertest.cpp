@@ -25,6 +25,7 @@
 #include "kfilterbase.h"
 #include <unistd.h>
 #include <limits.h>
+#include <QtCore/QDataStream>
 #include <QtCore/QFile>
 #include <QtCore/QTextStream>
 #include <QtCore/QDebug>
@@ -111,6 +112,110 @@ void KFilterTest::test_biggerWrites()
     }
 }
 
+void KFilterTest::test_parallelGzipWrite()
+{
+    const QString outFile = QDir::currentPath() + "/test_parallel.gz";
+    // Several blocks, the last one partial, compressible enough to use the dictionaries
+    QByteArray data;
+    for (int i = 0; i < 100000; ++i)
+        data.append(QByteArray::number(qrand() % 1000)).append(' ');
+    QVERIFY(data.size() > 3 * 128 * 1024);
+
+    KFilterDev dev(outFile);
+    dev.setThreadCount(4);
+    QCOMPARE(dev.threadCount(), 4);
+    QVERIFY(dev.open(QIODevice::WriteOnly));
+    QCOMPARE(int(dev.write(data.constData(), 1000)), 1000);
+    QCOMPARE(int(dev.write(data.constData() + 1000, data.size() - 1000)), data.size() - 1000);
+    dev.close();
+
+    // Test data is a single valid gzip stream
+    test_readall(outFile, QString::fromLatin1("application/x-gzip"), data);
+}
+
+void KFilterTest::test_xzThreads()
+{
+#if HAVE_XZ_SUPPORT
+    const QString outFile = QDir::currentPath() + "/test_threads.xz";
+    QByteArray data;
+    for (int i = 0; i < 200000; ++i)
+        data.append(QByteArray::number(qrand() % 1000)).append(' ');
+
+    KCompressionDevice writer(outFile, KCompressionDevice::Xz);
+    writer.setThreadCount(4);
+    QVERIFY(writer.open(QIODevice::WriteOnly));
+    QCOMPARE(writer.write(data), qint64(data.size()));
+    writer.close();
+
+    KCompressionDevice reader(outFile, KCompressionDevice::Xz);
+    reader.setThreadCount(4);
+    QVERIFY(reader.open(QIODevice::ReadOnly));
+    QCOMPARE(reader.readAll(), data);
+    // Going back re-creates the decoder
+    QVERIFY(reader.seek(0));
+    QCOMPARE(reader.read(100), data.left(100));
+#endif
+}
+
+void KFilterTest::test_accessPoints()
+{
+    const QString outFile = QDir::currentPath() + "/test_seek.gz";
+    QByteArray data;
+    for (int i = 0; i < 300000; ++i)
+        data.append(QByteArray::number(qrand() % 1000)).append(' ');
+    QVERIFY(data.size() > 1100020);
+    test_block_write(outFile, data);
+
+    KCompressionDevice dev(outFile, KCompressionDevice::GZip);
+    dev.setAccessPointSpan(64 * 1024);
+    QCOMPARE(dev.accessPointSpan(), qint64(64 * 1024));
+    QVERIFY(dev.open(QIODevice::ReadOnly));
+    // The first pass records the access points
+    QCOMPARE(dev.readAll(), data);
+
+    // Backwards and forwards, close to and far from the current position
+    const qint64 positions[] = { 1000000, 5, 700000, 700010, 300000, 1100000, 100 };
+    for (uint i = 0; i < sizeof(positions) / sizeof(*positions); ++i) {
+        const qint64 pos = positions[i];
+        QVERIFY(dev.seek(pos));
+        QCOMPARE(dev.pos(), pos);
+        QCOMPARE(dev.read(20), data.mid(pos, 20));
+    }
+
+    // Access points saved once can be used by another device straight away
+    const QByteArray accessPoints = dev.accessPoints();
+    QVERIFY(!accessPoints.isEmpty());
+    KCompressionDevice other(outFile, KCompressionDevice::GZip);
+    other.setAccessPointSpan(64 * 1024);
+    QVERIFY(other.open(QIODevice::ReadOnly));
+    QVERIFY(other.setAccessPoints(accessPoints));
+    QVERIFY(other.seek(1000000));
+    QCOMPARE(other.read(20), data.mid(1000000, 20));
+    QVERIFY(other.seek(300000));
+    QCOMPARE(other.read(20), data.mid(300000, 20));
+
+    // Access points out of order, or past the end of the compressed data,
+    // are rejected and the ones restored before are kept
+    const qint64 compressedSize = QFileInfo(outFile).size();
+    QByteArray outOfOrder;
+    {
+        QDataStream stream(&outOfOrder, QIODevice::WriteOnly);
+        stream << qint32(2)
+               << qint64(1000) << qint64(200000) << qint32(0) << QByteArray(32768, 'a')
+               << qint64(500) << qint64(400000) << qint32(0) << QByteArray(32768, 'a');
+    }
+    QVERIFY(!other.setAccessPoints(outOfOrder));
+    QByteArray pastEnd;
+    {
+        QDataStream stream(&pastEnd, QIODevice::WriteOnly);
+        stream << qint32(1)
+               << qint64(compressedSize + 1) << qint64(200000) << qint32(0) << QByteArray(32768, 'a');
+    }
+    QVERIFY(!other.setAccessPoints(pastEnd));
+    QVERIFY(other.seek(1000000));
+    QCOMPARE(other.read(20), data.mid(1000000, 20));
+}
+
 void KFilterTest::test_block_read( const QString & fileName )
 {
     KFilterDev dev(fileName);
@@ -283,6 +388,7 @@ void KFilterTest::test_findFilterByMimeType_data()
 #endif
     // indirect compressed mimetypes
     QTest::newRow("application/x-gzdvi") << QString::fromLatin1("application/x-gzdvi") << KCompressionDevice::GZip;
+    QTest::newRow("application/x-compressed-tar") << QString::fromLatin1("application/x-compressed-tar") << KCompressionDevice::GZip;
 
     // non-compressed mimetypes
     QTest::newRow("text/plain") << QString::fromLatin1("text/plain") << KCompressionDevice::None;
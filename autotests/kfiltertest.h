@@ -38,6 +38,9 @@ private Q_SLOTS:
     void test_findFilterByMimeType();
     void test_deflateWithZlibHeader();
     void test_pushData();
+    void test_parallelGzipWrite();
+    void test_xzThreads();
+    void test_accessPoints();
 
 private:
     void test_block_write(const QString & fileName, const QByteArray& data);
@@ -76,3 +76,41 @@ void KLimitedIODeviceTest::testSeeking()
     QCOMPARE(dev.readAll(), chunk.data);
 }
 
+void KLimitedIODeviceTest::testInterleavedReads_data()
+{
+    QTest::addColumn<bool>("useFile");
+
+    QTest::newRow("buffer") << false;
+    QTest::newRow("file") << true;
+}
+
+void KLimitedIODeviceTest::testInterleavedReads()
+{
+    QFETCH(bool, useFile);
+
+    QTemporaryFile tempFile;
+    QFile file;
+    QIODevice *device = &m_buffer;
+    if (useFile) {
+        QVERIFY(tempFile.open());
+        QCOMPARE(tempFile.write(m_data), qint64(m_data.size()));
+        QVERIFY(tempFile.flush());
+        // Positional reads are used on files opened for reading only
+        file.setFileName(tempFile.fileName());
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        device = &file;
+    }
+
+    // Each reader keeps its own position in the shared device
+    const ChunkData &firstChunk = m_chunks.at(1);
+    const ChunkData &secondChunk = m_chunks.at(2);
+    KLimitedIODevice first(device, firstChunk.offset, firstChunk.data.size());
+    KLimitedIODevice second(device, secondChunk.offset, secondChunk.data.size());
+    QByteArray firstData, secondData;
+    for (int i = 0; i < 20; ++i) {
+        firstData += first.read(5);
+        secondData += second.read(7);
+    }
+    QCOMPARE(firstData, firstChunk.data);
+    QCOMPARE(secondData, secondChunk.data);
+}
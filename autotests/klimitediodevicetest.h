@@ -40,6 +40,8 @@ private Q_SLOTS:
     void testReadChunks_data();
     void testReadChunks();
     void testSeeking();
+    void testInterleavedReads_data();
+    void testInterleavedReads();
 
 private:
     void addChunk(const QByteArray &chunk);
@@ -16,12 +16,20 @@
    Boston, MA 02110-1301, USA.
 */
 
-#include "k7zip.h"
+#include "7z.h"
 
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
 #include <QtCore/QBuffer>
+#include <QtCore/QDataStream>
 #include <QtCore/QFile>
+#include <QtCore/QMap>
+#include <QtCore/QMutex>
+#include <QtCore/QRunnable>
+#include <QtCore/QSemaphore>
+#include <QtCore/QSet>
+#include <QtCore/QThreadPool>
+#include <QtCore/QWaitCondition>
 
 #include "kcompressiondevice.h"
 #include <kfilterbase.h>
@@ -32,9 +40,29 @@
 #include <time.h> // time()
 #include "zlib.h"
 
+#include <karchivehandlerplugin.h>
+
+class SevenZipPlugin : public KArchiveHandlerPlugin
+{
+    Q_OBJECT
+    Q_PLUGIN_METADATA(IID "org.kde.KArchiveHandlerFactoryInterface" FILE "7z.json")
+public:
+    QStringList mimeTypes() const {
+        QStringList types;
+        types << QStringLiteral("application/x-7z-compressed");
+        return types;
+    }
+
+    KArchiveHandler *create(const QString &mimeType) {
+        if (mimeTypes().contains(mimeType))
+          return new SevenZipHandler(mimeType);
+        return 0;
+    }
+};
+
 
 ////////////////////////////////////////////////////////////////////////
-/////////////////////////// K7Zip //////////////////////////////////////
+/////////////////////////// SevenZipHandler //////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////
 
 #define BUFFER_SIZE 8*1024
@@ -54,6 +82,15 @@ unsigned char XZ_HEADER_MAGIC[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
 
 #define LZMA2_DIC_SIZE_FROM_PROP(p) (((quint32)2 | ((p) & 1)) << ((p) / 2 + 11))
 
+// Dictionary of the LZMA2 preset KXzFilter encodes with
+static const quint32 k_lzma2DictSize = 1 << 23;
+// Folders growing past this are no longer buffered for a worker
+static const qint64 max_parallel_folder_size = 256 * 1024 * 1024;
+// Folders decoded in one go are kept until they take more than this
+static const qint64 max_decoded_folders_size = 64 * 1024 * 1024;
+// Decoders of streamed folders kept around once their entry is read
+static const int max_idle_decoders = 8;
+
 #define FILE_ATTRIBUTE_READONLY             1
 #define FILE_ATTRIBUTE_HIDDEN               2
 #define FILE_ATTRIBUTE_SYSTEM               4
@@ -158,58 +195,161 @@ static const quint64 k_AES = 0x06F10701;
 
 
 /**
- * A K7ZipFileEntry represents an file in a 7zip archive.
+ * The decoders of streamed folders which aren't being read, so that the
+ * next entry of a folder is decoded from where the previous one ended
+ * instead of from the start of the folder.
  */
-class KARCHIVE_EXPORT K7ZipFileEntry : public KArchiveFile
+class SevenZipDecoderPool
 {
 public:
-    K7ZipFileEntry( K7Zip* zip, const QString& name, int access, int date,
-                   const QString& user, const QString& group, const QString& symlink,
-                   qint64 pos, qint64 size, const QByteArray& data);
+    ~SevenZipDecoderPool()
+    {
+        clear();
+    }
 
     /**
-     * @return the content of this file.
-     * Call data() with care (only once per file), this data isn't cached.
+     * Takes the decoder of @p folder which is the closest before @p offset.
+     * @return 0 if there is none
      */
-    virtual QByteArray data() const;
+    KCompressionDevice* take( int folder, qint64 offset )
+    {
+        QMutexLocker locker( &m_mutex );
+        int best = -1;
+        for ( int i = 0; i < m_decoders.size(); ++i ) {
+            const Decoder& decoder = m_decoders.at( i );
+            if ( decoder.folder == folder && decoder.dev->pos() <= offset
+                 && ( best < 0 || decoder.dev->pos() > m_decoders.at( best ).dev->pos() ) ) {
+                best = i;
+            }
+        }
+        return best < 0 ? 0 : m_decoders.takeAt( best ).dev;
+    }
 
     /**
-     * This method returns QIODevice (internal class: KLimitedIODevice)
-     * on top of the underlying QIODevice. This is obviously for reading only.
-     *
-     * WARNING: Note that the ownership of the device is being transferred to the caller,
-     * who will have to delete it.
-     *
-     * The returned device auto-opens (in readonly mode), no need to open it.
-     * @return the QIODevice of the file
+     * Gives back the decoder @p dev of @p folder, once its entry was read.
      */
-    virtual QIODevice *createDevice() const;
+    void put( int folder, KCompressionDevice* dev )
+    {
+        Decoder decoder;
+        decoder.folder = folder;
+        decoder.dev = dev;
+        QMutexLocker locker( &m_mutex );
+        m_decoders.append( decoder );
+        // Drop the least recently used one
+        if ( m_decoders.size() > max_idle_decoders ) {
+            delete m_decoders.takeFirst().dev;
+        }
+    }
+
+    void clear()
+    {
+        QMutexLocker locker( &m_mutex );
+        for ( int i = 0; i < m_decoders.size(); ++i ) {
+            delete m_decoders.at( i ).dev;
+        }
+        m_decoders.clear();
+    }
 
 private:
-    const QByteArray m_data;
-    QBuffer* m_buffer;
+    struct Decoder
+    {
+        int folder;
+        KCompressionDevice* dev;
+    };
+    QList<Decoder> m_decoders; // Least recently used first
+    QMutex m_mutex; // Entries may be read from several threads
 };
 
+/**
+ * A KLimitedIODevice which owns the device it reads from, or gives it back
+ * to the pool of decoders it was taken from.
+ */
+class SevenZipEntryDevice : public KLimitedIODevice
+{
+public:
+    SevenZipEntryDevice( QIODevice* dev, qint64 start, qint64 length )
+        : KLimitedIODevice( dev, start, length ), m_dev( dev ), m_pool( 0 ), m_folder( -1 )
+    {
+    }
+
+    SevenZipEntryDevice( KCompressionDevice* dev, qint64 start, qint64 length, SevenZipDecoderPool* pool, int folder )
+        : KLimitedIODevice( dev, start, length ), m_dev( dev ), m_pool( pool ), m_folder( folder )
+    {
+    }
+
+    virtual ~SevenZipEntryDevice()
+    {
+        if ( m_pool ) {
+            m_pool->put( m_folder, static_cast<KCompressionDevice*>( m_dev ) );
+        } else {
+            delete m_dev;
+        }
+    }
+
+private:
+    QIODevice* m_dev;
+    SevenZipDecoderPool* m_pool;
+    int m_folder;
+};
 
-K7ZipFileEntry::K7ZipFileEntry(K7Zip* zip, const QString& name, int access, int date,
-                               const QString& user, const QString& group, const QString& symlink,
-                               qint64 pos, qint64 size, const QByteArray& data)
+
+class SevenZipHandlerFileEntry::SevenZipHandlerFileEntryPrivate
+{
+public:
+    SevenZipHandlerFileEntryPrivate(int folder)
+        : folder(folder)
+        , crc(0)
+    {}
+    const int folder;
+    quint32 crc;
+};
+
+SevenZipHandlerFileEntry::SevenZipHandlerFileEntry(KArchive* zip, const QString& name, int access, int date,
+                                                   const QString& user, const QString& group, const QString& symlink,
+                                                   qint64 pos, qint64 size, int folder)
     : KArchiveFile(zip, name, access, date, user, group, symlink, pos, size)
-    , m_data(data)
+    , d(new SevenZipHandlerFileEntryPrivate(folder))
 {
-    m_buffer = new QBuffer;
-    m_buffer->setData(m_data);
-    m_buffer->open(QIODevice::ReadOnly);
 }
 
-QByteArray K7ZipFileEntry::data() const
+SevenZipHandlerFileEntry::~SevenZipHandlerFileEntry()
 {
-    return m_data.mid(position(), size());
+    delete d;
+}
+
+quint32 SevenZipHandlerFileEntry::crc() const
+{
+    return d->crc;
 }
 
-QIODevice *K7ZipFileEntry::createDevice() const
+void SevenZipHandlerFileEntry::setCrc(quint32 crc)
 {
-    return new KLimitedIODevice( m_buffer, position(), size() );
+    d->crc = crc;
+}
+
+QByteArray SevenZipHandlerFileEntry::data() const
+{
+    QIODevice* dev = createDevice();
+    QByteArray arr;
+    if (dev) {
+        arr = dev->readAll();
+        delete dev;
+    }
+    return arr;
+}
+
+QIODevice *SevenZipHandlerFileEntry::createDevice() const
+{
+    return static_cast<SevenZipHandler*>(archive()->handler())->createEntryDevice(d->folder, position(), size());
+}
+
+void SevenZipHandlerFileEntry::virtual_hook( int id, void* data )
+{
+    // The data always goes through createEntryDevice(), position()
+    // is no offset in the archive file
+    if ( id == StoredDataHook )
+        return;
+    KArchiveFile::virtual_hook( id, data );
 }
 
 class FileInfo
@@ -375,10 +515,54 @@ public:
     QVector<quint64> unpackSizes;
 };
 
-class K7Zip::K7ZipPrivate
+/**
+ * Compresses the data of a folder to raw LZMA2 on a worker thread.
+ */
+class SevenZipEncodeJob : public QRunnable
 {
 public:
-    K7ZipPrivate(K7Zip *parent)
+    SevenZipEncodeJob()
+        : ok(false)
+    {
+        setAutoDelete(false);
+    }
+
+    virtual void run()
+    {
+        KFilterBase* filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::Xz);
+        if (filter && static_cast<KXzFilter*>(filter)->init(QIODevice::WriteOnly, KXzFilter::LZMA2, QVector<unsigned char>())) {
+            QByteArray buffer(BUFFER_SIZE, 0);
+            const int chunkSize = 1024 * 1024;
+            int inputPos = 0;
+            KFilterBase::Result result = KFilterBase::Ok;
+            while (result == KFilterBase::Ok) {
+                if (filter->inBufferEmpty() && inputPos < input.size()) {
+                    const int len = qMin(chunkSize, input.size() - inputPos);
+                    filter->setInBuffer(input.constData() + inputPos, len);
+                    inputPos += len;
+                }
+                filter->setOutBuffer(buffer.data(), buffer.size());
+                result = filter->compress(inputPos == input.size());
+                output.append(buffer.constData(), buffer.size() - filter->outBufferAvailable());
+            }
+            ok = result == KFilterBase::End;
+            filter->terminate();
+        }
+        delete filter;
+        input.clear();
+        done.release();
+    }
+
+    QByteArray input;
+    QByteArray output;
+    bool ok;
+    QSemaphore done;
+};
+
+class SevenZipHandler::SevenZipHandlerPrivate
+{
+public:
+    SevenZipHandlerPrivate(SevenZipHandler *parent)
       : q(parent),
         packPos(0),
         numPackStreams(0),
@@ -387,17 +571,34 @@ public:
         end(0),
         headerSize(0),
         countSize(0),
+        decodedSize(0),
+        m_solidBlockSize(0),
+        m_workerCount(1),
+        m_encoder(0),
+        m_encoderStart(0),
+        m_streamSize(0),
+        m_folderStart(0),
+        m_folderCrc(0),
+        m_folderStreams(0),
         m_currentFile(0)
     {
     }
 
-    K7Zip *q;
+    ~SevenZipHandlerPrivate()
+    {
+        m_pool.waitForDone();
+        qDeleteAll(m_pending);
+        delete m_encoder;
+    }
+
+    SevenZipHandler *q;
 
     QVector<bool> packCRCsDefined;
     QVector<quint32> packCRCs;
     QVector<quint64> numUnpackStreamsInFolders;
 
     QVector<Folder*> folders;
+    QVector<quint64> folderStarts; // Offsets of the folders in the unpacked data of all of them
     QVector<FileInfo*> fileInfos;
     // File informations
     QVector<bool> cTimesDefined;
@@ -425,10 +626,33 @@ public:
     quint64 headerSize;
     quint64 countSize;
 
+    // Folders decoded in one go, see SevenZipHandler::createEntryDevice
+    QMap<int, QByteArray> decodedFolders;
+    QList<int> decodedOrder; // Least recently used first
+    qint64 decodedSize;
+    QSet<int> decodingFolders; // Being decoded outside of folderMutex
+    QWaitCondition folderDecoded;
+    QMutex folderMutex; // Entries may be read from several threads
+    SevenZipDecoderPool decoders;
+
     //Write
     QByteArray header;
-    QByteArray outData; // Store data in this buffer before compress and write in archive.
-    K7ZipFileEntry* m_currentFile;
+    qint64 m_solidBlockSize;
+    int m_workerCount;
+    QThreadPool m_pool;
+    KCompressionDevice* m_encoder; // LZMA2 coder of the folder, created with its first bytes
+    qint64 m_encoderStart;
+    QByteArray m_folderData; // Folder being filled for a worker, instead of m_encoder
+    quint64 m_streamSize; // Unpacked size of all folders so far
+    quint64 m_folderStart;
+    quint32 m_folderCrc;
+    quint64 m_folderStreams;
+    QList<SevenZipEncodeJob*> m_pending;
+    // Folders done, packSizes are only known once their job got written
+    QVector<Folder*> m_writtenFolders;
+    QVector<quint64> m_writtenPackSizes;
+    QVector<quint64> m_writtenStreams;
+    SevenZipHandlerFileEntry* m_currentFile;
     QList<KArchiveEntry*> m_entryList;
 
     void clear() {
@@ -436,6 +660,7 @@ public:
         packCRCs.clear();
         numUnpackStreamsInFolders.clear();
         folders.clear();
+        folderStarts.clear();
         fileInfos.clear();
         cTimesDefined.clear();
         cTimes.clear();
@@ -457,6 +682,10 @@ public:
         end = 0;
         headerSize = 0;
         countSize = 0;
+        decodedFolders.clear();
+        decodedOrder.clear();
+        decodedSize = 0;
+        decoders.clear();
     }
 
     // Read
@@ -478,9 +707,20 @@ public:
     bool readUnpackInfo();
     bool readSubStreamsInfo();
     QByteArray readAndDecodePackedStreams(bool readMainStreamInfo = true);
+    int firstPackStreamIndex(int folderIndex) const;
+    quint64 packStreamOffset(int packIndex) const;
+    bool readPackStreams(int folderIndex, QVector<QByteArray>& datas);
+    void setFolderStarts();
+    bool decodeFolders(int first, int count, QVector<QByteArray>& inflated);
+    void addDecodedFolder(int folderIndex, const QByteArray& inflated);
 
     //Write
-    void createItemsFromEntities(const KArchiveDirectory*, const QString&, QByteArray&);
+    bool startStream();
+    bool writeStream(const char* data, qint64 size);
+    bool finishFolder();
+    bool flushJobs(int maxPending);
+    Folder* createLzma2Folder(quint64 unpackSize, quint32 unpackCRC) const;
+    void createItemsFromEntities(const KArchiveDirectory*, const QString&, QMap<qint64, QPair<FileInfo*, quint64> >&);
     void writeByte(unsigned char b);
     void writeNumber(quint64 value);
     void writeBoolVector(const QVector<bool> &boolVector);
@@ -499,18 +739,12 @@ public:
     QByteArray encodeStream(QVector<quint64> &packSizes, QVector<Folder*> &folds);
 };
 
-K7Zip::K7Zip( const QString& fileName )
-    : KArchive( fileName ), d(new K7ZipPrivate(this))
+SevenZipHandler::SevenZipHandler( const QString& mimeType )
+    : KArchiveHandler( mimeType ), d(new SevenZipHandlerPrivate(this))
 {
 }
 
-K7Zip::K7Zip( QIODevice * dev )
-    : KArchive( dev ), d(new K7ZipPrivate(this))
-{
-    Q_ASSERT( dev );
-}
-
-K7Zip::~K7Zip()
+SevenZipHandler::~SevenZipHandler()
 {
     if( isOpen() )
         close();
@@ -518,7 +752,7 @@ K7Zip::~K7Zip()
     delete d;
 }
 
-int K7Zip::K7ZipPrivate::readByte()
+int SevenZipHandler::SevenZipHandlerPrivate::readByte()
 {
     if (!buffer || pos+1 > end) {
         return -1;
@@ -526,7 +760,7 @@ int K7Zip::K7ZipPrivate::readByte()
     return buffer[pos++];
 }
 
-quint32 K7Zip::K7ZipPrivate::readUInt32()
+quint32 SevenZipHandler::SevenZipHandlerPrivate::readUInt32()
 {
     if (!buffer || (quint64)(pos + 4) > end) {
         qDebug() << "error size";
@@ -538,7 +772,7 @@ quint32 K7Zip::K7ZipPrivate::readUInt32()
     return res;
 }
 
-quint64 K7Zip::K7ZipPrivate::readUInt64()
+quint64 SevenZipHandler::SevenZipHandlerPrivate::readUInt64()
 {
     if (!buffer || (quint64)(pos + 8) > end) {
         qDebug() << "error size";
@@ -550,7 +784,7 @@ quint64 K7Zip::K7ZipPrivate::readUInt64()
     return res;
 }
 
-quint64 K7Zip::K7ZipPrivate::readNumber()
+quint64 SevenZipHandler::SevenZipHandlerPrivate::readNumber()
 {
     if (!buffer) {
         return 0;
@@ -571,7 +805,7 @@ quint64 K7Zip::K7ZipPrivate::readNumber()
     return value;
 }
 
-QString K7Zip::K7ZipPrivate::readString()
+QString SevenZipHandler::SevenZipHandlerPrivate::readString()
 {
     if (!buffer) {
         return QString();
@@ -608,7 +842,7 @@ QString K7Zip::K7ZipPrivate::readString()
     return p;
 }
 
-void K7Zip::K7ZipPrivate::skipData(int size)
+void SevenZipHandler::SevenZipHandlerPrivate::skipData(int size)
 {
     if (!buffer || pos + size > end) {
         return;
@@ -616,7 +850,7 @@ void K7Zip::K7ZipPrivate::skipData(int size)
     pos += size;
 }
 
-bool K7Zip::K7ZipPrivate::findAttribute(int attribute)
+bool SevenZipHandler::SevenZipHandlerPrivate::findAttribute(int attribute)
 {
     if (!buffer) {
         return false;
@@ -636,7 +870,7 @@ bool K7Zip::K7ZipPrivate::findAttribute(int attribute)
 }
 
 
-void K7Zip::K7ZipPrivate::readBoolVector(int numItems, QVector<bool> &v)
+void SevenZipHandler::SevenZipHandlerPrivate::readBoolVector(int numItems, QVector<bool> &v)
 {
     if (!buffer) {
         return;
@@ -654,7 +888,7 @@ void K7Zip::K7ZipPrivate::readBoolVector(int numItems, QVector<bool> &v)
     }
 }
 
-void K7Zip::K7ZipPrivate::readBoolVector2(int numItems, QVector<bool> &v)
+void SevenZipHandler::SevenZipHandlerPrivate::readBoolVector2(int numItems, QVector<bool> &v)
 {
     if (!buffer) {
         return;
@@ -671,7 +905,7 @@ void K7Zip::K7ZipPrivate::readBoolVector2(int numItems, QVector<bool> &v)
     }
 }
 
-void K7Zip::K7ZipPrivate::readHashDigests(int numItems,
+void SevenZipHandler::SevenZipHandlerPrivate::readHashDigests(int numItems,
                                           QVector<bool> &digestsDefined,
                                           QVector<quint32> &digests)
 {
@@ -691,7 +925,7 @@ void K7Zip::K7ZipPrivate::readHashDigests(int numItems,
     }
 }
 
-Folder* K7Zip::K7ZipPrivate::folderItem()
+Folder* SevenZipHandler::SevenZipHandlerPrivate::folderItem()
 {
     if (!buffer) {
         return 0;
@@ -787,7 +1021,7 @@ Folder* K7Zip::K7ZipPrivate::folderItem()
     return folder;
 }
 
-bool K7Zip::K7ZipPrivate::readUInt64DefVector(int numFiles, QVector<quint64>& values, QVector<bool>& defined)
+bool SevenZipHandler::SevenZipHandlerPrivate::readUInt64DefVector(int numFiles, QVector<quint64>& values, QVector<bool>& defined)
 {
     if (!buffer) {
         return false;
@@ -817,7 +1051,7 @@ bool K7Zip::K7ZipPrivate::readUInt64DefVector(int numFiles, QVector<quint64>& va
     return true;
 }
 
-bool K7Zip::K7ZipPrivate::readPackInfo()
+bool SevenZipHandler::SevenZipHandlerPrivate::readPackInfo()
 {
     if (!buffer) {
         return false;
@@ -861,7 +1095,7 @@ bool K7Zip::K7ZipPrivate::readPackInfo()
     return true;
 }
 
-bool K7Zip::K7ZipPrivate::readUnpackInfo()
+bool SevenZipHandler::SevenZipHandlerPrivate::readUnpackInfo()
 {
     if (!buffer) {
         return false;
@@ -933,7 +1167,7 @@ bool K7Zip::K7ZipPrivate::readUnpackInfo()
     return true;
 }
 
-bool K7Zip::K7ZipPrivate::readSubStreamsInfo()
+bool SevenZipHandler::SevenZipHandlerPrivate::readSubStreamsInfo()
 {
     if (!buffer) {
         return false;
@@ -1095,7 +1329,7 @@ long long rtlSecondsSince1970ToSpecTime(quint32 seconds) {
 }
 
 
-bool K7Zip::K7ZipPrivate::readMainStreamsInfo()
+bool SevenZipHandler::SevenZipHandlerPrivate::readMainStreamsInfo()
 {
     if (!buffer) {
         return false;
@@ -1424,7 +1658,25 @@ static QByteArray decodeBCJ2(const QByteArray& mainStream, const QByteArray& cal
     }
 }
 
-QByteArray K7Zip::K7ZipPrivate::readAndDecodePackedStreams(bool readMainStreamInfo)
+int SevenZipHandler::SevenZipHandlerPrivate::firstPackStreamIndex(int folderIndex) const
+{
+    int packIndex = 0;
+    for (int i = 0; i < folderIndex; i++) {
+        packIndex += folders[i]->packedStreams.size();
+    }
+    return packIndex;
+}
+
+quint64 SevenZipHandler::SevenZipHandlerPrivate::packStreamOffset(int packIndex) const
+{
+    quint64 offset = 32 + packPos;
+    for (int i = 0; i < packIndex; i++) {
+        offset += packSizes[i];
+    }
+    return offset;
+}
+
+QByteArray SevenZipHandler::SevenZipHandlerPrivate::readAndDecodePackedStreams(bool readMainStreamInfo)
 {
     if (!buffer) {
         return QByteArray();
@@ -1433,223 +1685,498 @@ QByteArray K7Zip::K7ZipPrivate::readAndDecodePackedStreams(bool readMainStreamIn
     if (readMainStreamInfo)
         readMainStreamsInfo();
 
-    QByteArray inflatedData;
+    QVector<QByteArray> inflated;
+    if (!decodeFolders(0, folders.size(), inflated)) {
+        return QByteArray();
+    }
 
-    quint64 startPos = 32 + packPos ;
+    QByteArray inflatedData;
     for (int i = 0; i < folders.size(); i++)
     {
-        const Folder* folder = folders[i];
-        quint64 unpackSize64 = folder->getUnpackSize();;
-        size_t unpackSize = (size_t)unpackSize64;
-        if (unpackSize != unpackSize64) {
-            qDebug() << "unsupported";
-            return inflatedData;
+        inflatedData.append(inflated[i]);
+
+        const int packIndex = firstPackStreamIndex(i);
+        for (int j = 0; j < folders[i]->packedStreams.size(); j++) {
+            pos += packSizes[packIndex + j];
+            headerSize += packSizes[packIndex + j];
         }
+    }
 
-        // Find main coder
-        quint32 mainCoderIndex = 0;
-        QVector<int> outStreamIndexed;
-        int outStreamIndex = 0;
-        for (int j = 0; j < folder->folderInfos.size(); j++) {
-            const Folder::FolderInfo* info = folder->folderInfos[j];
-            for (int k = 0; k < info->numOutStreams; k++, outStreamIndex++) {
-                if (folder->findBindPairForOutStream(outStreamIndex) < 0) {
-                    outStreamIndexed.append(outStreamIndex);
-                    break;
-                }
-            }
+    return inflatedData;
+}
+
+void SevenZipHandler::SevenZipHandlerPrivate::setFolderStarts()
+{
+    folderStarts.clear();
+    quint64 start = 0;
+    for (int i = 0; i < folders.size(); i++) {
+        folderStarts.append(start);
+        start += folders[i]->getUnpackSize();
+    }
+}
+
+bool SevenZipHandler::SevenZipHandlerPrivate::readPackStreams(int folderIndex, QVector<QByteArray>& datas)
+{
+    // Through KLimitedIODevice, as folders may be decoded from several threads
+    const int packIndex = firstPackStreamIndex(folderIndex);
+    for (int j = 0; j < folders[folderIndex]->packedStreams.size(); j++) {
+        const qint64 size = packSizes[packIndex + j];
+        KLimitedIODevice dev(q->device(), packStreamOffset(packIndex + j), size);
+        QByteArray deflatedData = dev.readAll();
+        if ( deflatedData.size() != size ) {
+            qDebug() << "Failed read next size, should read " << size << ", read " << deflatedData.size();
+            return false;
         }
+        datas.append(deflatedData);
+    }
+    return true;
+}
 
-        quint32 temp = 0;
-        if (!outStreamIndexed.isEmpty()) {
-            folder->findOutStream(outStreamIndexed[0], mainCoderIndex, temp);
+/**
+ * Decodes a folder from its pack streams. Only works on its arguments,
+ * so several folders can be decoded at once.
+ */
+static bool decodeFolder(const Folder* folder, const QVector<QByteArray>& datas, QByteArray& inflated)
+{
+    quint64 unpackSize64 = folder->getUnpackSize();;
+    size_t unpackSize = (size_t)unpackSize64;
+    if (unpackSize != unpackSize64) {
+        qDebug() << "unsupported";
+        return false;
+    }
+
+    // Find main coder
+    quint32 mainCoderIndex = 0;
+    QVector<int> outStreamIndexed;
+    int outStreamIndex = 0;
+    for (int j = 0; j < folder->folderInfos.size(); j++) {
+        const Folder::FolderInfo* info = folder->folderInfos[j];
+        for (int k = 0; k < info->numOutStreams; k++, outStreamIndex++) {
+            if (folder->findBindPairForOutStream(outStreamIndex) < 0) {
+                outStreamIndexed.append(outStreamIndex);
+                break;
+            }
         }
+    }
 
-        quint32 startInIndex = folder->getCoderInStreamIndex(mainCoderIndex);
-        quint32 startOutIndex = folder->getCoderOutStreamIndex(mainCoderIndex);
+    quint32 temp = 0;
+    if (!outStreamIndexed.isEmpty()) {
+        folder->findOutStream(outStreamIndexed[0], mainCoderIndex, temp);
+    }
 
-        Folder::FolderInfo* mainCoder = folder->folderInfos[mainCoderIndex];
+    quint32 startInIndex = folder->getCoderInStreamIndex(mainCoderIndex);
+    quint32 startOutIndex = folder->getCoderOutStreamIndex(mainCoderIndex);
 
-        QVector<int> seqInStreams;
-        QVector<quint32> coderIndexes;
-        for (int j = 0; j < (int)mainCoder->numInStreams; j++) {
-            int seqInStream;
-            quint32 coderIndex;
-            getInStream(folder, startInIndex + j, seqInStream, coderIndex);
-            seqInStreams.append(seqInStream);
-            coderIndexes.append(coderIndex);
-        }
+    Folder::FolderInfo* mainCoder = folder->folderInfos[mainCoderIndex];
 
-        QVector<int> seqOutStreams;
-        for (int j = 0; j < (int)mainCoder->numOutStreams; j++) {
-            int seqOutStream;
-            getOutStream(folder, startOutIndex + j, seqOutStream);
-            seqOutStreams.append(seqOutStream);
-        }
+    QVector<int> seqInStreams;
+    QVector<quint32> coderIndexes;
+    for (int j = 0; j < (int)mainCoder->numInStreams; j++) {
+        int seqInStream;
+        quint32 coderIndex;
+        getInStream(folder, startInIndex + j, seqInStream, coderIndex);
+        seqInStreams.append(seqInStream);
+        coderIndexes.append(coderIndex);
+    }
 
-        QVector<QByteArray> datas;
-        for (int j=0; j<(int)mainCoder->numInStreams; j++) {
-            int size = packSizes[j+i];
-            char encodedBuffer[size];
-            QIODevice* dev = q->device();
-            dev->seek(startPos);
-            quint64 n = dev->read(encodedBuffer, size);
-            if ( n != (quint64)size ) {
-                qDebug() << "Failed read next size, should read " << size << ", read " << n;
-                return inflatedData;
-            }
-            QByteArray deflatedData(encodedBuffer, size);
-            datas.append(deflatedData);
-            startPos += size;
-            pos += size;
-            headerSize += size;
-        }
-
-        QVector<QByteArray> inflatedDatas;
-        QByteArray deflatedData;
-        for (int j = 0; j < seqInStreams.size(); ++j) {
-            Folder::FolderInfo* coder = 0;
-            if ((quint32)j != mainCoderIndex) {
-                coder = folder->folderInfos[coderIndexes[j]];
-            } else {
-                coder = folder->folderInfos[mainCoderIndex];
-            }
+    QVector<int> seqOutStreams;
+    for (int j = 0; j < (int)mainCoder->numOutStreams; j++) {
+        int seqOutStream;
+        getOutStream(folder, startOutIndex + j, seqOutStream);
+        seqOutStreams.append(seqOutStream);
+    }
 
-            deflatedData = datas[seqInStreams[j]];
+    if (datas.size() < (int)mainCoder->numInStreams) {
+        qDebug() << "missing pack streams";
+        return false;
+    }
 
-            KFilterBase* filter = 0;
+    QVector<QByteArray> inflatedDatas;
+    QByteArray deflatedData;
+    for (int j = 0; j < seqInStreams.size(); ++j) {
+        Folder::FolderInfo* coder = 0;
+        if ((quint32)j != mainCoderIndex) {
+            coder = folder->folderInfos[coderIndexes[j]];
+        } else {
+            coder = folder->folderInfos[mainCoderIndex];
+        }
 
-            switch (coder->methodID) {
-            case k_LZMA:
-                filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::Xz);
-                if (!filter) {
-                    qDebug() << "filter not found";
-                    return QByteArray();
-                }
-                static_cast<KXzFilter*>(filter)->init(QIODevice::ReadOnly, KXzFilter::LZMA, coder->properties);
-                break;
-            case k_LZMA2:
-                filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::Xz);
-                if (!filter) {
-                    qDebug() << "filter not found";
-                    return QByteArray();
-                }
-                static_cast<KXzFilter*>(filter)->init(QIODevice::ReadOnly, KXzFilter::LZMA2, coder->properties);
-                break;
-            case k_PPMD:
-            {
-                /*if (coder->properties.size() == 5) {
-                    //Byte order = *(const Byte *)coder.Props;
-                    qint32 dicSize = ((unsigned char)coder->properties[1]        |
-                                     (((unsigned char)coder->properties[2]) <<  8) |
-                                     (((unsigned char)coder->properties[3]) << 16) |
-                                     (((unsigned char)coder->properties[4]) << 24));
-                }*/
-                break;
+        deflatedData = datas[seqInStreams[j]];
+
+        KFilterBase* filter = 0;
+
+        switch (coder->methodID) {
+        case k_LZMA:
+            filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::Xz);
+            if (!filter) {
+                qDebug() << "filter not found";
+                return false;
             }
-            case k_AES:
-                if (coder->properties.size() >=1) {
-                    //const Byte *data = (const Byte *)coder.Props;
-                    //Byte firstByte = *data++;
-                    //UInt32 numCyclesPower = firstByte & 0x3F;
-                }
-                break;
-            case k_BCJ:
-                filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::Xz);
-                if (!filter) {
-                    qDebug() << "filter not found";
-                    return QByteArray();
-                }
-                static_cast<KXzFilter*>(filter)->init(QIODevice::ReadOnly, KXzFilter::BCJ, coder->properties);
-                break;
-            case k_BCJ2:
-            {
-                QByteArray bcj2 = decodeBCJ2(inflatedDatas[0], inflatedDatas[1], inflatedDatas[2], deflatedData);
-                inflatedDatas.clear();
-                inflatedDatas.append(bcj2);
-                break;
+            static_cast<KXzFilter*>(filter)->init(QIODevice::ReadOnly, KXzFilter::LZMA, coder->properties);
+            break;
+        case k_LZMA2:
+            filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::Xz);
+            if (!filter) {
+                qDebug() << "filter not found";
+                return false;
             }
-            case k_BZip2:
-                filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::BZip2);
-                if (!filter) {
-                    qDebug() << "filter not found";
-                    return QByteArray();
-                }
-                filter->init(QIODevice::ReadOnly);
-                break;
+            static_cast<KXzFilter*>(filter)->init(QIODevice::ReadOnly, KXzFilter::LZMA2, coder->properties);
+            break;
+        case k_PPMD:
+        {
+            /*if (coder->properties.size() == 5) {
+                //Byte order = *(const Byte *)coder.Props;
+                qint32 dicSize = ((unsigned char)coder->properties[1]        |
+                                 (((unsigned char)coder->properties[2]) <<  8) |
+                                 (((unsigned char)coder->properties[3]) << 16) |
+                                 (((unsigned char)coder->properties[4]) << 24));
+            }*/
+            break;
+        }
+        case k_AES:
+            if (coder->properties.size() >=1) {
+                //const Byte *data = (const Byte *)coder.Props;
+                //Byte firstByte = *data++;
+                //UInt32 numCyclesPower = firstByte & 0x3F;
             }
-
-            if (coder->methodID == k_BCJ2) {
-                continue;
+            break;
+        case k_BCJ:
+            filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::Xz);
+            if (!filter) {
+                qDebug() << "filter not found";
+                return false;
             }
-
+            static_cast<KXzFilter*>(filter)->init(QIODevice::ReadOnly, KXzFilter::BCJ, coder->properties);
+            break;
+        case k_BCJ2:
+        {
+            QByteArray bcj2 = decodeBCJ2(inflatedDatas[0], inflatedDatas[1], inflatedDatas[2], deflatedData);
+            inflatedDatas.clear();
+            inflatedDatas.append(bcj2);
+            break;
+        }
+        case k_BZip2:
+            filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::BZip2);
             if (!filter) {
-                return QByteArray();
+                qDebug() << "filter not found";
+                return false;
             }
+            filter->init(QIODevice::ReadOnly);
+            break;
+        }
 
-            filter->setInBuffer(deflatedData.data(), deflatedData.size());
+        if (coder->methodID == k_BCJ2) {
+            continue;
+        }
 
-            QByteArray outBuffer;
-            // reserve memory
-            outBuffer.resize(unpackSize);
+        if (!filter) {
+            return false;
+        }
 
-            KFilterBase::Result result = KFilterBase::Ok;
-            QByteArray inflatedDataTmp;
-            while (result != KFilterBase::End && result != KFilterBase::Error && !filter->inBufferEmpty()) {
-                filter->setOutBuffer(outBuffer.data(), outBuffer.size());
-                result = filter->uncompress();
-                if (result == KFilterBase::Error) {
-                    qDebug() << " decode error";
-                    return QByteArray();
-                }
-                int uncompressedBytes = outBuffer.size() - filter->outBufferAvailable();
+        filter->setInBuffer(deflatedData.data(), deflatedData.size());
 
-                // append the uncompressed data to inflate buffer
-                inflatedDataTmp.append(outBuffer.data(), uncompressedBytes);
+        QByteArray outBuffer;
+        // reserve memory
+        outBuffer.resize(unpackSize);
 
-                if (result == KFilterBase::End) {
-                    //qDebug() << "Finished unpacking";
-                    break; // Finished.
-                }
+        KFilterBase::Result result = KFilterBase::Ok;
+        QByteArray inflatedDataTmp;
+        while (result != KFilterBase::End && result != KFilterBase::Error && !filter->inBufferEmpty()) {
+            filter->setOutBuffer(outBuffer.data(), outBuffer.size());
+            result = filter->uncompress();
+            if (result == KFilterBase::Error) {
+                qDebug() << " decode error";
+                return false;
             }
+            int uncompressedBytes = outBuffer.size() - filter->outBufferAvailable();
 
-            if (result != KFilterBase::End && !filter->inBufferEmpty()) {
-                qDebug() << "decode failed result" << result;
-                delete filter;
-                return QByteArray();
+            // append the uncompressed data to inflate buffer
+            inflatedDataTmp.append(outBuffer.data(), uncompressedBytes);
+
+            if (result == KFilterBase::End) {
+                //qDebug() << "Finished unpacking";
+                break; // Finished.
             }
+        }
 
-            filter->terminate();
+        if (result != KFilterBase::End && !filter->inBufferEmpty()) {
+            qDebug() << "decode failed result" << result;
             delete filter;
+            return false;
+        }
+
+        filter->terminate();
+        delete filter;
+
+        inflatedDatas.append(inflatedDataTmp);
+    }
+
+    inflated.clear();
+    Q_FOREACH (QByteArray data, inflatedDatas) {
+        inflated.append(data);
+    }
 
-            inflatedDatas.append(inflatedDataTmp);
+    inflatedDatas.clear();
+
+    if (folder->unpackCRCDefined) {
+        quint32 crc = crc32(0, (Bytef*)(inflated.data()), unpackSize);
+        if (crc != folder->unpackCRC) {
+            qDebug() << "wrong crc";
+            return false;
         }
+    }
 
-        QByteArray inflated;
-        Q_FOREACH (QByteArray data, inflatedDatas) {
-            inflated.append(data);
+    return true;
+}
+
+bool SevenZipHandler::SevenZipHandlerPrivate::decodeFolders(int first, int count, QVector<QByteArray>& inflated)
+{
+    for (int i = first; i < first + count; ++i) {
+        QVector<QByteArray> datas;
+        QByteArray output;
+        if (!readPackStreams(i, datas) || !decodeFolder(folders[i], datas, output)) {
+            return false;
         }
+        inflated.append(output);
+    }
+    return true;
+}
 
-        inflatedDatas.clear();
+void SevenZipHandler::SevenZipHandlerPrivate::addDecodedFolder(int folderIndex, const QByteArray& inflated)
+{
+    decodedFolders.insert(folderIndex, inflated);
+    decodedOrder.append(folderIndex);
+    decodedSize += inflated.size();
+    // Drop the least recently used folders, but always keep the new one
+    while (decodedSize > max_decoded_folders_size && decodedOrder.size() > 1) {
+        decodedSize -= decodedFolders.take(decodedOrder.takeFirst()).size();
+    }
+}
+
+QIODevice* SevenZipHandler::createEntryDevice(int folderIndex, qint64 position, qint64 size)
+{
+    // Data written in this session went straight to the encoder
+    if (folderIndex < 0 || folderIndex >= d->folders.size()) {
+        return 0;
+    }
+    const qint64 offset = position - d->folderStarts[folderIndex];
+
+    // A folder made of a single coder reading a single pack stream is
+    // decompressed on the fly, straight from the archive. Entries being
+    // mostly read in order, the decoder of the previous entry carries on.
+    const Folder* folder = d->folders[folderIndex];
+    if (folder->folderInfos.size() == 1 && folder->packedStreams.size() == 1) {
+        KCompressionDevice* dev = d->decoders.take(folderIndex, offset);
+        if (dev) {
+            return new SevenZipEntryDevice(dev, offset, size, &d->decoders, folderIndex);
+        }
+
+        const Folder::FolderInfo* coder = folder->folderInfos[0];
+        const int packIndex = d->firstPackStreamIndex(folderIndex);
+        switch (coder->methodID) {
+        case k_LZMA:
+        case k_LZMA2:
+            dev = new KCompressionDevice(new KLimitedIODevice(device(), d->packStreamOffset(packIndex), d->packSizes[packIndex]),
+                                         true, KCompressionDevice::Xz);
+            break;
+        case k_BZip2:
+            dev = new KCompressionDevice(new KLimitedIODevice(device(), d->packStreamOffset(packIndex), d->packSizes[packIndex]),
+                                         true, KCompressionDevice::BZip2);
+            break;
+        }
 
-        if (folder->unpackCRCDefined) {
-            quint32 crc = crc32(0, (Bytef*)(inflated.data()), unpackSize);
-            if (crc != folder->unpackCRC) {
-                qDebug() << "wrong crc";
-                return QByteArray();
+        if (dev) {
+            if (!dev->open(QIODevice::ReadOnly)) {
+                delete dev;
+                return 0;
             }
+            // 7z stores raw streams, replace the default .xz setup; reset() keeps it
+            if (coder->methodID == k_LZMA || coder->methodID == k_LZMA2) {
+                const KXzFilter::Flag flag = coder->methodID == k_LZMA ? KXzFilter::LZMA : KXzFilter::LZMA2;
+                if (!static_cast<KXzFilter*>(dev->filterBase())->init(QIODevice::ReadOnly, flag, coder->properties)) {
+                    delete dev;
+                    return 0;
+                }
+            }
+            return new SevenZipEntryDevice(dev, offset, size, &d->decoders, folderIndex);
         }
+    }
 
-        inflatedData.append(inflated);
+    // Otherwise the folder is decoded in one go and kept around, as files
+    // are usually read one after another. The decoding happens outside of
+    // the lock, so that extracting with several workers decodes several
+    // folders at once.
+    QByteArray inflated;
+    bool decoded = false;
+    {
+        QMutexLocker locker(&d->folderMutex);
+        while (d->decodingFolders.contains(folderIndex)) {
+            d->folderDecoded.wait(&d->folderMutex);
+        }
+        QMap<int, QByteArray>::const_iterator it = d->decodedFolders.constFind(folderIndex);
+        if (it != d->decodedFolders.constEnd()) {
+            inflated = it.value();
+            decoded = true;
+            d->decodedOrder.removeOne(folderIndex);
+            d->decodedOrder.append(folderIndex);
+        } else {
+            d->decodingFolders.insert(folderIndex);
+        }
     }
 
-    return inflatedData;
+    if (!decoded) {
+        QVector<QByteArray> datas;
+        const bool ok = d->readPackStreams(folderIndex, datas) && decodeFolder(folder, datas, inflated);
+
+        QMutexLocker locker(&d->folderMutex);
+        d->decodingFolders.remove(folderIndex);
+        if (ok) {
+            d->addDecodedFolder(folderIndex, inflated);
+        }
+        d->folderDecoded.wakeAll();
+        if (!ok) {
+            return 0;
+        }
+    }
+
+    QBuffer* buffer = new QBuffer;
+    buffer->setData(inflated);
+    buffer->open(QIODevice::ReadOnly);
+    return new SevenZipEntryDevice(buffer, offset, size);
 }
 
 ///////////////// Write ////////////////////
 
-static int sizeItems = 0;
-void K7Zip::K7ZipPrivate::createItemsFromEntities(const KArchiveDirectory * dir, const QString & path, QByteArray& data)
+bool SevenZipHandler::SevenZipHandlerPrivate::startStream()
+{
+    // Files never span folders, so new ones only start between files
+    if (m_solidBlockSize > 0 && m_streamSize - m_folderStart >= (quint64)m_solidBlockSize) {
+        return finishFolder();
+    }
+    return true;
+}
+
+bool SevenZipHandler::SevenZipHandlerPrivate::writeStream(const char* data, qint64 size)
+{
+    const bool parallel = m_solidBlockSize > 0 && m_workerCount > 1;
+    if (parallel && !m_encoder && m_folderData.size() + size <= max_parallel_folder_size) {
+        m_folderData.append(data, size);
+    } else {
+        if (!m_encoder) {
+            // Keep the folders in order
+            if (!flushJobs(0)) {
+                return false;
+            }
+            m_encoder = new KCompressionDevice(q->device(), false, KCompressionDevice::Xz);
+            if (!m_encoder->open(QIODevice::WriteOnly)) {
+                delete m_encoder;
+                m_encoder = 0;
+                return false;
+            }
+            KFilterBase* filter = m_encoder->filterBase();
+            static_cast<KXzFilter*>(filter)->init(QIODevice::WriteOnly, KXzFilter::LZMA2, QVector<unsigned char>());
+            m_encoderStart = q->device()->pos();
+            if (!m_folderData.isEmpty()) {
+                const QByteArray folderData = m_folderData;
+                m_folderData.clear();
+                if (m_encoder->write(folderData) != folderData.size()) {
+                    qDebug() << "write error";
+                    return false;
+                }
+            }
+        }
+
+        if (m_encoder->write(data, size) != size) {
+            qDebug() << "write error";
+            return false;
+        }
+    }
+    m_folderCrc = crc32(m_folderCrc, (const Bytef*)data, size);
+    m_streamSize += size;
+    return true;
+}
+
+bool SevenZipHandler::SevenZipHandlerPrivate::finishFolder()
+{
+    const quint64 unpackSize = m_streamSize - m_folderStart;
+    if (unpackSize == 0) {
+        return true;
+    }
+
+    m_writtenFolders.append(createLzma2Folder(unpackSize, m_folderCrc));
+    m_writtenStreams.append(m_folderStreams);
+    m_folderStart = m_streamSize;
+    m_folderCrc = 0;
+    m_folderStreams = 0;
+
+    if (m_encoder) {
+        m_encoder->close();
+        delete m_encoder;
+        m_encoder = 0;
+        m_writtenPackSizes.append(q->device()->pos() - m_encoderStart);
+        return true;
+    }
+
+    SevenZipEncodeJob* job = new SevenZipEncodeJob;
+    job->input = m_folderData;
+    m_folderData.clear();
+    m_pending.append(job);
+    m_pool.start(job);
+    return flushJobs(2 * m_workerCount);
+}
+
+bool SevenZipHandler::SevenZipHandlerPrivate::flushJobs(int maxPending)
+{
+    while (m_pending.size() > maxPending) {
+        SevenZipEncodeJob* job = m_pending.takeFirst();
+        job->done.acquire();
+        const bool ok = job->ok && q->device()->write(job->output) == job->output.size();
+        m_writtenPackSizes.append(job->output.size());
+        delete job;
+        if (!ok) {
+            qDebug() << "write error";
+            return false;
+        }
+    }
+    return true;
+}
+
+Folder* SevenZipHandler::SevenZipHandlerPrivate::createLzma2Folder(quint64 unpackSize, quint32 unpackCRC) const
+{
+    Folder *folder = new Folder();
+    folder->unpackSizes.append(unpackSize);
+
+    Folder::FolderInfo *info = new Folder::FolderInfo();
+
+    info->numInStreams = 1;
+    info->numOutStreams = 1;
+    info->methodID = k_LZMA2;
+
+    // The encoder never looks further back than the data it got
+    quint32 dictSize = qMin<quint64>(unpackSize, k_lzma2DictSize);
+
+    const quint32 kMinReduceSize = (1 << 16);
+    if (dictSize < kMinReduceSize) {
+        dictSize = kMinReduceSize;
+    }
+
+    // k_LZMA2 mehtod
+    int dict;
+    for (dict = 0; dict < 40; dict++) {
+        if (dictSize <= LZMA2_DIC_SIZE_FROM_PROP(dict)) {
+            break;
+        }
+    }
+    info->properties.append(dict);
+
+    folder->folderInfos.append(info);
+    folder->unpackCRCDefined = true;
+    folder->unpackCRC = unpackCRC;
+    return folder;
+}
+
+void SevenZipHandler::SevenZipHandlerPrivate::createItemsFromEntities(const KArchiveDirectory * dir, const QString & path,
+                                                  QMap<qint64, QPair<FileInfo*, quint64> >& streamFiles)
 {
     QStringList l = dir->entries();
     QStringList::ConstIterator it = l.constBegin();
@@ -1660,27 +2187,28 @@ void K7Zip::K7ZipPrivate::createItemsFromEntities(const KArchiveDirectory * dir,
         fileInfo->attribDefined = true;
 
         fileInfo->path = path + entry->name();
-        mTimesDefined.append(true);
-        mTimes.append(rtlSecondsSince1970ToSpecTime(entry->date()));
+        const quint64 mTime = rtlSecondsSince1970ToSpecTime(entry->date());
 
         if (entry->isFile()) {
-            const K7ZipFileEntry* fileEntry = static_cast<const K7ZipFileEntry*>(entry);
+            const SevenZipHandlerFileEntry* fileEntry = static_cast<const SevenZipHandlerFileEntry*>(entry);
 
             fileInfo->attributes = FILE_ATTRIBUTE_ARCHIVE;
             fileInfo->attributes |= FILE_ATTRIBUTE_UNIX_EXTENSION + ((entry->permissions() & 0xFFFF) << 16);
             fileInfo->size = fileEntry->size();
-            sizeItems += fileInfo->size;
             QString symLink = fileEntry->symLinkTarget();
+            if (!symLink.isEmpty()) {
+                fileInfo->size = QFile::encodeName(symLink).size();
+            }
             if (fileInfo->size > 0) {
                 fileInfo->hasStream = true;
-                data.append(outData.mid(fileEntry->position(), fileEntry->size()));
-                unpackSizes.append(fileInfo->size);
-            } else if (!symLink.isEmpty()) {
-                fileInfo->hasStream = true;
-                data.append(symLink.toUtf8());
-                unpackSizes.append(symLink.size());
+                fileInfo->crc = fileEntry->crc();
+                fileInfo->crcDefined = true;
+                streamFiles.insert(fileEntry->position(), qMakePair(fileInfo, mTime));
+            } else {
+                fileInfos.append(fileInfo);
+                mTimesDefined.append(true);
+                mTimes.append(mTime);
             }
-            fileInfos.append(fileInfo);
         }
 
         if (entry->isDirectory()) {
@@ -1688,19 +2216,21 @@ void K7Zip::K7ZipPrivate::createItemsFromEntities(const KArchiveDirectory * dir,
             fileInfo->attributes |= FILE_ATTRIBUTE_UNIX_EXTENSION + ((entry->permissions() & 0xFFFF) << 16);
             fileInfo->isDir = true;
             fileInfos.append(fileInfo);
-            createItemsFromEntities( (KArchiveDirectory *)entry, path+(*it)+QLatin1Char('/'), data);
+            mTimesDefined.append(true);
+            mTimes.append(mTime);
+            createItemsFromEntities( (KArchiveDirectory *)entry, path+(*it)+QLatin1Char('/'), streamFiles);
 
         }
     }
 }
 
-void K7Zip::K7ZipPrivate::writeByte(unsigned char b)
+void SevenZipHandler::SevenZipHandlerPrivate::writeByte(unsigned char b)
 {
     header.append(b);
     countSize++;
 }
 
-void K7Zip::K7ZipPrivate::writeNumber(quint64 value)
+void SevenZipHandler::SevenZipHandlerPrivate::writeNumber(quint64 value)
 {
     int firstByte = 0;
     short mask = 0x80;
@@ -1723,7 +2253,7 @@ void K7Zip::K7ZipPrivate::writeNumber(quint64 value)
     }
 }
 
-void K7Zip::K7ZipPrivate::writeBoolVector(const QVector<bool> &boolVector)
+void SevenZipHandler::SevenZipHandlerPrivate::writeBoolVector(const QVector<bool> &boolVector)
 {
     int b = 0;
     short mask = 0x80;
@@ -1742,7 +2272,7 @@ void K7Zip::K7ZipPrivate::writeBoolVector(const QVector<bool> &boolVector)
         writeByte(b);
 }
 
-void K7Zip::K7ZipPrivate::writeUInt32(quint32 value)
+void SevenZipHandler::SevenZipHandlerPrivate::writeUInt32(quint32 value)
 {
     for (int i = 0; i < 4; i++)
     {
@@ -1751,7 +2281,7 @@ void K7Zip::K7ZipPrivate::writeUInt32(quint32 value)
     }
 }
 
-void K7Zip::K7ZipPrivate::writeUInt64(quint64 value)
+void SevenZipHandler::SevenZipHandlerPrivate::writeUInt64(quint64 value)
 {
     for (int i = 0; i < 8; i++) {
         writeByte((unsigned char)value);
@@ -1759,7 +2289,7 @@ void K7Zip::K7ZipPrivate::writeUInt64(quint64 value)
     }
 }
 
-void K7Zip::K7ZipPrivate::writeAlignedBoolHeader(const QVector<bool> &v, int numDefined, int type, unsigned itemSize)
+void SevenZipHandler::SevenZipHandlerPrivate::writeAlignedBoolHeader(const QVector<bool> &v, int numDefined, int type, unsigned itemSize)
 {
     const unsigned bvSize = (numDefined == v.size()) ? 0 : ((unsigned)v.size() + 7) / 8;
     const quint64 dataSize = (quint64)numDefined * itemSize + bvSize + 2;
@@ -1776,7 +2306,7 @@ void K7Zip::K7ZipPrivate::writeAlignedBoolHeader(const QVector<bool> &v, int num
     writeByte(0);
 }
 
-void K7Zip::K7ZipPrivate::writeUInt64DefVector(const QVector<quint64> &v, const QVector<bool> defined, int type)
+void SevenZipHandler::SevenZipHandlerPrivate::writeUInt64DefVector(const QVector<quint64> &v, const QVector<bool> defined, int type)
 {
     int numDefined = 0;
 
@@ -1798,7 +2328,7 @@ void K7Zip::K7ZipPrivate::writeUInt64DefVector(const QVector<quint64> &v, const
     }
 }
 
-void K7Zip::K7ZipPrivate::writeHashDigests(
+void SevenZipHandler::SevenZipHandlerPrivate::writeHashDigests(
     const QVector<bool> &digestsDefined,
     const QVector<quint32> &digests)
 {
@@ -1829,7 +2359,7 @@ void K7Zip::K7ZipPrivate::writeHashDigests(
     }
 }
 
-void K7Zip::K7ZipPrivate::writePackInfo(quint64 dataOffset, QVector<quint64> &packedSizes, QVector<bool> &packedCRCsDefined, QVector<quint32> &packedCRCs)
+void SevenZipHandler::SevenZipHandlerPrivate::writePackInfo(quint64 dataOffset, QVector<quint64> &packedSizes, QVector<bool> &packedCRCsDefined, QVector<quint32> &packedCRCs)
 {
     if (packedSizes.isEmpty())
         return;
@@ -1847,7 +2377,7 @@ void K7Zip::K7ZipPrivate::writePackInfo(quint64 dataOffset, QVector<quint64> &pa
     writeByte(kEnd);
 }
 
-void K7Zip::K7ZipPrivate::writeFolder(const Folder *folder)
+void SevenZipHandler::SevenZipHandlerPrivate::writeFolder(const Folder *folder)
 {
     writeNumber(folder->folderInfos.size());
     for (int i = 0; i < folder->folderInfos.size(); i++) {
@@ -1906,7 +2436,7 @@ void K7Zip::K7ZipPrivate::writeFolder(const Folder *folder)
     }
 }
 
-void K7Zip::K7ZipPrivate::writeUnpackInfo(QVector<Folder*> &folderItems)
+void SevenZipHandler::SevenZipHandlerPrivate::writeUnpackInfo(QVector<Folder*> &folderItems)
 {
     if (folderItems.isEmpty())
         return;
@@ -1943,7 +2473,7 @@ void K7Zip::K7ZipPrivate::writeUnpackInfo(QVector<Folder*> &folderItems)
     writeByte(kEnd);
 }
 
-void K7Zip::K7ZipPrivate::writeSubStreamsInfo(
+void SevenZipHandler::SevenZipHandlerPrivate::writeSubStreamsInfo(
     const QVector<quint64> &unpackSizes,
     const QVector<bool> &digestsDefined,
     const QVector<quint32> &digests)
@@ -1997,7 +2527,7 @@ void K7Zip::K7ZipPrivate::writeSubStreamsInfo(
     writeByte(kEnd);
 }
 
-QByteArray K7Zip::K7ZipPrivate::encodeStream(QVector<quint64> &packSizes, QVector<Folder*> &folds)
+QByteArray SevenZipHandler::SevenZipHandlerPrivate::encodeStream(QVector<quint64> &packSizes, QVector<Folder*> &folds)
 {
     Folder *folder = new Folder;
     folder->unpackCRCDefined = true;
@@ -2055,7 +2585,7 @@ QByteArray K7Zip::K7ZipPrivate::encodeStream(QVector<quint64> &packSizes, QVecto
 }
 
 
-void K7Zip::K7ZipPrivate::writeHeader(quint64 &headerOffset)
+void SevenZipHandler::SevenZipHandlerPrivate::writeHeader(quint64 &headerOffset)
 {
     quint64 packedSize = 0;
     for (int i=0; i < packSizes.size(); ++i) {
@@ -2230,7 +2760,7 @@ static void setUInt64(unsigned char *p, quint64 d)
     }
 }
 
-void K7Zip::K7ZipPrivate::writeStartHeader(const quint64 nextHeaderSize, const quint32 nextHeaderCRC, const quint64 nextHeaderOffset)
+void SevenZipHandler::SevenZipHandlerPrivate::writeStartHeader(const quint64 nextHeaderSize, const quint32 nextHeaderCRC, const quint64 nextHeaderOffset)
 {
     unsigned char buf[24];
     setUInt64(buf + 4, nextHeaderOffset);
@@ -2240,7 +2770,7 @@ void K7Zip::K7ZipPrivate::writeStartHeader(const quint64 nextHeaderSize, const q
     q->device()->write((char*)buf, 24);
 }
 
-void K7Zip::K7ZipPrivate::writeSignature()
+void SevenZipHandler::SevenZipHandlerPrivate::writeSignature()
 {
     unsigned char buf[8];
     memcpy(buf, k7zip_signature, 6);
@@ -2249,16 +2779,22 @@ void K7Zip::K7ZipPrivate::writeSignature()
     q->device()->write((char*)buf, 8);
 }
 
-bool K7Zip::openArchive( QIODevice::OpenMode mode )
+bool SevenZipHandler::openArchive( QIODevice::OpenMode mode )
 {
-    if ( !(mode & QIODevice::ReadOnly) )
-        return true;
+    if ( !(mode & QIODevice::ReadOnly) ) {
+        // Room for the start header, written once the archive is complete
+        const QByteArray startHeader(32, '\0');
+        return device()->write(startHeader) == startHeader.size();
+    }
 
     QIODevice* dev = device();
 
     if ( !dev )
         return false;
 
+    // The handler may have been used on another archive before
+    d->clear();
+
     char header[32];
     // check signature
     qint64 n = dev->read( header, 32 );
@@ -2572,9 +3108,16 @@ bool K7Zip::openArchive( QIODevice::OpenMode mode )
         }
     }
 
-    d->outData = d->readAndDecodePackedStreams(false);
-
-    int oldPos = 0;
+    // Files with data are laid out one after another in the folders,
+    // which only get decoded when an entry is read. Their position counts
+    // from the start of the first folder, so that sorting entries by
+    // position sorts them by folder too.
+    d->setFolderStarts();
+    // Only list the entries in the table if asked to
+    const bool deferred = deferredEntries() && mode == QIODevice::ReadOnly;
+    int folderIndex = 0;
+    quint64 folderStreamsLeft = d->numUnpackStreamsInFolders.value(0);
+    qint64 folderPos = 0;
     for (int i = 0; i < numFiles; i++)
     {
         FileInfo* fileInfo = d->fileInfos[i];
@@ -2648,9 +3191,20 @@ bool K7Zip::openArchive( QIODevice::OpenMode mode )
         }
 
         qint64 pos = 0;
-        if (!fileInfo->isDir) {
-            pos = oldPos;
-            oldPos += fileInfo->size;
+        int folder = -1;
+        if (fileInfo->hasStream) {
+            while (folderStreamsLeft == 0 && folderIndex + 1 < d->numUnpackStreamsInFolders.size()) {
+                folderStreamsLeft = d->numUnpackStreamsInFolders[++folderIndex];
+                folderPos = 0;
+            }
+            if (folderStreamsLeft == 0) {
+                qDebug() << "more files with data than streams";
+                return false;
+            }
+            folder = folderIndex;
+            pos = d->folderStarts[folderIndex] + folderPos;
+            folderPos += fileInfo->size;
+            folderStreamsLeft--;
         }
 
         KArchiveEntry* e;
@@ -2670,20 +3224,42 @@ bool K7Zip::openArchive( QIODevice::OpenMode mode )
             mTime = time(NULL);
         }
 
+        // The target of a link is stored as its data
+        QString target;
+        if (symlink) {
+            QIODevice* dev = createEntryDevice(folder, pos, fileInfo->size);
+            if (dev) {
+                target = QFile::decodeName(dev->readAll());
+                delete dev;
+            }
+        }
+
+        if (deferred) {
+            // Unknown owners get the one of the root dir once created from
+            // the table, see createFileEntry() for the folder of the files
+            const int entryMode = fileInfo->isDir ? (access | S_IFDIR) : access;
+            if (!entryTable().append(QDir::cleanPath(fileInfo->path), entryMode, mTime,
+                                     symlink ? 0 : pos, symlink ? 0 : fileInfo->size,
+                                     QString(), QString(), target)) {
+                //qWarning() << "too many entries in" << fileName();
+                return false;
+            }
+            continue;
+        }
+
         if (fileInfo->isDir) {
             QString path = QDir::cleanPath( fileInfo->path );
             const KArchiveEntry* ent = rootDir()->entry( path );
             if ( ent && ent->isDirectory() ) {
                 e = 0;
             } else {
-                e = new KArchiveDirectory( this, entryName, access, mTime, rootDir()->user(), rootDir()->group(), QString()/*symlink*/ );
+                e = new ( archive() ) KArchiveDirectory( archive(), entryName, access, mTime, rootDir()->user(), rootDir()->group(), QString()/*symlink*/ );
             }
         } else {
             if (!symlink) {
-                e = new K7ZipFileEntry( this, entryName, access, mTime, rootDir()->user(), rootDir()->group(), QString()/*symlink*/, pos, fileInfo->size, d->outData );
+                e = new ( archive() ) SevenZipHandlerFileEntry( archive(), entryName, access, mTime, rootDir()->user(), rootDir()->group(), QString()/*symlink*/, pos, fileInfo->size, folder );
             } else {
-                QString target = QFile::decodeName(d->outData.mid(pos, fileInfo->size));
-                e = new K7ZipFileEntry( this, entryName, access, mTime, rootDir()->user(), rootDir()->group(), target, 0, 0, 0 );
+                e = new ( archive() ) SevenZipHandlerFileEntry( archive(), entryName, access, mTime, rootDir()->user(), rootDir()->group(), target, 0, 0, -1 );
             }
         }
 
@@ -2692,8 +3268,8 @@ bool K7Zip::openArchive( QIODevice::OpenMode mode )
                 rootDir()->addEntry( e );
             } else {
                 QString path = QDir::cleanPath( fileInfo->path.left( index ) );
-                KArchiveDirectory * d = findOrCreate( path );
-                d->addEntry( e );
+                KArchiveDirectory * dir = findOrCreate( path );
+                dir->addEntry( e );
             }
         }
     }
@@ -2701,7 +3277,7 @@ bool K7Zip::openArchive( QIODevice::OpenMode mode )
     return true;
 }
 
-bool K7Zip::closeArchive()
+bool SevenZipHandler::closeArchive()
 {
     if ( !isOpen() )
     {
@@ -2711,81 +3287,41 @@ bool K7Zip::closeArchive()
 
     if ((mode() == QIODevice::ReadOnly))
     {
+        // The decoders read from the device, which is about to be closed
+        d->clear();
         return true;
     }
 
-    d->clear();
-
-    Folder *folder = new Folder();
-
-    folder->unpackSizes.clear();
-    folder->unpackSizes.append(d->outData.size());
-
-    Folder::FolderInfo *info = new Folder::FolderInfo();
-
-    info->numInStreams = 1;
-    info->numOutStreams = 1;
-    info->methodID = k_LZMA2;
-
-    quint32 dictSize = d->outData.size();
-
-    const quint32 kMinReduceSize = (1 << 16);
-    if (dictSize < kMinReduceSize) {
-        dictSize = kMinReduceSize;
-    }
-
-    // k_LZMA2 mehtod
-    int dict;
-    for (dict = 0; dict < 40; dict++) {
-        if (dictSize <= LZMA2_DIC_SIZE_FROM_PROP(dict)) {
-            break;
-        }
+    // Flush the folders, their data follows the start header
+    if (!d->finishFolder() || !d->flushJobs(0)) {
+        return false;
     }
-    info->properties.append(dict);
-
-    folder->folderInfos.append(info);
-    d->folders.append(folder);
-
-    const KArchiveDirectory* dir = directory();
-    QByteArray data;
-    d->createItemsFromEntities(dir, QString(), data);
-    d->outData = data;
-
-    folder->unpackCRCDefined = true;
-    folder->unpackCRC = crc32(0, (Bytef*)(d->outData.data()), d->outData.size());
-
-    //compress data
-    QByteArray encodedData;
-    if (d->outData.size() > 0) {
-        QByteArray enc;
-        QBuffer inBuffer(&enc);
-
-        KCompressionDevice flt(&inBuffer, false, KCompressionDevice::Xz);
-        flt.open(QIODevice::WriteOnly);
-
-        KFilterBase* filter = flt.filterBase();
-
-        static_cast<KXzFilter*>(filter)->init(QIODevice::WriteOnly, KXzFilter::LZMA2, info->properties);
-
-        const int ret = flt.write(d->outData);
-        if (ret != d->outData.size()) {
-            qDebug() << "write error";
-            return false;
-        }
-
-        flt.close();
-        encodedData = inBuffer.data();
+    quint64 packSize = 0;
+    for (int i = 0; i < d->m_writtenPackSizes.size(); ++i) {
+        packSize += d->m_writtenPackSizes[i];
     }
 
-    d->packSizes.append(encodedData.size());
+    d->clear();
 
-    int numUnpackStream = 0;
-    for (int i = 0; i < d->fileInfos.size(); ++i) {
-        if (d->fileInfos[i]->hasStream) {
-            numUnpackStream++;
-        }
+    d->folders = d->m_writtenFolders;
+    d->packSizes = d->m_writtenPackSizes;
+    d->numUnpackStreamsInFolders = d->m_writtenStreams;
+    d->m_writtenFolders.clear();
+    d->m_writtenPackSizes.clear();
+    d->m_writtenStreams.clear();
+    d->m_streamSize = 0;
+    d->m_folderStart = 0;
+
+    // Files with data go last, in the order their data went to the folders
+    QMap<qint64, QPair<FileInfo*, quint64> > streamFiles;
+    d->createItemsFromEntities(rootDir(), QString(), streamFiles);
+    QMap<qint64, QPair<FileInfo*, quint64> >::const_iterator it = streamFiles.constBegin();
+    for ( ; it != streamFiles.constEnd(); ++it ) {
+        d->fileInfos.append(it.value().first);
+        d->mTimesDefined.append(true);
+        d->mTimes.append(it.value().second);
+        d->unpackSizes.append(it.value().first->size);
     }
-    d->numUnpackStreamsInFolders.append(numUnpackStream);
 
     quint64 headerOffset;
     d->writeHeader(headerOffset);
@@ -2819,41 +3355,45 @@ bool K7Zip::closeArchive()
     quint32 nextHeaderCRC = crc32(0, (Bytef*)(d->header.data()), d->header.size());
     quint64 nextHeaderOffset = headerOffset;
 
+    device()->seek(32 + packSize);
+    device()->write(encodedStream.data(), encodedStream.size());
+    device()->write(d->header.data(), d->header.size());
     device()->seek(0);
     d->writeSignature();
     d->writeStartHeader(nextHeaderSize, nextHeaderCRC, nextHeaderOffset);
-    device()->write(encodedData.data(), encodedData.size());
-    device()->write(encodedStream.data(), encodedStream.size());
-    device()->write(d->header.data(), d->header.size());
 
     return true;
 }
 
-bool K7Zip::doFinishWriting( qint64 size ) {
+bool SevenZipHandler::doFinishWriting( qint64 size ) {
 
+    if (!d->m_currentFile) {
+        return false;
+    }
     d->m_currentFile->setSize(size);
+    if (size > 0) {
+        d->m_folderStreams++;
+    }
     d->m_currentFile = 0L;
 
     return true;
 }
 
-bool K7Zip::writeData(const char * data, qint64 size)
+bool SevenZipHandler::writeData(const char * data, qint64 size)
 {
     if (!d->m_currentFile) {
         return false;
     }
 
-    if (d->m_currentFile->position() == d->outData.size()) {
-        d->outData.append(data, size);
-    } else {
-        d->outData.remove(d->m_currentFile->position(), d->m_currentFile->size());
-        d->outData.insert(d->m_currentFile->position(), data, size);
+    if (!d->writeStream(data, size)) {
+        return false;
     }
+    d->m_currentFile->setCrc(crc32(d->m_currentFile->crc(), (const Bytef*)data, size));
 
     return true;
 }
 
-bool K7Zip::doPrepareWriting(const QString &name, const QString &user,
+bool SevenZipHandler::doPrepareWriting(const QString &name, const QString &user,
                           const QString &group, qint64 /*size*/, mode_t perm,
                           time_t /*atime*/, time_t mtime, time_t /*ctime*/)
 {
@@ -2881,22 +3421,27 @@ bool K7Zip::doPrepareWriting(const QString &name, const QString &user,
         parentDir = findOrCreate( dir );
     }
 
-    // test if the entry already exist
-    const KArchiveEntry* entry = parentDir->entry(fileName);
-    if (!entry) {
-        K7ZipFileEntry* e = new K7ZipFileEntry( this, fileName, perm, mtime, user, group, QString()/*symlink*/, d->outData.size(), 0 /*unknown yet*/, d->outData );
-        parentDir->addEntry( e );
-        d->m_entryList << e;
-        d->m_currentFile = e;
-    } else {
-        // TODO : find and replace in m_entryList
-        //d->m_currentFile = static_cast<K7ZipFileEntry*>(entry);
+    // The data of a file can't be taken out of its folder once written,
+    // as all the data in a folder must belong to a file: unlike ZipHandler,
+    // writing the same file twice is refused
+    if (parentDir->entry(fileName)) {
+        //qWarning() << name << "was already written";
+        return false;
+    }
+
+    if (!d->startStream()) {
+        return false;
     }
 
+    SevenZipHandlerFileEntry* e = new SevenZipHandlerFileEntry( archive(), fileName, perm, mtime, user, group, QString()/*symlink*/, d->m_streamSize, 0 /*unknown yet*/, -1 );
+    parentDir->addEntry( e );
+    d->m_entryList << e;
+    d->m_currentFile = e;
+
     return true;
 }
 
-bool K7Zip::doWriteDir(const QString &name, const QString &user,
+bool SevenZipHandler::doWriteDir(const QString &name, const QString &user,
                       const QString &group, mode_t perm,
                       time_t /*atime*/, time_t mtime, time_t /*ctime*/)
 {
@@ -2927,13 +3472,13 @@ bool K7Zip::doWriteDir(const QString &name, const QString &user,
         parentDir = findOrCreate( dir );
     }
 
-    KArchiveDirectory* e = new KArchiveDirectory( this, dirName, perm, mtime, user, group, QString()/*symlink*/ );
+    KArchiveDirectory* e = new KArchiveDirectory( archive(), dirName, perm, mtime, user, group, QString()/*symlink*/ );
     parentDir->addEntry( e );
 
     return true;
 }
 
-bool K7Zip::doWriteSymLink(const QString &name, const QString &target,
+bool SevenZipHandler::doWriteSymLink(const QString &name, const QString &target,
                         const QString &user, const QString &group,
                         mode_t perm, time_t /*atime*/, time_t mtime, time_t /*ctime*/)
 {
@@ -2961,8 +3506,20 @@ bool K7Zip::doWriteSymLink(const QString &name, const QString &target,
     }
     QByteArray encodedTarget = QFile::encodeName(target);
 
-    K7ZipFileEntry* e = new K7ZipFileEntry( this, fileName, perm, mtime, user, group, target, 0, 0, 0 );
-    d->outData.append(encodedTarget);
+    if (!d->startStream()) {
+        return false;
+    }
+
+    // The target is stored as the content of the link
+    SevenZipHandlerFileEntry* e = new SevenZipHandlerFileEntry( archive(), fileName, perm, mtime, user, group, target, d->m_streamSize, 0, -1 );
+    if (!encodedTarget.isEmpty()) {
+        if (!d->writeStream(encodedTarget.constData(), encodedTarget.size())) {
+            delete e;
+            return false;
+        }
+        e->setCrc(crc32(0, (const Bytef*)encodedTarget.constData(), encodedTarget.size()));
+        d->m_folderStreams++;
+    }
 
     parentDir->addEntry( e );
     d->m_entryList << e;
@@ -2970,6 +3527,101 @@ bool K7Zip::doWriteSymLink(const QString &name, const QString &target,
     return true;
 }
 
-void K7Zip::virtual_hook( int id, void* data ) {
-    KArchive::virtual_hook( id, data );
+bool SevenZipHandler::supportsIndex() const
+{
+    // Reading sets up the folders besides the entries
+    return true;
+}
+
+void SevenZipHandler::saveIndexData( QDataStream &stream ) const
+{
+    // All createEntryDevice() needs to find and decode the folders
+    stream << d->packPos << d->packSizes << qint32(d->folders.size());
+    for (int i = 0; i < d->folders.size(); ++i) {
+        const Folder* folder = d->folders[i];
+        stream << qint32(folder->folderInfos.size());
+        for (int j = 0; j < folder->folderInfos.size(); ++j) {
+            const Folder::FolderInfo* info = folder->folderInfos[j];
+            stream << qint32(info->numInStreams) << qint32(info->numOutStreams)
+                   << info->properties << info->methodID;
+        }
+        stream << folder->inIndexes << folder->outIndexes << folder->packedStreams
+               << folder->unpackSizes << folder->unpackCRCDefined << folder->unpackCRC;
+    }
+}
+
+bool SevenZipHandler::loadIndexData( QDataStream &stream )
+{
+    d->clear();
+    qint32 folderCount;
+    stream >> d->packPos >> d->packSizes >> folderCount;
+    int packStreamCount = 0;
+    for (qint32 i = 0; i < folderCount && stream.status() == QDataStream::Ok; ++i) {
+        Folder* folder = new Folder;
+        d->folders.append(folder);
+        qint32 infoCount;
+        stream >> infoCount;
+        for (qint32 j = 0; j < infoCount && stream.status() == QDataStream::Ok; ++j) {
+            Folder::FolderInfo* info = new Folder::FolderInfo;
+            folder->folderInfos.append(info);
+            qint32 numInStreams, numOutStreams;
+            stream >> numInStreams >> numOutStreams >> info->properties >> info->methodID;
+            info->numInStreams = numInStreams;
+            info->numOutStreams = numOutStreams;
+        }
+        stream >> folder->inIndexes >> folder->outIndexes >> folder->packedStreams
+               >> folder->unpackSizes >> folder->unpackCRCDefined >> folder->unpackCRC;
+        packStreamCount += folder->packedStreams.size();
+    }
+    // The folders read their pack streams from packSizes
+    if (stream.status() != QDataStream::Ok || packStreamCount > d->packSizes.size()) {
+        d->clear();
+        return false;
+    }
+    d->setFolderStarts();
+    return true;
+}
+
+KArchiveFile *SevenZipHandler::createFileEntry( const QString &name, int access, int date,
+                                                const QString &user, const QString &group,
+                                                const QString &symlink, qint64 position, qint64 size )
+{
+    // Positions count across the folders, the data lies in the last
+    // folder starting before it
+    int folder = -1;
+    for (int i = d->folderStarts.size() - 1; size > 0 && i >= 0; --i) {
+        if (d->folderStarts[i] <= quint64(position)) {
+            folder = i;
+            break;
+        }
+    }
+    return new ( archive() ) SevenZipHandlerFileEntry( archive(), name, access, date, user, group, symlink,
+                                                       position, size, folder );
 }
+
+void SevenZipHandler::setSolidBlockSize( qint64 size )
+{
+    d->m_solidBlockSize = qMax<qint64>(size, 0);
+}
+
+qint64 SevenZipHandler::solidBlockSize() const
+{
+    return d->m_solidBlockSize;
+}
+
+void SevenZipHandler::setWorkerCount( int count )
+{
+    d->m_workerCount = qMax(count, 1);
+    d->m_pool.setMaxThreadCount(d->m_workerCount);
+}
+
+int SevenZipHandler::workerCount() const
+{
+    return d->m_workerCount;
+}
+
+void SevenZipHandler::virtual_hook( int id, void* data ) {
+    KArchiveHandler::virtual_hook( id, data );
+}
+
+#include "7z.moc"
@@ -0,0 +1,194 @@
+/* This file is part of the KDE libraries
+   Copyright (C) 2011 Mario Bensi <mbensi@ipsquad.net>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#ifndef SEVENZIP_H
+#define SEVENZIP_H
+
+#include <karchive.h>
+#include <karchivehandler.h>
+
+/**
+ * A class for reading / writing p7zip archives.
+ *
+ * Files are written into solid folders as they come, so writing a file
+ * which is already in the archive fails.
+ *
+ * @author Mario Bensi
+ */
+class KARCHIVE_EXPORT SevenZipHandler : public KArchiveHandler
+{
+public:
+    /**
+     * Creates an instance that operates on the given MIME Type.
+     *
+     * @param mimeType is archive MIME Type
+     */
+    SevenZipHandler( const QString& mimeType );
+
+    /**
+     * If the archive is still opened, then it will be
+     * closed automatically by the destructor.
+     */
+    virtual ~SevenZipHandler();
+
+    /**
+     * Call this before writing files to split the data into several
+     * folders (solid blocks). A new folder is started between two files
+     * once the current one holds @p size bytes, so that reading a file
+     * later only decodes the folder it belongs to.
+     * @param size the unpacked size of a folder, 0 (the default) to keep
+     * all files in a single folder
+     * @see setWorkerCount()
+     */
+    void setSolidBlockSize( qint64 size );
+
+    /**
+     * The unpacked size after which a new folder is started.
+     * @return the solid block size, 0 for a single folder
+     * @see setSolidBlockSize()
+     */
+    qint64 solidBlockSize() const;
+
+    /**
+     * Call this to compress several folders at once.
+     * When writing with a solid block size set, folders are buffered in
+     * memory and compressed on a pool of @p count threads, while the
+     * archive still gets written in order. Up to twice @p count folders
+     * may be held in memory at any time.
+     * This has no effect on reading: to decode several folders at once,
+     * extract the archive with KArchiveDirectory::copyTo() and workers.
+     * @param count the number of worker threads, 1 (the default) to
+     * compress in the calling thread
+     * @see setSolidBlockSize()
+     */
+    void setWorkerCount( int count );
+
+    /**
+     * The number of threads used to compress folders.
+     * @return the number of worker threads
+     * @see setWorkerCount()
+     */
+    int workerCount() const;
+
+protected:
+
+    /// Reimplemented from KArchiveHandler
+    virtual bool doWriteSymLink(const QString &name, const QString &target,
+                                const QString &user, const QString &group,
+                                mode_t perm, time_t atime, time_t mtime, time_t ctime);
+    /// Reimplemented from KArchiveHandler
+    virtual bool doWriteDir( const QString& name, const QString& user, const QString& group,
+                             mode_t perm, time_t atime, time_t mtime, time_t ctime );
+    /// Reimplemented from KArchiveHandler
+    virtual bool doPrepareWriting( const QString& name, const QString& user,
+                                   const QString& group, qint64 size, mode_t perm,
+                                   time_t atime, time_t mtime, time_t ctime );
+    /// Reimplemented from KArchiveHandler
+    virtual bool doFinishWriting( qint64 size );
+
+    /// Reimplemented from KArchiveHandler
+    virtual bool writeData( const char* data, qint64 size );
+
+    /**
+     * Opens the archive for reading.
+     * Parses the directory listing of the archive
+     * and creates the KArchiveDirectory/KArchiveFile entries.
+     * @param mode the mode of the file
+     */
+    virtual bool openArchive( QIODevice::OpenMode mode );
+    virtual bool closeArchive();
+
+    /// Reimplemented from KArchiveHandler
+    virtual bool supportsIndex() const;
+    /// Reimplemented from KArchiveHandler
+    virtual void saveIndexData( QDataStream &stream ) const;
+    /// Reimplemented from KArchiveHandler
+    virtual bool loadIndexData( QDataStream &stream );
+    /// Reimplemented from KArchiveHandler
+    virtual KArchiveFile *createFileEntry( const QString &name, int access, int date,
+                                           const QString &user, const QString &group,
+                                           const QString &symlink, qint64 position, qint64 size );
+
+protected:
+    virtual void virtual_hook( int id, void* data );
+private:
+    friend class SevenZipHandlerFileEntry;
+    /**
+     * @return a device on the @p size bytes of the given folder at
+     * @p position, counted like SevenZipHandlerFileEntry::position(),
+     * decoded while it gets read where possible. 0 on error.
+     */
+    QIODevice* createEntryDevice( int folder, qint64 position, qint64 size );
+
+    class SevenZipHandlerPrivate;
+    SevenZipHandlerPrivate* const d;
+};
+
+
+/**
+ * A SevenZipHandlerFileEntry represents a file in a 7z archive.
+ */
+class KARCHIVE_EXPORT SevenZipHandlerFileEntry : public KArchiveFile
+{
+public:
+    /**
+     * Creates a new 7z file entry. Do not call this, SevenZipHandler takes care of it.
+     * @param folder the folder holding the data, or -1 for files written
+     * in this session. position() counts from the start of the unpacked
+     * data of the first folder.
+     */
+    SevenZipHandlerFileEntry( KArchive* zip, const QString& name, int access, int date,
+                              const QString& user, const QString& group, const QString& symlink,
+                              qint64 pos, qint64 size, int folder );
+
+    /**
+     * Destructor. Do not call this.
+     */
+    ~SevenZipHandlerFileEntry();
+
+    /**
+     * @return the content of this file.
+     * Call data() with care (only once per file), this data isn't cached.
+     */
+    virtual QByteArray data() const;
+
+    /**
+     * This method returns QIODevice (internal class: KLimitedIODevice)
+     * on top of the unpacked data of the folder holding the file.
+     * This is obviously for reading only.
+     *
+     * WARNING: Note that the ownership of the device is being transferred to the caller,
+     * who will have to delete it.
+     *
+     * The returned device auto-opens (in readonly mode), no need to open it.
+     * @return the QIODevice of the file
+     */
+    virtual QIODevice *createDevice() const;
+
+    /// CRC: only used when writing
+    quint32 crc() const;
+    void setCrc( quint32 crc );
+
+protected:
+    virtual void virtual_hook( int id, void* data );
+
+private:
+    class SevenZipHandlerFileEntryPrivate;
+    SevenZipHandlerFileEntryPrivate * const d;
+};
+
+#endif
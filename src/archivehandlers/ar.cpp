@@ -115,6 +115,9 @@ bool ArHandler::openArchive( QIODevice::OpenMode mode )
         return false;
     }
 
+    // Only list the entries in the table if asked to
+    const bool deferred = deferredEntries() && mode == QIODevice::ReadOnly;
+
     char *ar_longnames = 0;
     while (! dev->atEnd()) {
         QByteArray ar_header;
@@ -172,10 +175,20 @@ bool ArHandler::openArchive( QIODevice::OpenMode mode )
         name.replace( '/', QByteArray() );
         //qDebug() << "Filename: " << name << " Size: " << size;
 
-        KArchiveEntry* entry = new KArchiveFile(archive(), QString::fromLocal8Bit(name.constData()), mode, date,
-                                                rootDir()->user(), rootDir()->group(), /*symlink*/ QString(),
-                                                dev->pos(), size);
-        rootDir()->addEntry(entry); // Ar files don't support directories, so everything in root
+        if (deferred) {
+            // Unknown owners get the one of the root dir once created from the table
+            if (!entryTable().append(QString::fromLocal8Bit(name.constData()), mode, date, dev->pos(), size,
+                                     QString(), QString(), QString())) {
+                //qWarning() << "too many entries in" << fileName();
+                delete[] ar_longnames;
+                return false;
+            }
+        } else {
+            KArchiveEntry* entry = new (archive()) KArchiveFile(archive(), QString::fromLocal8Bit(name.constData()), mode, date,
+                                                                rootDir()->user(), rootDir()->group(), /*symlink*/ QString(),
+                                                                dev->pos(), size);
+            rootDir()->addEntry(entry); // Ar files don't support directories, so everything in root
+        }
 
         dev->seek( dev->pos() + size ); // Skip contents
     }
@@ -190,6 +203,12 @@ bool ArHandler::closeArchive()
     return true;
 }
 
+bool ArHandler::supportsIndex() const
+{
+    // Reading keeps no state besides the entries
+    return true;
+}
+
 void ArHandler::virtual_hook( int id, void* data )
 { KArchiveHandler::virtual_hook( id, data ); }
 
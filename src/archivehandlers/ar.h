@@ -77,6 +77,9 @@ protected:
     virtual bool openArchive( QIODevice::OpenMode mode );
     virtual bool closeArchive();
 
+    /// Reimplemented from KArchiveHandler
+    virtual bool supportsIndex() const;
+
 protected:
     virtual void virtual_hook( int id, void* data );
 private:
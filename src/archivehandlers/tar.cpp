@@ -24,6 +24,7 @@
 #include <time.h> // time()
 #include <assert.h>
 
+#include <QtCore/QDataStream>
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
 #include <QtCore/QFile>
@@ -68,13 +69,19 @@ static const char application_lzma[] = "application/x-lzma";
 static const char application_xz[] = "application/x-xz";
 static const char application_zip[] = "application/zip";
 
+// Distance between the access points of compressed tar files opened for reading,
+// each one costs 32 KiB of memory
+static const qint64 accessPointSpan = 16 * 1024 * 1024;
+
 class TarHandler::TarHandlerPrivate
 {
 public:
     TarHandlerPrivate(TarHandler *parent)
       : q(parent),
         tarEnd( 0 ),
-        tmpFile( 0 )
+        tmpFile( 0 ),
+        compressionDevice( 0 ),
+        threadCount( 1 )
     {
     }
 
@@ -82,8 +89,10 @@ public:
     QStringList dirList;
     qint64 tarEnd;
     QTemporaryFile* tmpFile;
+    KCompressionDevice* compressionDevice; // when reading compressed tar files
     QString mimetype;
     QByteArray origFileName;
+    int threadCount;
 
     bool fillTempFile(const QString & fileName);
     bool writeBackTempFile( const QString & fileName );
@@ -110,14 +119,16 @@ bool TarHandler::createDevice(QIODevice::OpenMode mode)
 
         QMimeDatabase db;
         QMimeType mime;
-        if (mode != QIODevice::WriteOnly && QFile::exists(fileName())) {
+        if (mode != QIODevice::WriteOnly) {
             // Give priority to file contents: if someone renames a .tar.bz2 to .tar.gz,
             // we can still do the right thing here.
             QFile f(fileName());
             if (f.open(QIODevice::ReadOnly)) {
-                mime = db.mimeTypeForData(&f);
+                const QByteArray header = f.read(headerSize());
+                const QString name = mimeTypeForHeader(header, fileName());
+                mime = name.isEmpty() ? db.mimeTypeForData(header) : db.mimeTypeForName(name);
             }
-            if (!mime.isValid()) {
+            if (!mime.isValid() || mime.isDefault()) {
                 // Unable to determine mimetype from contents, get it from file name
                 mime = db.mimeTypeForFile(fileName(), QMimeDatabase::MatchExtension);
             }
@@ -152,9 +163,26 @@ bool TarHandler::createDevice(QIODevice::OpenMode mode)
             //qDebug() << "creating KFilterDev for" << d->mimetype;
             KCompressionDevice::CompressionType type = KFilterDev::compressionTypeForMimeType(d->mimetype);
             KCompressionDevice* compressionDevice = new KCompressionDevice(device(), true, type);
+            compressionDevice->setThreadCount(d->threadCount);
             setDevice(compressionDevice);
         }
         return true;
+    } else if (mode == QIODevice::ReadOnly) {
+        KCompressionDevice::CompressionType type = KFilterDev::compressionTypeForMimeType(d->mimetype);
+        if (type == KCompressionDevice::None)
+            return KArchiveHandler::createDevice(mode);
+
+        // Read the headers straight from the decompressing stream, instead
+        // of extracting the whole archive to a temporary file first.
+        // Random access to the files is then made affordable by the access
+        // points recorded while listing (gzip only), other compression types
+        // decompress again from the start when going back.
+        Q_ASSERT(!d->compressionDevice);
+        d->compressionDevice = new KCompressionDevice(fileName(), type);
+        d->compressionDevice->setAccessPointSpan(accessPointSpan);
+        d->compressionDevice->setThreadCount(d->threadCount);
+        setDevice(d->compressionDevice);
+        return true;
     } else {
         // The compression filters are very slow with random access.
         // So instead of applying the filter to the device,
@@ -165,6 +193,8 @@ bool TarHandler::createDevice(QIODevice::OpenMode mode)
         // This is because the tar ioslave extracts one file after the other and normally
         // has to walk through the decompression filter each time.
         // Which is in fact nearly as slow as a complete decompression for each file.
+        // Reading only avoids this thanks to access points, see above, but
+        // ReadWrite needs a real file to append to.
 
         Q_ASSERT(!d->tmpFile);
         d->tmpFile = new QTemporaryFile();
@@ -184,6 +214,7 @@ TarHandler::~TarHandler()
         close();
 
     delete d->tmpFile;
+    delete d->compressionDevice;
     delete d;
 }
 
@@ -196,6 +227,10 @@ void TarHandler::setOrigFileName( const QByteArray & fileName ) {
     d->origFileName = fileName;
 }
 
+void TarHandler::setThreadCount( int count ) {
+    d->threadCount = count;
+}
+
 qint64 TarHandler::TarHandlerPrivate::readRawHeader( char *buffer ) {
   // Read header
   qint64 n = q->device()->read( buffer, 0x200 );
@@ -308,6 +343,7 @@ bool TarHandler::TarHandlerPrivate::fillTempFile( const QString & fileName) {
 
     KCompressionDevice::CompressionType compressionType = KFilterDev::compressionTypeForMimeType(mimetype);
     KCompressionDevice filterDev(fileName, compressionType);
+    filterDev.setThreadCount(threadCount);
 
     QFile* file = tmpFile;
     Q_ASSERT(file->isOpen());
@@ -359,6 +395,10 @@ bool TarHandler::openArchive( QIODevice::OpenMode mode ) {
     if ( !dev )
         return false;
 
+    // Only list the entries in the table if asked to,
+    // KArchiveHandler::rootDir() creates them from it
+    const bool deferred = deferredEntries() && mode == QIODevice::ReadOnly;
+
     // read dir information
     char buffer[ 0x200 ];
     bool ende = false;
@@ -396,8 +436,8 @@ bool TarHandler::openArchive( QIODevice::OpenMode mode ) {
             int access = (int)strtol( p, &dummy, 8 );
 
             // read user and group
-            QString user = QString::fromLocal8Bit( buffer + 0x109 );
-            QString group = QString::fromLocal8Bit( buffer + 0x129 );
+            const QString user = internLocal8Bit( buffer + 0x109, 32 );
+            const QString group = internLocal8Bit( buffer + 0x129, 32 );
 
             // read time
             buffer[ 0x93 ] = 0;
@@ -432,11 +472,14 @@ bool TarHandler::openArchive( QIODevice::OpenMode mode ) {
             if (isdir)
                 access |= S_IFDIR; // f*cking broken tar files
 
-            KArchiveEntry* e;
+            KArchiveEntry* e = 0;
+            qint64 entryPos = 0;
+            qint64 entrySize = 0;
             if ( isdir )
             {
                 //qDebug() << "directory" << nm;
-                e = new KArchiveDirectory( archive(), nm, access, time, user, group, symlink );
+                if ( !deferred )
+                    e = new ( archive() ) KArchiveDirectory( archive(), nm, access, time, user, group, symlink );
             }
             else
             {
@@ -449,7 +492,10 @@ bool TarHandler::openArchive( QIODevice::OpenMode mode ) {
                 if ( isDumpDir )
                 {
                     //qDebug() << nm << "isDumpDir";
-                    e = new KArchiveDirectory( archive(), nm, access, time, user, group, symlink );
+                    if ( deferred )
+                        access |= S_IFDIR; // So that the table knows it is a directory
+                    else
+                        e = new ( archive() ) KArchiveDirectory( archive(), nm, access, time, user, group, symlink );
                 }
                 else
                 {
@@ -462,8 +508,11 @@ bool TarHandler::openArchive( QIODevice::OpenMode mode ) {
                     }
 
                     //qDebug() << "file" << nm << "size=" << size;
-                    e = new KArchiveFile( archive(), nm, access, time, user, group, symlink,
-                                          dev->pos(), size );
+                    entryPos = dev->pos();
+                    entrySize = size;
+                    if ( !deferred )
+                        e = new ( archive() ) KArchiveFile( archive(), nm, access, time, user, group, symlink,
+                                                            entryPos, entrySize );
                 }
 
                 // Skip contents + align bytes
@@ -475,7 +524,17 @@ bool TarHandler::openArchive( QIODevice::OpenMode mode ) {
                 }
             }
 
-            if ( pos == -1 )
+            if ( deferred )
+            {
+                // In some tar files we can find dir/./file => call cleanPath
+                const QString path = ( pos == -1 ) ? nm
+                                   : QDir::cleanPath( name.left( pos ) ) + QLatin1Char('/') + nm;
+                if ( !entryTable().append( path, access, time, entryPos, entrySize, user, group, symlink ) ) {
+                    //qWarning() << "too many entries in" << fileName();
+                    return false;
+                }
+            }
+            else if ( pos == -1 )
             {
                 if (nm == QLatin1String(".")) { // special case
                     Q_ASSERT( isdir );
@@ -527,6 +586,7 @@ bool TarHandler::TarHandlerPrivate::writeBackTempFile( const QString & fileName
     // circumvents that).
 
     KFilterDev dev(fileName);
+    dev.setThreadCount(threadCount);
     QFile* file = tmpFile;
     if ( !dev.open(QIODevice::WriteOnly) )
     {
@@ -565,6 +625,12 @@ bool TarHandler::closeArchive() {
         setDevice(0);
     }
 
+    if (d->compressionDevice) {
+        delete d->compressionDevice;
+        d->compressionDevice = 0;
+        setDevice(0);
+    }
+
     return ok;
 }
 
@@ -866,6 +932,30 @@ bool TarHandler::doWriteSymLink(const QString &name, const QString &target,
     return retval;
 }
 
+bool TarHandler::supportsIndex() const
+{
+    // Reading only sets up the end of the archive besides the entries
+    return true;
+}
+
+void TarHandler::saveIndexData( QDataStream &stream ) const
+{
+    stream << d->tarEnd;
+    // Lets the next opening seek in the decompressed stream right away
+    stream << ( d->compressionDevice ? d->compressionDevice->accessPoints() : QByteArray() );
+}
+
+bool TarHandler::loadIndexData( QDataStream &stream )
+{
+    QByteArray accessPoints;
+    stream >> d->tarEnd >> accessPoints;
+    if ( d->compressionDevice && !accessPoints.isEmpty() ) {
+        // Without them, reading just decompresses from the start
+        d->compressionDevice->setAccessPoints( accessPoints );
+    }
+    return true;
+}
+
 void TarHandler::virtual_hook( int id, void* data ) {
     KArchiveHandler::virtual_hook( id, data );
 }
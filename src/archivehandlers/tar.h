@@ -60,6 +60,14 @@ public:
      */
     void setOrigFileName( const QByteArray & fileName );
 
+    /**
+     * Call this before open() to compress a tar.gz or tar.xz,
+     * or to uncompress a tar.xz, on @p count threads.
+     * @param count the number of threads
+     * @see KCompressionDevice::setThreadCount()
+     */
+    void setThreadCount( int count );
+
 protected:
 
     /// Reimplemented from KArchive
@@ -87,6 +95,13 @@ protected:
 
     virtual bool createDevice( QIODevice::OpenMode mode );
 
+    /// Reimplemented from KArchiveHandler
+    virtual bool supportsIndex() const;
+    /// Reimplemented from KArchiveHandler, keeps the access points of compressed archives
+    virtual void saveIndexData( QDataStream &stream ) const;
+    /// Reimplemented from KArchiveHandler
+    virtual bool loadIndexData( QDataStream &stream );
+
 protected:
     virtual void virtual_hook( int id, void* data );
 private:
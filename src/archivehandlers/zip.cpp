@@ -29,10 +29,17 @@
 #include <QtCore/QFile>
 #include <QtCore/QDate>
 #include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QPair>
+#include <QtCore/QRunnable>
+#include <QtCore/QSemaphore>
+#include <QtCore/QSet>
+#include <QtCore/QThreadPool>
 
 #include <zlib.h>
 #include <time.h>
 #include <string.h>
+#include <limits.h>
 
 #include <karchivehandlerplugin.h>
 
@@ -56,6 +63,8 @@ public:
 
 
 const int max_path_len = 4095;	// maximum number of character a path may contain
+// larger entries are never buffered for compression on worker threads
+const qint64 max_parallel_entry_size = 64 * 1024 * 1024;
 
 static void transformToMsDos(const QDateTime& dt, char* buffer)
 {
@@ -104,6 +113,64 @@ static time_t transformFromMsDos(const char* buffer)
     return dt.toTime_t();
 }
 
+static quint16 getUInt16(const char* buffer)
+{
+    return quint16( (uchar)buffer[0] | (uchar)buffer[1] << 8 );
+}
+
+static quint32 getUInt32(const char* buffer)
+{
+    return quint32( (uchar)buffer[0] ) | quint32( (uchar)buffer[1] ) << 8 |
+           quint32( (uchar)buffer[2] ) << 16 | quint32( (uchar)buffer[3] ) << 24;
+}
+
+static quint64 getUInt64(const char* buffer)
+{
+    return quint64( getUInt32( buffer ) ) | quint64( getUInt32( buffer + 4 ) ) << 32;
+}
+
+static void setUInt16(char* buffer, quint16 value)
+{
+    buffer[0] = char(value);
+    buffer[1] = char(value >> 8);
+}
+
+static void setUInt32(char* buffer, quint32 value)
+{
+    buffer[0] = char(value);
+    buffer[1] = char(value >> 8);
+    buffer[2] = char(value >> 16);
+    buffer[3] = char(value >> 24);
+}
+
+static void setUInt64(char* buffer, quint64 value)
+{
+    setUInt32( buffer, quint32( value ) );
+    setUInt32( buffer + 4, quint32( value >> 32 ) );
+}
+
+// Sizes and offsets that don't fit in the classic headers are saturated
+// to this value and stored in the ZIP64 extra field instead.
+static const quint32 zip64Marker = 0xffffffff;
+
+/**
+ * Reads the local file header starting at @p headerStart and computes
+ * where the data of the entry begins. The local name and extra field
+ * lengths may differ from the ones in the central directory.
+ * @return true if a valid local header was found
+ */
+static bool readLocalDataStart(QIODevice* dev, qint64 headerStart, qint64* dataStart)
+{
+    char buffer[30];
+    KLimitedIODevice header( dev, headerStart, 30 );
+    if ( header.read( buffer, 30 ) != 30 || memcmp( buffer, "PK\3\4", 4 ) ) {
+        //qWarning() << "Invalid ZIP file. No local header at" << headerStart;
+        return false;
+    }
+    *dataStart = headerStart + 30 + getUInt16( buffer + 26 ) + getUInt16( buffer + 28 );
+    return true;
+}
+
 // == parsing routines for zip headers
 
 /** all relevant information about parsing file information */
@@ -117,15 +184,22 @@ struct ParseFileInfo {
   int gid;			// group id (-1 if not specified)
   QByteArray guessed_symlink;	// guessed symlink target
   int extralen;			// length of extra field
+  int cmethod;			// compression method
+  uint crc;			// crc32 of the uncompressed data
+  quint64 csize;		// compressed size
+  quint64 ucsize;		// uncompressed size
+  quint64 localheaderoffset;	// offset of the local header
 
   // parsing related info
   bool exttimestamp_seen;	// true if extended timestamp extra field
   				// has been parsed
   bool newinfounix_seen;	// true if Info-ZIP Unix New extra field has
   				// been parsed
+  bool zip64_seen;		// true if a ZIP64 extra field has been parsed
 
   ParseFileInfo() : perm(0100644), uid(-1), gid(-1), extralen(0),
-  	exttimestamp_seen(false), newinfounix_seen(false) {
+  	cmethod(0), crc(0), csize(0), ucsize(0), localheaderoffset(0),
+  	exttimestamp_seen(false), newinfounix_seen(false), zip64_seen(false) {
     ctime = mtime = atime = time(0);
   }
 };
@@ -223,6 +297,32 @@ static bool parseInfoZipUnixOld(const char *buffer, int size, bool islocal,
   return true;
 }
 
+/** updates the parse information with the given ZIP64 extended information
+  * extra field. It only holds the values which are saturated in the header,
+  * in this order: uncompressed size, compressed size, local header offset.
+  * @param buffer start of content of buffer known to contain a ZIP64
+  *	extra field (without magic & size)
+  * @param size size of field content (must not count magic and size entries)
+  * @param pfi ParseFileInfo object to be updated, its sizes and offset
+  *	must already hold the values read from the header
+  * @return true if processing was successful
+  */
+static bool parseZip64(const char *buffer, int size, ParseFileInfo &pfi) {
+  quint64 *values[] = { &pfi.ucsize, &pfi.csize, &pfi.localheaderoffset };
+  for (int i = 0; i < 3; ++i) {
+    if (*values[i] != zip64Marker) continue;
+    if (size < 8) {
+      //qDebug() << "premature end of ZIP64 extra field";
+      return false;
+    }/*end if*/
+    *values[i] = getUInt64(buffer);
+    buffer += 8;
+    size -= 8;
+  }/*end for*/
+  pfi.zip64_seen = true;
+  return true;
+}
+
 #if 0 // not needed yet
 /** updates the parse information with the given Info-ZIP Unix new extra field.
   * @param buffer start of content of buffer known to contain an Info-ZIP
@@ -264,10 +364,8 @@ static bool parseInfoZipUnixNew(const char *buffer, int size, bool islocal,
  */
 static bool parseExtraField(const char *buffer, int size, bool islocal,
 			ParseFileInfo &pfi) {
-  // extra field in central directory doesn't contain useful data, so we
-  // don't bother parsing it
-  if (!islocal) return true;
-
+  // the central directory only carries the modification time, which is
+  // all we need when the listing is built without the local headers
   while (size >= 4) {	// as long as a potential extra field can be read
     int magic = (uchar)buffer[0] | (uchar)buffer[1] << 8;
     buffer += 2;
@@ -282,6 +380,9 @@ static bool parseExtraField(const char *buffer, int size, bool islocal,
     }/*end if*/
 
     switch (magic) {
+      case 0x0001:		// ZIP64 extended information
+        if (!parseZip64(buffer, fieldsize, pfi)) return false;
+	break;
       case 0x5455:		// extended timestamp
         if (!parseExtTimestamp(buffer, fieldsize, islocal, pfi)) return false;
 	break;
@@ -303,6 +404,81 @@ static bool parseExtraField(const char *buffer, int size, bool islocal,
   return true;
 }
 
+/**
+ * Write-only device forwarding everything to the archive device.
+ * Used when streaming, because pos() has no meaning on sequential devices
+ * while the offsets of the local headers are needed for the central directory.
+ */
+class ZipStreamDevice : public QIODevice
+{
+public:
+    ZipStreamDevice( QIODevice *dev ) : m_dev( dev )
+    {
+        open( QIODevice::WriteOnly | QIODevice::Unbuffered );
+    }
+
+protected:
+    virtual qint64 readData( char *, qint64 ) { return -1; } // unsupported
+    virtual qint64 writeData( const char *data, qint64 len )
+    {
+        return m_dev->write( data, len );
+    }
+
+private:
+    QIODevice *m_dev;
+};
+
+/**
+ * Deflates an entry buffered in memory, on one of the worker threads.
+ * @see ZipHandler::setWorkerCount()
+ */
+class ZipDeflateJob : public QRunnable
+{
+public:
+    ZipDeflateJob( ZipHandlerFileEntry *e, ZipHandler::ExtraField ef,
+                   time_t atime, time_t mtime, time_t ctime )
+        : entry( e ), extraField( ef ), atime( atime ), mtime( mtime ), ctime( ctime ),
+          size( 0 ), crc( 0 ), ok( false )
+    {
+        setAutoDelete( false );
+    }
+
+    virtual void run()
+    {
+        crc = crc32( 0L, Z_NULL, 0 );
+        crc = crc32( crc, (const Bytef *) input.constData(), input.size() );
+
+        // Same parameters as KGzipFilter without headers
+        z_stream zStream;
+        memset( &zStream, 0, sizeof( zStream ) );
+        ok = deflateInit2( &zStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY ) == Z_OK;
+        if ( ok ) {
+            output.resize( deflateBound( &zStream, input.size() ) );
+            zStream.next_in = (Bytef *) input.data();
+            zStream.avail_in = input.size();
+            zStream.next_out = (Bytef *) output.data();
+            zStream.avail_out = output.size();
+            ok = deflate( &zStream, Z_FINISH ) == Z_STREAM_END;
+            output.resize( output.size() - zStream.avail_out );
+            deflateEnd( &zStream );
+        }
+        input.clear();
+        done.release();
+    }
+
+    ZipHandlerFileEntry *entry;
+    ZipHandler::ExtraField extraField;
+    time_t atime;
+    time_t mtime;
+    time_t ctime;
+    qint64 size;        // as given to doFinishWriting
+    QByteArray input;   // uncompressed data, filled by writeData
+    QByteArray output;  // raw deflate data
+    unsigned long crc;
+    bool ok;
+    QSemaphore done;    // released once run() is over
+};
+
 ////////////////////////////////////////////////////////////////////////
 /////////////////////////// ZipHandler ///////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////
@@ -310,19 +486,66 @@ static bool parseExtraField(const char *buffer, int size, bool islocal,
 class ZipHandler::ZipHandlerPrivate
 {
 public:
-    ZipHandlerPrivate()
-        : m_crc( 0 ),
+    ZipHandlerPrivate(ZipHandler *parent)
+        : q( parent ),
+          m_crc( 0 ),
           m_currentFile( 0 ),
           m_currentDev( 0 ),
           m_compression( 8 ),
           m_extraField( ZipHandler::NoExtraField ),
-	  m_offset( 0 )
+	  m_offset( 0 ),
+          m_writeStart( 0 ),
+          m_streaming( false ),
+          m_stream( 0 ),
+          m_workerCount( 1 ),
+          m_currentJob( 0 )
     {}
+    ~ZipHandlerPrivate()
+    {
+        m_pool.waitForDone();
+        qDeleteAll( m_pending );
+        delete m_currentJob;
+        delete m_stream;
+    }
 
+    // Where the archive gets written to
+    QIODevice *writeDevice() const
+    {
+        return m_stream ? m_stream : q->device();
+    }
+
+    enum CentralDirectoryStatus {
+        CentralDirectoryRead,
+        CentralDirectoryMissing,  // no usable end of central directory record
+        CentralDirectoryBroken
+    };
+
+    CentralDirectoryStatus readCentralDirectory();
+
+    // Creates the entry stored as rawName, described by pfi, and adds it
+    // to the tree. The data is known to start at dataoffset if resolved,
+    // otherwise it is only an estimate until the local header is read.
+    void addEntry( const QByteArray &rawName, const ParseFileInfo &pfi, qint64 dataoffset, bool resolved );
+
+    // Builds the local header of e, with placeholders instead of the crc
+    // and sizes unless final is set
+    QByteArray localHeader( ZipHandlerFileEntry *e, bool zip64, bool final, ZipHandler::ExtraField ef,
+                            time_t atime, time_t mtime, time_t ctime ) const;
+    // Writes out compressed entries in order, waiting for the first pending
+    // ones as long as more than maxPending entries are queued
+    bool flushJobs( int maxPending );
+    bool writeJob( ZipDeflateJob *job );
+    // Writes the local header of e, the current file, and prepares
+    // m_currentDev for its data to be written on the fly
+    bool startEntry( ZipHandlerFileEntry *e, bool zip64, ZipHandler::ExtraField ef,
+                     time_t atime, time_t mtime, time_t ctime );
+
+    ZipHandler *q;
     unsigned long           m_crc;         // checksum
     ZipHandlerFileEntry*          m_currentFile; // file currently being written
     QIODevice*              m_currentDev;  // filterdev used to write to the above file
     QList<ZipHandlerFileEntry*> m_fileList;    // flat list of all files, for the index (saves a recursive method ;)
+    QSet<ZipHandlerFileEntry*> m_zip64Entries; // files written with a ZIP64 field in their local header
     int                     m_compression;
     ZipHandler::ExtraField        m_extraField;
     // m_offset holds the offset of the place in the zip,
@@ -330,10 +553,228 @@ public:
     // writeonly mode, or it points to the beginning of the central directory.
     // each call to writefile updates this value.
     quint64                 m_offset;
+    // local headers from this offset on were written by us and need
+    // their crc and sizes filled in when closing
+    qint64                  m_writeStart;
+    bool                    m_streaming;
+    // set while writing in streaming mode, entries are then followed by
+    // a data descriptor instead of having their local header patched
+    ZipStreamDevice*        m_stream;
+    int                     m_workerCount;
+    QThreadPool             m_pool;
+    ZipDeflateJob*          m_currentJob;  // buffers the file currently being written
+    QList<ZipDeflateJob*>   m_pending;     // queued or compressed files, in archive order
+    QSet<ZipHandlerFileEntry*> m_finalHeaders; // files whose local header already holds crc and sizes
+    QMutex                  m_resolveMutex; // entries of this archive may be read from several threads
 };
 
+QByteArray ZipHandler::ZipHandlerPrivate::localHeader( ZipHandlerFileEntry *e, bool zip64, bool final,
+                                                       ZipHandler::ExtraField ef,
+                                                       time_t atime, time_t mtime, time_t ctime ) const
+{
+    const QByteArray encodedName = QFile::encodeName( e->path() );
+    const int zip64_field_len = zip64 ? 20 : 0;
+
+    int extra_field_len = zip64_field_len;
+    if ( ef == ModificationTime )
+        extra_field_len += 17;
+
+    QByteArray header( extra_field_len + encodedName.length() + 30, 0 );
+    char* buffer = header.data();
+
+    buffer[ 0 ] = 'P'; //local file header signature
+    buffer[ 1 ] = 'K';
+    buffer[ 2 ] = 3;
+    buffer[ 3 ] = 4;
+
+    buffer[ 4 ] = zip64 ? 45 : 0x14; // version needed to extract
+    buffer[ 5 ] = 0;
+
+    buffer[ 6 ] = ( m_stream && !final ) ? 8 : 0; // general purpose bit flag, 8: data descriptor follows
+    buffer[ 7 ] = 0;
+
+    buffer[ 8 ] = char(e->encoding()); // compression method
+    buffer[ 9 ] = char(e->encoding() >> 8);
+
+    transformToMsDos( e->datetime(), &buffer[ 10 ] );
+
+    if ( final )
+    {
+        setUInt32( buffer + 14, e->crc32() );
+        setUInt32( buffer + 18, zip64 ? zip64Marker : quint32( e->compressedSize() ) );
+        setUInt32( buffer + 22, zip64 ? zip64Marker : quint32( e->size() ) );
+    }
+    else if ( !m_stream ) // zeroes when the data descriptor holds them
+    {
+        buffer[ 14 ] = 'C'; //dummy crc
+        buffer[ 15 ] = 'R';
+        buffer[ 16 ] = 'C';
+        buffer[ 17 ] = 'q';
+
+        buffer[ 18 ] = 'C'; //compressed file size
+        buffer[ 19 ] = 'S';
+        buffer[ 20 ] = 'I';
+        buffer[ 21 ] = 'Z';
+
+        buffer[ 22 ] = 'U'; //uncompressed file size
+        buffer[ 23 ] = 'S';
+        buffer[ 24 ] = 'I';
+        buffer[ 25 ] = 'Z';
+    }
+
+    buffer[ 26 ] = (uchar)(encodedName.length()); //fileName length
+    buffer[ 27 ] = (uchar)(encodedName.length() >> 8);
+
+    buffer[ 28 ] = (uchar)(extra_field_len); // extra field length
+    buffer[ 29 ] = (uchar)(extra_field_len >> 8);
+
+    // file name
+    memcpy( buffer + 30, encodedName.constData(), encodedName.length() );
+
+    // extra field
+    if ( zip64 )
+    {
+        char *zip64field = buffer + 30 + encodedName.length();
+        // ZIP64 extended information (0x0001), zeroes if the sizes are unknown yet
+        setUInt16( zip64field, 0x0001 );
+        setUInt16( zip64field + 2, 16 );
+        if ( final ) {
+            setUInt64( zip64field + 4, e->size() );
+            setUInt64( zip64field + 12, e->compressedSize() );
+        }
+        // the sizes in the header itself must point to it
+        setUInt32( buffer + 18, zip64Marker );
+        setUInt32( buffer + 22, zip64Marker );
+    }
+
+    if ( ef == ModificationTime )
+    {
+        char *extfield = buffer + 30 + encodedName.length() + zip64_field_len;
+        // "Extended timestamp" header (0x5455)
+        extfield[0] = 'U';
+        extfield[1] = 'T';
+        extfield[2] = 13; // data size
+        extfield[3] = 0;
+        extfield[4] = 1 | 2 | 4;	// contains mtime, atime, ctime
+
+        extfield[5] = char(mtime);
+        extfield[6] = char(mtime >> 8);
+        extfield[7] = char(mtime >> 16);
+        extfield[8] = char(mtime >> 24);
+
+        extfield[9] = char(atime);
+        extfield[10] = char(atime >> 8);
+        extfield[11] = char(atime >> 16);
+        extfield[12] = char(atime >> 24);
+
+        extfield[13] = char(ctime);
+        extfield[14] = char(ctime >> 8);
+        extfield[15] = char(ctime >> 16);
+        extfield[16] = char(ctime >> 24);
+    }
+
+    return header;
+}
+
+bool ZipHandler::ZipHandlerPrivate::flushJobs( int maxPending )
+{
+    while ( !m_pending.isEmpty() ) {
+        ZipDeflateJob *job = m_pending.first();
+        if ( m_pending.count() > maxPending )
+            job->done.acquire();
+        else if ( !job->done.tryAcquire() )
+            break;
+
+        m_pending.removeFirst();
+        const bool ok = job->ok && writeJob( job );
+        delete job;
+        if ( !ok )
+            return false;
+    }
+    return true;
+}
+
+bool ZipHandler::ZipHandlerPrivate::writeJob( ZipDeflateJob *job )
+{
+    QIODevice* dev = writeDevice();
+    if ( !m_stream && !dev->seek( m_offset ) )
+        return false;
+
+    // The sizes are known now, they go right into the local header.
+    // Buffered entries are small enough not to need ZIP64 there.
+    ZipHandlerFileEntry *e = job->entry;
+    e->setSize( job->size );
+    e->setCompressedSize( job->output.size() );
+    e->setCRC32( job->crc );
+
+    const QByteArray header = localHeader( e, false, true, job->extraField,
+                                           job->atime, job->mtime, job->ctime );
+    e->setHeaderStart( dev->pos() );
+    e->setPosition( dev->pos() + header.size() );
+    if ( dev->write( header ) != header.size() )
+        return false;
+    if ( dev->write( job->output ) != job->output.size() )
+        return false;
+
+    m_finalHeaders.insert( e );
+    m_offset = dev->pos();
+    return true;
+}
+
+bool ZipHandler::ZipHandlerPrivate::startEntry( ZipHandlerFileEntry *e, bool zip64, ZipHandler::ExtraField ef,
+                                               time_t atime, time_t mtime, time_t ctime )
+{
+    // Everything queued so far goes before this entry
+    if ( !flushJobs( 0 ) )
+        return false;
+
+    QIODevice* dev = writeDevice();
+
+    // set right offset in zip.
+    if ( !m_stream && !dev->seek( m_offset ) ) {
+        //qWarning() << "doPrepareWriting: cannot seek in ZIP file. Disk full?";
+        return false;
+    }
+
+    if ( zip64 )
+        m_zip64Entries.insert( e );
+
+    // write out zip header
+    const QByteArray header = localHeader( e, zip64, false, ef, atime, mtime, ctime );
+    e->setHeaderStart( dev->pos() );
+    e->setPosition( dev->pos() + header.size() );
+    //qDebug() << "wrote file start: " << e->position() << " name: " << e->path();
+
+    // Write header
+    bool b = (dev->write( header ) == header.size() );
+
+    Q_ASSERT( b );
+    if (!b) {
+        return false;
+    }
+
+    // Prepare device for writing the data
+    // Either dev if no compression, or a KFilterDev to compress
+    if ( e->encoding() == 0 ) {
+        m_currentDev = dev;
+        return true;
+    }
+
+    KCompressionDevice::CompressionType type = KFilterDev::compressionTypeForMimeType(QString::fromLatin1("application/x-gzip"));
+    m_currentDev = new KCompressionDevice(dev, false, type);
+    Q_ASSERT( m_currentDev );
+    if ( !m_currentDev ) {
+        return false; // ouch
+    }
+    static_cast<KFilterDev *>(m_currentDev)->setSkipHeaders(); // Just zlib, not gzip
+
+    b = m_currentDev->open( QIODevice::WriteOnly );
+    Q_ASSERT( b );
+    return b;
+}
+
 ZipHandler::ZipHandler( const QString& mimeType )
-    : KArchiveHandler( mimeType ),d(new ZipHandlerPrivate)
+    : KArchiveHandler( mimeType ),d(new ZipHandlerPrivate(this))
 {
 }
 
@@ -349,9 +790,31 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
 {
     //qDebug();
     d->m_fileList.clear();
+    d->m_zip64Entries.clear();
+    d->m_offset = 0;
+    d->m_writeStart = 0;
+    d->m_finalHeaders.clear();
+    delete d->m_stream;
+    d->m_stream = 0;
+
+    if ( mode == QIODevice::WriteOnly ) {
+        // Sequential devices can't seek back to the local headers
+        if ( d->m_streaming || device()->isSequential() )
+            d->m_stream = new ZipStreamDevice( device() );
+        return true;
+    }
 
-    if ( mode == QIODevice::WriteOnly )
+    // Normally the listing comes from the central directory alone. Walking
+    // the local headers is only a recovery path for truncated archives.
+    switch ( d->readCentralDirectory() ) {
+    case ZipHandlerPrivate::CentralDirectoryRead:
+        d->m_writeStart = d->m_offset;
         return true;
+    case ZipHandlerPrivate::CentralDirectoryBroken:
+    case ZipHandlerPrivate::CentralDirectoryMissing:
+        //qDebug() << "No usable central directory found, scanning local headers";
+        break;
+    }
 
     char buffer[47];
 
@@ -365,6 +828,16 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
     QHash<QByteArray, ParseFileInfo> pfi_map;
 
     QIODevice* dev = device();
+    // readCentralDirectory() may have moved away from the start
+    if ( !dev->isSequential() && !dev->seek( 0 ) )
+        return false;
+
+    // The local headers in archive order, the listing comes from them
+    // when there is no central directory at all (truncated archive)
+    QList<QByteArray> localNames;
+    qint64 localEnd = 0; // end of the last complete local entry
+    bool centralSeen = false;
+    bool endOfFile = false;
 
     // We set a bool for knowing if we are allowed to skip the start of the file
     bool startOfFile = true;
@@ -378,8 +851,8 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
         if (n < 4)
         {
             //qWarning() << "Invalid ZIP file. Unexpected end of file. (#1)";
-
-            return false;
+            endOfFile = true;
+            break;
         }
 
         if ( !memcmp( buffer, "PK\5\6", 4 ) ) // 'end of entries'
@@ -393,6 +866,7 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
         {
 	    //qDebug() << "PK34 found local file header";
             startOfFile = false;
+            const qint64 headerStart = dev->pos() - 4;
             // can this fail ???
 	    dev->seek( dev->pos() + 2 ); // skip 'version needed to extract'
 
@@ -400,16 +874,17 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
             n = dev->read( buffer, 24 );
 	    if (n < 24) {
                 //qWarning() << "Invalid ZIP file. Unexpected end of file. (#4)";
-                return false;
+                endOfFile = true;
+                break;
 	    }
 
 	    int gpf = (uchar)buffer[0];	// "general purpose flag" not "general protection fault" ;-)
 	    int compression_mode = (uchar)buffer[2] | (uchar)buffer[3] << 8;
 	    time_t mtime = transformFromMsDos( buffer+4 );
 
-            const qint64 compr_size = uint(uchar(buffer[12])) | uint(uchar(buffer[13])) << 8 |
+            qint64 compr_size = uint(uchar(buffer[12])) | uint(uchar(buffer[13])) << 8 |
                                       uint(uchar(buffer[14])) << 16 | uint(uchar(buffer[15])) << 24;
-            const qint64 uncomp_size = uint(uchar(buffer[16])) | uint(uchar(buffer[17])) << 8 |
+            qint64 uncomp_size = uint(uchar(buffer[16])) | uint(uchar(buffer[17])) << 8 |
                                       uint(uchar(buffer[18])) << 16 | uint(uchar(buffer[19])) << 24;
             const int namelen = uint(uchar(buffer[20])) | uint(uchar(buffer[21])) << 8;
             const int extralen = uint(uchar(buffer[22])) | uint(uchar(buffer[23])) << 8;
@@ -428,31 +903,34 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
 	    QByteArray fileName = dev->read(namelen);
             if ( fileName.size() < namelen ) {
                 //qWarning() << "Invalid ZIP file. Name not completely read (#2)";
-		return false;
+                endOfFile = true;
+                break;
 	    }
 
 	    ParseFileInfo pfi;
 	    pfi.mtime = mtime;
-
-            // read and parse the beginning of the extra field,
-            // skip rest of extra field in case it is too long
-            unsigned int extraFieldEnd = dev->pos() + extralen;
+	    pfi.cmethod = compression_mode;
+	    pfi.crc = getUInt32( buffer + 8 );
+	    pfi.csize = compr_size;
+	    pfi.ucsize = uncomp_size;
+	    pfi.localheaderoffset = headerStart;
+
+            // read and parse the whole extra field, the ZIP64 field
+            // may come after fields longer than the buffer
 	    pfi.extralen = extralen;
-	    int handledextralen = qMin(extralen, (int)sizeof buffer);
-
-            //if ( handledextralen )
-            //    qDebug() << "handledextralen: " << handledextralen;
-
-	    n = dev->read(buffer, handledextralen);
-	    // no error msg necessary as we deliberately truncate the extra field
-	    if (!parseExtraField(buffer, handledextralen, true, pfi))
+	    const QByteArray extra = dev->read( extralen );
+	    if ( extra.size() < extralen ) {
+                //qWarning() << "Invalid ZIP file. Extra field not completely read";
+                endOfFile = true;
+                break;
+	    }
+	    if (!parseExtraField(extra.constData(), extra.size(), true, pfi))
 	    {
 	        //qWarning() << "Invalid ZIP File. Broken ExtraField.";
 	        return false;
 	    }
-
-            // jump to end of extra field
-            dev->seek( extraFieldEnd );
+	    compr_size = pfi.csize;
+	    uncomp_size = pfi.ucsize;
 
 	    // we have to take care of the 'general purpose bit flag'.
             // if bit 3 is set, the header doesn't contain the length of
@@ -470,7 +948,8 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
                     if (n < 1)
                     {
                         //qWarning() << "Invalid ZIP file. Unexpected end of file. (#2)";
-                        return false;
+                        endOfFile = true;
+                        break;
                     }
 
                     if ( buffer[0] != 'P' )
@@ -480,7 +959,8 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
                     if (n < 3)
                     {
                         //qWarning() << "Invalid ZIP file. Unexpected end of file. (#3)";
-                        return false;
+                        endOfFile = true;
+                        break;
                     }
 
                     // we have to detect three magic tokens here:
@@ -491,7 +971,18 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
 		    if ( buffer[0] == 'K' && buffer[1] == 7 && buffer[2] == 8 )
                     {
                         foundSignature = true;
-                        dev->seek( dev->pos() + 12 ); // skip the 'data_descriptor'
+                        // the 'data_descriptor' holds the crc and sizes,
+                        // 64-bit sizes when the local header has a ZIP64 field
+                        const int descriptorSize = pfi.zip64_seen ? 20 : 12;
+                        n = dev->read( buffer, descriptorSize );
+                        if ( n < descriptorSize )
+                        {
+                            endOfFile = true;
+                            break;
+                        }
+                        pfi.crc = getUInt32( buffer );
+                        pfi.csize = pfi.zip64_seen ? getUInt64( buffer + 4 ) : getUInt32( buffer + 4 );
+                        pfi.ucsize = pfi.zip64_seen ? getUInt64( buffer + 12 ) : getUInt32( buffer + 8 );
                     }
 		    else if ( ( buffer[0] == 'K' && buffer[1] == 1 && buffer[2] == 2 )
 		         || ( buffer[0] == 'K' && buffer[1] == 3 && buffer[2] == 4 ) )
@@ -520,7 +1011,7 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
 		    pfi.guessed_symlink = dev->read(uncomp_size);
 		    if (pfi.guessed_symlink.size() < uncomp_size) {
 			//qWarning() << "Invalid ZIP file. Unexpected end of file. (#5)";
-			return false;
+			endOfFile = true;
 		    }
 		} else {
 
@@ -536,7 +1027,8 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
 				if (n < 1)
 				{
 					//qWarning() << "Invalid ZIP file. Unexpected end of file. (#2)";
-					return false;
+					endOfFile = true;
+					break;
 				}
 
 				if ( buffer[0] != 'P' )
@@ -546,7 +1038,8 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
 				if (n < 3)
 				{
 					//qWarning() << "Invalid ZIP file. Unexpected end of file. (#3)";
-					return false;
+					endOfFile = true;
+					break;
 				}
 
 				// we have to detect three magic tokens here:
@@ -591,12 +1084,23 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
                 uint skip = compr_size + namelen + extralen;
                 offset += 30 + skip;*/
             }
+
+            if ( endOfFile || ( !dev->isSequential() && dev->pos() > dev->size() ) )
+            {
+                // the archive ends in the data of this entry
+                endOfFile = true;
+                break;
+            }
+            if ( !pfi_map.contains( fileName ) )
+                localNames.append( fileName );
             pfi_map.insert(fileName, pfi);
+            localEnd = dev->pos();
         }
         else if ( !memcmp( buffer, "PK\1\2", 4 ) ) // central block
         {
 	    //qDebug() << "PK12 found central block";
             startOfFile = false;
+            centralSeen = true;
 
             // so we reached the central header at the end of the zip file
             // here we get all interesting data out of the central header
@@ -624,9 +1128,6 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
 
             ParseFileInfo pfi = pfi_map.value( bufferName, ParseFileInfo() );
 
-            QString name( QFile::decodeName(bufferName) );
-
-            //qDebug() << "name: " << name;
             // only in central header ! see below.
             // length of extra attributes
             int extralen = (uchar)buffer[31] << 8 | (uchar)buffer[30];
@@ -653,6 +1154,14 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
             uint localheaderoffset = (uchar)buffer[45] << 24 | (uchar)buffer[44] << 16 |
 				(uchar)buffer[43] << 8 | (uchar)buffer[42];
 
+            // ZIP64 values are only found in the central extra field
+            ParseFileInfo centralpfi;
+            centralpfi.ucsize = ucsize;
+            centralpfi.csize = csize;
+            centralpfi.localheaderoffset = localheaderoffset;
+            const QByteArray extra = dev->read( extralen );
+            parseExtraField( extra.constData(), extra.size(), false, centralpfi );
+
             // some clever people use different extra field lengths
             // in the central header and in the local header... funny.
             // so we need to get the localextralen to calculate the offset
@@ -663,83 +1172,20 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
             //qDebug() << "localextralen: " << localextralen;
 
             // offset, where the real data for uncompression starts
-            uint dataoffset = localheaderoffset + 30 + localextralen + namelen; //comment only in central header
-
-            //qDebug() << "esize: " << esize;
-            //qDebug() << "eoffset: " << eoffset;
-            //qDebug() << "csize: " << csize;
-
+            qint64 dataoffset = centralpfi.localheaderoffset + 30 + localextralen + namelen; //comment only in central header
+
+            // the central header has the final say about the entry
+            pfi.cmethod = cmethod;
+            pfi.crc = crc32;
+            pfi.csize = centralpfi.csize;
+            pfi.ucsize = centralpfi.ucsize;
+            pfi.localheaderoffset = centralpfi.localheaderoffset;
 	    int os_madeby = (uchar)buffer[5];
-            bool isdir = false;
-            int access = 0100644;
-
 	    if (os_madeby == 3) {	// good ole unix
-	    	access = (uchar)buffer[40] | (uchar)buffer[41] << 8;
+	    	pfi.perm = (uchar)buffer[40] | (uchar)buffer[41] << 8;
 	    }
 
-            QString entryName;
-
-            if (name.endsWith(QLatin1Char('/'))) { // Entries with a trailing slash are directories
-                isdir = true;
-                name = name.left( name.length() - 1 );
-                if (os_madeby != 3) access = S_IFDIR | 0755;
-		else Q_ASSERT(access & S_IFDIR);
-            }
-
-            int pos = name.lastIndexOf(QLatin1Char('/'));
-            if ( pos == -1 )
-                entryName = name;
-            else
-                entryName = name.mid( pos + 1 );
-            Q_ASSERT( !entryName.isEmpty() );
-
-            KArchiveEntry* entry;
-            if ( isdir )
-            {
-                QString path = QDir::cleanPath( name );
-                const KArchiveEntry* ent = rootDir()->entry( path );
-                if ( ent && ent->isDirectory() )
-                {
-                    //qDebug() << "Directory already exists, NOT going to add it again";
-                    entry = 0;
-                }
-                else
-                {
-                    entry = new KArchiveDirectory( archive(), entryName, access, (int)pfi.mtime, rootDir()->user(), rootDir()->group(), QString() );
-                    //qDebug() << "KArchiveDirectory created, entryName= " << entryName << ", name=" << name;
-                }
-	    }
-            else
-            {
-	        QString symlink;
-		if (S_ISLNK(access)) {
-		    symlink = QFile::decodeName(pfi.guessed_symlink);
-		}
-                entry = new ZipHandlerFileEntry( archive(), entryName, access, pfi.mtime,
-					rootDir()->user(), rootDir()->group(),
-					symlink, name, dataoffset,
-					ucsize, cmethod, csize );
-                static_cast<ZipHandlerFileEntry *>(entry)->setHeaderStart( localheaderoffset );
-                static_cast<ZipHandlerFileEntry*>(entry)->setCRC32(crc32);
-                //qDebug() << "ZipHandlerFileEntry created, entryName= " << entryName << ", name=" << name;
-                d->m_fileList.append( static_cast<ZipHandlerFileEntry *>( entry ) );
-            }
-
-            if ( entry )
-            {
-                if ( pos == -1 )
-                {
-                    rootDir()->addEntry(entry);
-                }
-                else
-                {
-                    // In some tar files we can find dir/./file => call cleanPath
-                    QString path = QDir::cleanPath( name.left( pos ) );
-                    // Ensure container directory exists, create otherwise
-                    KArchiveDirectory * tdir = findOrCreate( path );
-                    tdir->addEntry(entry);
-                }
-            }
+            d->addEntry( bufferName, pfi, dataoffset, pfi_map.contains( bufferName ) );
 
             //calculate offset to next entry
             offset += 46 + commlen + extralen + namelen;
@@ -799,10 +1245,223 @@ bool ZipHandler::openArchive( QIODevice::OpenMode mode )
             return false;
         }
     }
+    if ( !centralSeen )
+    {
+        if ( endOfFile && localNames.isEmpty() )
+            return false;
+
+        // No central directory, e.g. in a truncated archive:
+        // list the complete entries found in the local headers
+        foreach ( const QByteArray &fileName, localNames )
+        {
+            const ParseFileInfo pfi = pfi_map.value( fileName );
+            const qint64 dataoffset = pfi.localheaderoffset + 30 + fileName.size() + pfi.extralen;
+            d->addEntry( fileName, pfi, dataoffset, true );
+        }
+        //set offset for appending new files
+        d->m_offset = localEnd;
+    }
+
     //qDebug() << "*** done *** ";
+    d->m_writeStart = d->m_offset;
     return true;
 }
 
+ZipHandler::ZipHandlerPrivate::CentralDirectoryStatus ZipHandler::ZipHandlerPrivate::readCentralDirectory()
+{
+    QIODevice* dev = q->device();
+    const qint64 fileSize = dev->size();
+    if ( dev->isSequential() || fileSize < 22 )
+        return CentralDirectoryMissing;
+
+    // The end of central directory record is 22 bytes long and
+    // may be followed by a comment of up to 65535 bytes.
+    const qint64 tailStart = fileSize - qMin( fileSize, qint64( 22 + 0xffff ) );
+    if ( !dev->seek( tailStart ) )
+        return CentralDirectoryMissing;
+    const QByteArray tail = dev->read( fileSize - tailStart );
+    if ( tail.size() != fileSize - tailStart )
+        return CentralDirectoryMissing;
+
+    int eocd = -1;
+    for ( int i = tail.size() - 22; i >= 0; --i ) {
+        const char* record = tail.constData() + i;
+        if ( !memcmp( record, "PK\5\6", 4 ) && i + 22 + getUInt16( record + 20 ) <= tail.size() ) {
+            eocd = i;
+            break;
+        }
+    }
+    if ( eocd == -1 )
+        return CentralDirectoryMissing;
+
+    const char* record = tail.constData() + eocd;
+    qint64 count = getUInt16( record + 10 );
+    qint64 cdSize = getUInt32( record + 12 );
+    qint64 cdOffset = getUInt32( record + 16 );
+    qint64 cdEnd = tailStart + eocd;
+
+    // A ZIP64 end of central directory locator right before the record
+    // points to the ZIP64 record, which holds the real values.
+    if ( eocd >= 20 && !memcmp( record - 20, "PK\6\7", 4 ) ) {
+        char buffer[56];
+        qint64 zip64Pos = getUInt64( record - 12 );
+        if ( !dev->seek( zip64Pos ) || dev->read( buffer, 56 ) != 56 || memcmp( buffer, "PK\6\6", 4 ) ) {
+            // Stored offset is wrong if data was prepended, the record
+            // normally comes right before the locator.
+            zip64Pos = cdEnd - 20 - 56;
+            if ( zip64Pos < 0 || !dev->seek( zip64Pos ) || dev->read( buffer, 56 ) != 56 || memcmp( buffer, "PK\6\6", 4 ) )
+                return CentralDirectoryMissing;
+        }
+        count = getUInt64( buffer + 32 );
+        cdSize = getUInt64( buffer + 40 );
+        cdOffset = getUInt64( buffer + 48 );
+        cdEnd = zip64Pos;
+    }
+
+    // Data in front of the archive (e.g. self-extractable ZIP files)
+    // shifts all the offsets stored in the archive.
+    const qint64 cdStart = cdEnd - cdSize;
+    const qint64 skew = cdStart - cdOffset;
+    if ( cdStart < 0 || skew < 0 || cdSize > INT_MAX )
+        return CentralDirectoryMissing;
+
+    if ( !dev->seek( cdStart ) )
+        return CentralDirectoryMissing;
+    const QByteArray cd = dev->read( cdSize );
+    if ( cd.size() != cdSize )
+        return CentralDirectoryMissing;
+
+    // All the records are checked before any entry gets created, so that
+    // a broken central directory leaves the tree empty for the scan.
+    QList<QPair<QByteArray, ParseFileInfo> > records;
+    int offset = 0;
+    while ( offset + 46 <= cd.size() )
+    {
+        const char* buffer = cd.constData() + offset;
+        const int namelen = getUInt16( buffer + 28 );
+        const int extralen = getUInt16( buffer + 30 );
+        const int commlen = getUInt16( buffer + 32 );
+        if ( memcmp( buffer, "PK\1\2", 4 ) || namelen == 0 ||
+             offset + 46 + namelen + extralen + commlen > cd.size() ) {
+            //qWarning() << "Invalid ZIP file. Broken central entry at" << cdStart + offset;
+            return CentralDirectoryBroken;
+        }
+
+        const QByteArray bufferName( buffer + 46, namelen );
+
+        ParseFileInfo pfi;
+        pfi.mtime = transformFromMsDos( buffer + 12 );
+        pfi.cmethod = getUInt16( buffer + 10 );
+        pfi.crc = getUInt32( buffer + 16 );
+        pfi.csize = getUInt32( buffer + 20 );
+        pfi.ucsize = getUInt32( buffer + 24 );
+        pfi.localheaderoffset = getUInt32( buffer + 42 );
+        if ( !parseExtraField( buffer + 46 + namelen, extralen, false, pfi ) ) {
+            //qWarning() << "Invalid ZIP file. Broken extra field for" << bufferName;
+            return CentralDirectoryBroken;
+        }
+        pfi.localheaderoffset += skew;
+        pfi.extralen = extralen;
+
+        const int os_madeby = (uchar)buffer[5];
+        if ( os_madeby == 3 ) { // good ole unix
+            pfi.perm = getUInt16( buffer + 40 );
+        }
+
+        records.append( qMakePair( bufferName, pfi ) );
+        offset += 46 + namelen + extralen + commlen;
+    }
+
+    // Without ZIP64 record the count only holds the low 16 bits
+    const bool countMatches = cdEnd == tailStart + eocd
+                              ? quint16( records.count() ) == count
+                              : records.count() == count;
+    if ( offset != cd.size() || !countMatches ) {
+        //qWarning() << "Central directory lists" << records.count() << "entries, expected" << count;
+        return CentralDirectoryBroken;
+    }
+
+    for ( int i = 0; i < records.count(); ++i )
+    {
+        const QByteArray &bufferName = records.at( i ).first;
+        const ParseFileInfo &pfi = records.at( i ).second;
+        // The local extra field is often the same as the central one; the
+        // real data offset is read from the local header on first access.
+        const qint64 dataoffset = pfi.localheaderoffset + 30 + bufferName.size() + pfi.extralen;
+        addEntry( bufferName, pfi, dataoffset, false );
+    }
+
+    //set offset for appending new files
+    m_offset = cdStart;
+    return CentralDirectoryRead;
+}
+
+void ZipHandler::ZipHandlerPrivate::addEntry( const QByteArray &rawName, const ParseFileInfo &pfi, qint64 dataoffset, bool resolved )
+{
+    QString name( QFile::decodeName( rawName ) );
+    mode_t access = pfi.perm;
+    const bool isdir = name.endsWith( QLatin1Char('/') );
+    if ( isdir ) { // Entries with a trailing slash are directories
+        name.chop( 1 );
+        if ( !S_ISDIR( access ) ) access = S_IFDIR | 0755;
+    }
+
+    const int pos = name.lastIndexOf( QLatin1Char('/') );
+    const QString entryName = ( pos == -1 ) ? name : name.mid( pos + 1 );
+    if ( entryName.isEmpty() ) {
+        //qDebug() << "Ignoring entry without a name";
+        return;
+    }
+
+    KArchiveEntry* entry;
+    if ( isdir )
+    {
+        const KArchiveEntry* ent = q->rootDir()->entry( QDir::cleanPath( name ) );
+        if ( ent && ent->isDirectory() ) {
+            //qDebug() << "Directory already exists, NOT going to add it again";
+            return;
+        }
+        entry = new ( q->archive() ) KArchiveDirectory( q->archive(), entryName, access, (int)pfi.mtime,
+                                                        q->rootDir()->user(), q->rootDir()->group(), QString() );
+    }
+    else
+    {
+        QString symlink;
+        qint64 start = dataoffset;
+        if ( S_ISLNK( access ) ) {
+            if ( !pfi.guessed_symlink.isNull() ) {
+                symlink = QFile::decodeName( pfi.guessed_symlink );
+            } else {
+                // Symlink targets are needed for the listing, so only those
+                // entries get their local header read right away.
+                QIODevice* dev = q->device();
+                if ( !resolved )
+                    resolved = readLocalDataStart( dev, pfi.localheaderoffset, &start );
+                if ( resolved && pfi.cmethod == NoCompression && pfi.ucsize > 0 && pfi.ucsize <= quint64( max_path_len )
+                     && dev->seek( start ) ) {
+                    symlink = QFile::decodeName( dev->read( pfi.ucsize ) );
+                }
+            }
+        }
+
+        ZipHandlerFileEntry* e = new ( q->archive() ) ZipHandlerFileEntry( q->archive(), entryName, access, pfi.mtime,
+                                                                           q->rootDir()->user(), q->rootDir()->group(),
+                                                                           symlink, name, start,
+                                                                           pfi.ucsize, pfi.cmethod, pfi.csize );
+        e->setHeaderStart( pfi.localheaderoffset );
+        e->setCRC32( pfi.crc );
+        e->setPositionResolved( resolved );
+        m_fileList.append( e );
+        entry = e;
+    }
+
+    if ( pos == -1 )
+        q->rootDir()->addEntry( entry );
+    else
+        // In some zip files we can find dir/./file => call cleanPath
+        q->findOrCreate( QDir::cleanPath( name.left( pos ) ) )->addEntry( entry );
+}
+
 bool ZipHandler::closeArchive()
 {
     if ( ! ( mode() & QIODevice::WriteOnly ) )
@@ -812,48 +1471,63 @@ bool ZipHandler::closeArchive()
     }
 
     //ReadWrite or WriteOnly
+    // entries still being compressed come first
+    if ( !d->flushJobs( 0 ) )
+        return false;
+
     //write all central dir file entries
 
     // to be written at the end of the file...
-    char buffer[ 22 ]; // first used for 12, then for 22 at the end
+    char buffer[ 22 ]; // first used for 16, then for 22 at the end
     uLong crc = crc32(0L, Z_NULL, 0);
 
-    qint64 centraldiroffset = device()->pos();
+    QIODevice* dev = d->writeDevice();
+    qint64 centraldiroffset = dev->pos();
     //qDebug() << "closearchive: centraldiroffset: " << centraldiroffset;
     qint64 atbackup = centraldiroffset;
     QMutableListIterator<ZipHandlerFileEntry*> it( d->m_fileList );
 
-    while(it.hasNext())
+    // when streaming, the data descriptors already hold these values
+    while(!d->m_stream && it.hasNext())
     {	//set crc and compressed size in each local file header
 	    it.next();
-        if ( !device()->seek( it.value()->headerStart() + 14 ) )
+        ZipHandlerFileEntry* entry = it.value();
+        // entries read from an existing archive already have valid headers
+        if ( entry->headerStart() < d->m_writeStart || d->m_finalHeaders.contains( entry ) )
+            continue;
+        if ( !dev->seek( entry->headerStart() + 14 ) )
             return false;
 	//qDebug() << "closearchive setcrcandcsize: fileName:"
 	//    << it.current()->path()
 	//    << "encoding:" << it.current()->encoding();
 
-        uLong mycrc = it.value()->crc32();
-        buffer[0] = char(mycrc); // crc checksum, at headerStart+14
-        buffer[1] = char(mycrc >> 8);
-        buffer[2] = char(mycrc >> 16);
-        buffer[3] = char(mycrc >> 24);
-
-        int mysize1 = it.value()->compressedSize();
-        buffer[4] = char(mysize1); // compressed file size, at headerStart+18
-        buffer[5] = char(mysize1 >> 8);
-        buffer[6] = char(mysize1 >> 16);
-        buffer[7] = char(mysize1 >> 24);
-
-        int myusize = it.value()->size();
-        buffer[8] = char(myusize); // uncompressed file size, at headerStart+22
-        buffer[9] = char(myusize >> 8);
-        buffer[10] = char(myusize >> 16);
-        buffer[11] = char(myusize >> 24);
-
-        if ( device()->write( buffer, 12 ) != 12 )
+        // Without a ZIP64 field in the local header, sizes beyond 4 GiB
+        // are only available from the central directory.
+        const bool zip64 = d->m_zip64Entries.contains( entry );
+        const quint64 csize = entry->compressedSize();
+        const quint64 usize = entry->size();
+        if ( !zip64 && ( csize >= zip64Marker || usize >= zip64Marker ) )
+            return false; // doFinishWriting() refused it already
+        setUInt32( buffer, entry->crc32() ); // crc checksum, at headerStart+14
+        setUInt32( buffer + 4, zip64 ? zip64Marker : quint32( csize ) ); // compressed file size, at headerStart+18
+        setUInt32( buffer + 8, zip64 ? zip64Marker : quint32( usize ) ); // uncompressed file size, at headerStart+22
+
+        if ( dev->write( buffer, 12 ) != 12 )
             return false;
+
+        if ( zip64 ) {
+            // The ZIP64 extra field comes first, right after the file name
+            const qint64 namelen = QFile::encodeName( entry->path() ).length();
+            if ( !dev->seek( entry->headerStart() + 30 + namelen + 4 ) )
+                return false;
+            setUInt64( buffer, usize );
+            setUInt64( buffer + 8, csize );
+            if ( dev->write( buffer, 16 ) != 16 )
+                return false;
+        }
     }
-    device()->seek( atbackup );
+    if ( !d->m_stream )
+        dev->seek( atbackup );
 
     it.toFront();
     while (it.hasNext())
@@ -862,9 +1536,22 @@ bool ZipHandler::closeArchive()
         //qDebug() << "fileName:" << it.current()->path()
         //              << "encoding:" << it.current()->encoding();
 
-        QByteArray path = QFile::encodeName(it.value()->path());
-
-	const int extra_field_len = 9;
+        ZipHandlerFileEntry* entry = it.value();
+        QByteArray path = QFile::encodeName(entry->path());
+
+        // ZIP64 extra field, holding only the values which don't fit
+        // in the header, in the order mandated by the spec
+        quint64 zip64Values[ 3 ];
+        int zip64Count = 0;
+        if ( quint64( entry->size() ) >= zip64Marker )
+            zip64Values[ zip64Count++ ] = entry->size();
+        if ( quint64( entry->compressedSize() ) >= zip64Marker )
+            zip64Values[ zip64Count++ ] = entry->compressedSize();
+        if ( quint64( entry->headerStart() ) >= zip64Marker )
+            zip64Values[ zip64Count++ ] = entry->headerStart();
+        const int zip64_field_len = zip64Count ? 4 + 8 * zip64Count : 0;
+
+	const int extra_field_len = 9 + zip64_field_len;
         int bufferSize = extra_field_len + path.length() + 46;
         char* buffer = new char[ bufferSize ];
 
@@ -881,28 +1568,24 @@ bool ZipHandler::closeArchive()
         //memcpy(buffer, head, sizeof(head));
         memmove(buffer, head, sizeof(head));
 
-        buffer[ 10 ] = char(it.value()->encoding()); // compression method
-        buffer[ 11 ] = char(it.value()->encoding() >> 8);
+        // Same as in the local header, which has a ZIP64 field
+        // for all the streamed entries
+        if ( zip64Count || d->m_zip64Entries.contains( entry ) ) {
+            buffer[ 4 ] = 45; // ZIP64 needs version 4.5
+            buffer[ 6 ] = 45;
+        }
 
-        transformToMsDos( it.value()->datetime(), &buffer[ 12 ] );
+        if ( d->m_stream && entry->headerStart() >= d->m_writeStart && !d->m_finalHeaders.contains( entry ) )
+            buffer[ 8 ] = 8; // general purpose bit flag: data descriptor
 
-        uLong mycrc = it.value()->crc32();
-        buffer[ 16 ] = char(mycrc); // crc checksum
-        buffer[ 17 ] = char(mycrc >> 8);
-        buffer[ 18 ] = char(mycrc >> 16);
-        buffer[ 19 ] = char(mycrc >> 24);
+        buffer[ 10 ] = char(entry->encoding()); // compression method
+        buffer[ 11 ] = char(entry->encoding() >> 8);
 
-        int mysize1 = it.value()->compressedSize();
-        buffer[ 20 ] = char(mysize1); // compressed file size
-        buffer[ 21 ] = char(mysize1 >> 8);
-        buffer[ 22 ] = char(mysize1 >> 16);
-        buffer[ 23 ] = char(mysize1 >> 24);
+        transformToMsDos( entry->datetime(), &buffer[ 12 ] );
 
-        int mysize = it.value()->size();
-        buffer[ 24 ] = char(mysize); // uncompressed file size
-        buffer[ 25 ] = char(mysize >> 8);
-        buffer[ 26 ] = char(mysize >> 16);
-        buffer[ 27 ] = char(mysize >> 24);
+        setUInt32( &buffer[ 16 ], entry->crc32() ); // crc checksum
+        setUInt32( &buffer[ 20 ], quint32( qMin( quint64( entry->compressedSize() ), quint64( zip64Marker ) ) ) ); // compressed file size
+        setUInt32( &buffer[ 24 ], quint32( qMin( quint64( entry->size() ), quint64( zip64Marker ) ) ) ); // uncompressed file size
 
         buffer[ 28 ] = char(path.length()); // fileName length
         buffer[ 29 ] = char(path.length() >> 8);
@@ -910,14 +1593,11 @@ bool ZipHandler::closeArchive()
 	buffer[ 30 ] = char(extra_field_len);
 	buffer[ 31 ] = char(extra_field_len >> 8);
 
-	buffer[ 40 ] = char(it.value()->permissions());
-	buffer[ 41 ] = char(it.value()->permissions() >> 8);
+	buffer[ 40 ] = char(entry->permissions());
+	buffer[ 41 ] = char(entry->permissions() >> 8);
 
-        int myhst = it.value()->headerStart();
-        buffer[ 42 ] = char(myhst); //relative offset of local header
-        buffer[ 43 ] = char(myhst >> 8);
-        buffer[ 44 ] = char(myhst >> 16);
-        buffer[ 45 ] = char(myhst >> 24);
+        //relative offset of local header
+        setUInt32( &buffer[ 42 ], quint32( qMin( quint64( entry->headerStart() ), quint64( zip64Marker ) ) ) );
 
         // file name
         strncpy( buffer + 46, path.constData(), path.length() );
@@ -932,21 +1612,58 @@ bool ZipHandler::closeArchive()
 	extfield[4] = 1 | 2 | 4;	// specify flags from local field
 					// (unless I misread the spec)
 	// provide only modification time
-	unsigned long time = (unsigned long)it.value()->date();
+	unsigned long time = (unsigned long)entry->date();
 	extfield[5] = char(time);
 	extfield[6] = char(time >> 8);
 	extfield[7] = char(time >> 16);
 	extfield[8] = char(time >> 24);
 
+        if ( zip64Count ) {
+            char *zip64field = extfield + 9;
+            setUInt16( zip64field, 0x0001 );
+            setUInt16( zip64field + 2, 8 * zip64Count );
+            for ( int i = 0; i < zip64Count; ++i )
+                setUInt64( zip64field + 4 + 8 * i, zip64Values[ i ] );
+        }
+
         crc = crc32(crc, (Bytef *)buffer, bufferSize );
-        bool ok = ( device()->write( buffer, bufferSize ) == bufferSize );
+        bool ok = ( dev->write( buffer, bufferSize ) == bufferSize );
         delete[] buffer;
         if ( !ok )
             return false;
     }
-    qint64 centraldirendoffset = device()->pos();
+    qint64 centraldirendoffset = dev->pos();
     //qDebug() << "closearchive: centraldirendoffset: " << centraldirendoffset;
-    //qDebug() << "closearchive: device()->pos(): " << device()->pos();
+    //qDebug() << "closearchive: dev->pos(): " << dev->pos();
+
+    const qint64 count = d->m_fileList.count();
+    //qDebug() << "number of files (count): " << count;
+    const qint64 cdsize = centraldirendoffset - centraldiroffset;
+
+    if ( count >= 0xffff || cdsize >= zip64Marker || centraldiroffset >= zip64Marker )
+    {
+        // write ZIP64 end of central dir record and its locator
+        char zip64[ 56 + 20 ];
+        memset( zip64, 0, sizeof( zip64 ) );
+
+        memcpy( zip64, "PK\6\6", 4 );
+        setUInt64( zip64 + 4, 56 - 12 ); // size of the remaining record
+        zip64[ 12 ] = 45; // version made by
+        zip64[ 13 ] = 3;  // (3 == UNIX)
+        zip64[ 14 ] = 45; // version needed to extract
+        setUInt64( zip64 + 24, count ); // total number of entries in central dir of this disk
+        setUInt64( zip64 + 32, count ); // total number of entries in the central dir
+        setUInt64( zip64 + 40, cdsize ); // size of the central dir
+        setUInt64( zip64 + 48, centraldiroffset ); // central dir offset
+
+        char *locator = zip64 + 56;
+        memcpy( locator, "PK\6\7", 4 );
+        setUInt64( locator + 8, centraldirendoffset ); // ZIP64 end of central dir offset
+        setUInt32( locator + 16, 1 ); // total number of disks
+
+        if ( dev->write( zip64, sizeof( zip64 ) ) != sizeof( zip64 ) )
+            return false;
+    }
 
     //write end of central dir record.
     buffer[ 0 ] = 'P'; //end of central dir signature
@@ -960,36 +1677,27 @@ bool ZipHandler::closeArchive()
     buffer[ 6 ] = 0; // number of disk with start of central dir
     buffer[ 7 ] = 0;
 
-    int count = d->m_fileList.count();
-    //qDebug() << "number of files (count): " << count;
-
-
-    buffer[ 8 ] = char(count); // total number of entries in central dir of
-    buffer[ 9 ] = char(count >> 8); // this disk
-
+    // values which don't fit are saturated, the ZIP64 record has them
+    setUInt16( &buffer[ 8 ], quint16( qMin( count, qint64( 0xffff ) ) ) ); // total number of entries in central dir of
+                                                                          // this disk
     buffer[ 10 ] = buffer[ 8 ]; // total number of entries in the central dir
     buffer[ 11 ] = buffer[ 9 ];
 
-    int cdsize = centraldirendoffset - centraldiroffset;
-    buffer[ 12 ] = char(cdsize); // size of the central dir
-    buffer[ 13 ] = char(cdsize >> 8);
-    buffer[ 14 ] = char(cdsize >> 16);
-    buffer[ 15 ] = char(cdsize >> 24);
+    setUInt32( &buffer[ 12 ], quint32( qMin( cdsize, qint64( zip64Marker ) ) ) ); // size of the central dir
 
     //qDebug() << "end : centraldiroffset: " << centraldiroffset;
     //qDebug() << "end : centraldirsize: " << cdsize;
 
-    buffer[ 16 ] = char(centraldiroffset); // central dir offset
-    buffer[ 17 ] = char(centraldiroffset >> 8);
-    buffer[ 18 ] = char(centraldiroffset >> 16);
-    buffer[ 19 ] = char(centraldiroffset >> 24);
+    setUInt32( &buffer[ 16 ], quint32( qMin( centraldiroffset, qint64( zip64Marker ) ) ) ); // central dir offset
 
     buffer[ 20 ] = 0; //zipfile comment length
     buffer[ 21 ] = 0;
 
-    if ( device()->write( buffer, 22 ) != 22 )
+    if ( dev->write( buffer, 22 ) != 22 )
         return false;
 
+    delete d->m_stream;
+    d->m_stream = 0;
     return true;
 }
 
@@ -1005,7 +1713,7 @@ bool ZipHandler::doWriteDir( const QString &name, const QString &user, const QSt
 }
 
 bool ZipHandler::doPrepareWriting(const QString &name, const QString &user,
-                               const QString &group, qint64 /*size*/, mode_t perm,
+                               const QString &group, qint64 size, mode_t perm,
                                time_t atime, time_t mtime, time_t ctime) {
     //qDebug();
     if ( !isOpen() )
@@ -1022,10 +1730,15 @@ bool ZipHandler::doPrepareWriting(const QString &name, const QString &user,
 
     Q_ASSERT( device() );
 
-    // set right offset in zip.
-    if ( !device()->seek( d->m_offset ) ) {
-        //qWarning() << "doPrepareWriting: cannot seek in ZIP file. Disk full?";
-        return false;
+    // Find or create parent dir
+    KArchiveDirectory* parentDir = rootDir();
+    QString fileName( name );
+    int i = name.lastIndexOf(QLatin1Char('/'));
+    if (i != -1) {
+        QString dir = name.left( i );
+        fileName = name.mid( i + 1 );
+        //qDebug() << "ensuring" << dir << "exists. fileName=" << fileName;
+        parentDir = findOrCreate( dir );
     }
 
     // delete entries in the filelist with the same fileName as the one we want
@@ -1041,162 +1754,76 @@ bool ZipHandler::doPrepareWriting(const QString &name, const QString &user,
 		if (name == it.value()->path() )
         {
 	    	//qDebug() << "removing following entry: " << it.current()->path();
+		// it may still be waiting to be written out
+		if ( !d->flushJobs( 0 ) )
+		    return false;
+		d->m_zip64Entries.remove(it.value());
+		d->m_finalHeaders.remove(it.value());
+		// the directory must not keep pointing to it
+		parentDir->removeEntry(it.value());
 		delete it.value();
 	        it.remove();
         }
 
     }
-    // Find or create parent dir
-    KArchiveDirectory* parentDir = rootDir();
-    QString fileName( name );
-    int i = name.lastIndexOf(QLatin1Char('/'));
-    if (i != -1) {
-        QString dir = name.left( i );
-        fileName = name.mid( i + 1 );
-        //qDebug() << "ensuring" << dir << "exists. fileName=" << fileName;
-        parentDir = findOrCreate( dir );
-    }
 
-    // construct a ZipHandlerFileEntry and add it to list
+    // Entries which may reach 4 GiB get a ZIP64 extra field in their local
+    // header, closeArchive() fills in the real sizes. Deflate can slightly
+    // expand incompressible data, hence the margin. When streaming, nothing
+    // vouches for the announced size, so every entry gets the field and
+    // a data descriptor with 64-bit sizes.
+    const bool zip64 = d->m_stream || quint64( size ) + quint64( size ) / 1000 + 1024 >= zip64Marker;
+
+    // construct a ZipHandlerFileEntry and add it to list,
+    // its position is only known once the header is written
     ZipHandlerFileEntry * e = new ZipHandlerFileEntry( archive(), fileName, perm, mtime, user, group, QString(),
-                                           name, device()->pos() + 30 + name.length(), // start
+                                           name, 0 /*start unknown yet*/,
                                            0 /*size unknown yet*/, d->m_compression, 0 /*csize unknown yet*/ );
-    e->setHeaderStart( device()->pos() );
-    //qDebug() << "wrote file start: " << e->position() << " name: " << name;
     parentDir->addEntry( e );
 
     d->m_currentFile = e;
     d->m_fileList.append( e );
-
-    int extra_field_len = 0;
-    if ( d->m_extraField == ModificationTime )
-        extra_field_len = 17;	// value also used in finishWriting()
-
-    // write out zip header
-    QByteArray encodedName = QFile::encodeName(name);
-    int bufferSize = extra_field_len + encodedName.length() + 30;
-    //qDebug() << "bufferSize=" << bufferSize;
-    char* buffer = new char[ bufferSize ];
-
-    buffer[ 0 ] = 'P'; //local file header signature
-    buffer[ 1 ] = 'K';
-    buffer[ 2 ] = 3;
-    buffer[ 3 ] = 4;
-
-    buffer[ 4 ] = 0x14; // version needed to extract
-    buffer[ 5 ] = 0;
-
-    buffer[ 6 ] = 0; // general purpose bit flag
-    buffer[ 7 ] = 0;
-
-    buffer[ 8 ] = char(e->encoding()); // compression method
-    buffer[ 9 ] = char(e->encoding() >> 8);
-
-    transformToMsDos( e->datetime(), &buffer[ 10 ] );
-
-    buffer[ 14 ] = 'C'; //dummy crc
-    buffer[ 15 ] = 'R';
-    buffer[ 16 ] = 'C';
-    buffer[ 17 ] = 'q';
-
-    buffer[ 18 ] = 'C'; //compressed file size
-    buffer[ 19 ] = 'S';
-    buffer[ 20 ] = 'I';
-    buffer[ 21 ] = 'Z';
-
-    buffer[ 22 ] = 'U'; //uncompressed file size
-    buffer[ 23 ] = 'S';
-    buffer[ 24 ] = 'I';
-    buffer[ 25 ] = 'Z';
-
-    buffer[ 26 ] = (uchar)(encodedName.length()); //fileName length
-    buffer[ 27 ] = (uchar)(encodedName.length() >> 8);
-
-    buffer[ 28 ] = (uchar)(extra_field_len); // extra field length
-    buffer[ 29 ] = (uchar)(extra_field_len >> 8);
-
-    // file name
-    strncpy( buffer + 30, encodedName.constData(), encodedName.length() );
-
-    // extra field
-    if ( d->m_extraField == ModificationTime )
-    {
-        char *extfield = buffer + 30 + encodedName.length();
-        // "Extended timestamp" header (0x5455)
-        extfield[0] = 'U';
-        extfield[1] = 'T';
-        extfield[2] = 13; // data size
-        extfield[3] = 0;
-        extfield[4] = 1 | 2 | 4;	// contains mtime, atime, ctime
-
-        extfield[5] = char(mtime);
-        extfield[6] = char(mtime >> 8);
-        extfield[7] = char(mtime >> 16);
-        extfield[8] = char(mtime >> 24);
-
-        extfield[9] = char(atime);
-        extfield[10] = char(atime >> 8);
-        extfield[11] = char(atime >> 16);
-        extfield[12] = char(atime >> 24);
-
-        extfield[13] = char(ctime);
-        extfield[14] = char(ctime >> 8);
-        extfield[15] = char(ctime >> 16);
-        extfield[16] = char(ctime >> 24);
-    }
-
-    // Write header
-    bool b = (device()->write( buffer, bufferSize ) == bufferSize );
     d->m_crc = 0L;
-    delete[] buffer;
 
-    Q_ASSERT( b );
-    if (!b) {
-        return false;
-    }
-
-    // Prepare device for writing the data
-    // Either device() if no compression, or a KFilterDev to compress
-    if ( d->m_compression == 0 ) {
-        d->m_currentDev = device();
+    // With several workers, entries to be deflated are buffered and
+    // compressed on the thread pool; writeJob() writes them out in order.
+    if ( d->m_workerCount > 1 && d->m_compression == 8 && size <= max_parallel_entry_size )
+    {
+        d->m_currentJob = new ZipDeflateJob( e, d->m_extraField, atime, mtime, ctime );
+        d->m_currentJob->input.reserve( size );
         return true;
     }
 
-    KCompressionDevice::CompressionType type = KFilterDev::compressionTypeForMimeType(QString::fromLatin1("application/x-gzip"));
-    d->m_currentDev = new KCompressionDevice(device(), false, type);
-    Q_ASSERT( d->m_currentDev );
-    if ( !d->m_currentDev ) {
-        return false; // ouch
-    }
-    static_cast<KFilterDev *>(d->m_currentDev)->setSkipHeaders(); // Just zlib, not gzip
-
-    b = d->m_currentDev->open( QIODevice::WriteOnly );
-    Q_ASSERT( b );
-    return b;
+    return d->startEntry( e, zip64, d->m_extraField, atime, mtime, ctime );
 }
 
 bool ZipHandler::doFinishWriting( qint64 size )
 {
+    if ( d->m_currentJob ) {
+        ZipDeflateJob *job = d->m_currentJob;
+        job->size = size;
+        d->m_currentJob = 0;
+        d->m_currentFile = 0L;
+        d->m_pending.append( job );
+        d->m_pool.start( job );
+        // Bound the memory held by buffered entries
+        return d->flushJobs( 2 * d->m_workerCount );
+    }
+
     if ( d->m_currentFile->encoding() == 8 ) {
         // Finish
         (void)d->m_currentDev->write( 0, 0 );
         delete d->m_currentDev;
     }
-    // If 0, d->m_currentDev was device() - don't delete ;)
+    // If 0, d->m_currentDev was the write device - don't delete ;)
     d->m_currentDev = 0L;
 
     Q_ASSERT( d->m_currentFile );
     //qDebug() << "fileName: " << d->m_currentFile->path();
-    //qDebug() << "getpos (at): " << device()->pos();
+    QIODevice* dev = d->writeDevice();
+    //qDebug() << "getpos (at): " << dev->pos();
     d->m_currentFile->setSize(size);
-    int extra_field_len = 0;
-    if ( d->m_extraField == ModificationTime )
-        extra_field_len = 17;	// value also used in finishWriting()
-
-    const QByteArray encodedName = QFile::encodeName(d->m_currentFile->path());
-    int csize = device()->pos() -
-        d->m_currentFile->headerStart() - 30 -
-		encodedName.length() - extra_field_len;
+    const qint64 csize = dev->pos() - d->m_currentFile->position();
     d->m_currentFile->setCompressedSize(csize);
     //qDebug() << "usize: " << d->m_currentFile->size();
     //qDebug() << "csize: " << d->m_currentFile->compressedSize();
@@ -1205,10 +1832,38 @@ bool ZipHandler::doFinishWriting( qint64 size )
     //qDebug() << "crc: " << d->m_crc;
     d->m_currentFile->setCRC32( d->m_crc );
 
+    // Sizes of 4 GiB and more need the ZIP64 field, only reserved in the
+    // local header when the size given to doPrepareWriting() called for it
+    const bool zip64 = d->m_zip64Entries.contains( d->m_currentFile );
+    if ( !zip64 && ( quint64( csize ) >= zip64Marker || quint64( size ) >= zip64Marker ) ) {
+        //qWarning() << "ZipHandler::doFinishWriting:" << d->m_currentFile->path() << "is larger than announced";
+        d->m_currentFile = 0L;
+        return false;
+    }
+
+    if ( d->m_stream ) {
+        // data descriptor, with 64 bit sizes if the local header has a ZIP64 field
+        char buffer[ 24 ];
+        memcpy( buffer, "PK\7\8", 4 );
+        setUInt32( buffer + 4, d->m_crc );
+        int descriptorSize;
+        if ( zip64 ) {
+            setUInt64( buffer + 8, csize );
+            setUInt64( buffer + 16, size );
+            descriptorSize = 24;
+        } else {
+            setUInt32( buffer + 8, quint32( csize ) );
+            setUInt32( buffer + 12, quint32( size ) );
+            descriptorSize = 16;
+        }
+        if ( dev->write( buffer, descriptorSize ) != descriptorSize )
+            return false;
+    }
+
     d->m_currentFile = 0L;
 
     // update saved offset for appending new files
-    d->m_offset = device()->pos();
+    d->m_offset = dev->pos();
     return true;
 }
 
@@ -1251,6 +1906,25 @@ void ZipHandler::virtual_hook( int id, void* data )
 
 bool ZipHandler::writeData(const char * data, qint64 size)
 {
+    if ( d->m_currentJob ) {
+        // compressed later, on a worker thread
+        if ( size <= max_parallel_entry_size - d->m_currentJob->input.size() ) {
+            d->m_currentJob->input.append( data, size );
+            return true;
+        }
+
+        // More data than announced: deflate it on the fly instead of
+        // buffering it, its final size is unknown now
+        ZipDeflateJob *job = d->m_currentJob;
+        d->m_currentJob = 0;
+        const QByteArray buffered = job->input;
+        const bool started = d->startEntry( job->entry, true, job->extraField,
+                                            job->atime, job->mtime, job->ctime );
+        delete job;
+        if ( !started || !writeData( buffered.constData(), buffered.size() ) )
+            return false;
+    }
+
     Q_ASSERT( d->m_currentFile );
     Q_ASSERT( d->m_currentDev );
     if (!d->m_currentFile || !d->m_currentDev) {
@@ -1286,6 +1960,27 @@ ZipHandler::ExtraField ZipHandler::extraField() const
     return d->m_extraField;
 }
 
+void ZipHandler::setStreaming( bool streaming )
+{
+    d->m_streaming = streaming;
+}
+
+bool ZipHandler::isStreaming() const
+{
+    return d->m_streaming;
+}
+
+void ZipHandler::setWorkerCount( int count )
+{
+    d->m_workerCount = qMax( 1, count );
+    d->m_pool.setMaxThreadCount( d->m_workerCount );
+}
+
+int ZipHandler::workerCount() const
+{
+    return d->m_workerCount;
+}
+
 ////////////////////////////////////////////////////////////////////////
 ////////////////////// ZipHandlerFileEntry////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////
@@ -1296,13 +1991,15 @@ public:
     : crc(0),
       compressedSize(0),
       headerStart(0),
-      encoding(0)
+      encoding(0),
+      positionResolved(true)
     {}
     unsigned long crc;
     qint64        compressedSize;
     qint64        headerStart;
     int           encoding;
     QString       path;
+    bool          positionResolved;
 };
 
 ZipHandlerFileEntry::ZipHandlerFileEntry(KArchive* zip, const QString& name, int access, int date,
@@ -1362,8 +2059,53 @@ const QString &ZipHandlerFileEntry::path() const
     return d->path;
 }
 
+void ZipHandlerFileEntry::setPositionResolved(bool resolved)
+{
+    d->positionResolved = resolved;
+}
+
+bool ZipHandlerFileEntry::resolvePosition() const
+{
+    // Entries may be read from several threads at once
+    ZipHandler *handler = static_cast<ZipHandler *>( archive()->handler() );
+    QMutexLocker locker( &handler->d->m_resolveMutex );
+    if ( d->positionResolved )
+        return true;
+
+    qint64 start;
+    if ( !readLocalDataStart( archive()->device(), d->headerStart, &start ) )
+        return false;
+    const_cast<ZipHandlerFileEntry *>( this )->setPosition( start );
+    d->positionResolved = true;
+    return true;
+}
+
 QByteArray ZipHandlerFileEntry::data() const
 {
+    // Use the mapped archive file straight away when possible
+    KArchiveHandler* handler = archive()->handler();
+    if ( handler && handler->memoryMapping() && size() > 0 && resolvePosition() ) {
+        const QByteArray mapped = handler->mappedData( position(), compressedSize() );
+        if ( !mapped.isNull() && encoding() == 0 )
+            return mapped;
+        if ( !mapped.isNull() && encoding() == 8 && size() <= INT_MAX ) {
+            QByteArray arr( size(), Qt::Uninitialized );
+            z_stream zs;
+            memset( &zs, 0, sizeof( zs ) );
+            if ( inflateInit2( &zs, -MAX_WBITS ) == Z_OK ) {
+                zs.next_in = reinterpret_cast<Bytef *>( const_cast<char *>( mapped.constData() ) );
+                zs.avail_in = mapped.size();
+                zs.next_out = reinterpret_cast<Bytef *>( arr.data() );
+                zs.avail_out = arr.size();
+                const int ret = inflate( &zs, Z_FINISH );
+                inflateEnd( &zs );
+                if ( ret == Z_STREAM_END && zs.avail_out == 0 )
+                    return arr;
+            }
+            //qWarning() << "Failed to inflate" << name() << "from the mapped archive";
+        }
+    }
+
     QIODevice* dev = createDevice();
     QByteArray arr;
     if ( dev ) {
@@ -1375,6 +2117,9 @@ QByteArray ZipHandlerFileEntry::data() const
 
 QIODevice* ZipHandlerFileEntry::createDevice() const
 {
+    if ( !resolvePosition() )
+        return 0L;
+
     //qDebug() << "creating iodevice limited to pos=" << position() << ", csize=" << compressedSize();
     // Limit the reading to the appropriate part of the underlying device (e.g. file)
     KLimitedIODevice* limitedDev = new KLimitedIODevice( archive()->device(), position(), compressedSize() );
@@ -1402,4 +2147,12 @@ QIODevice* ZipHandlerFileEntry::createDevice() const
     return 0L;
 }
 
+void ZipHandlerFileEntry::virtual_hook( int id, void* data )
+{
+    // Only data stored without compression can be copied as is
+    if ( id == StoredDataHook && ( ( encoding() != 0 && compressedSize() != 0 ) || !resolvePosition() ) )
+        return;
+    KArchiveFile::virtual_hook( id, data );
+}
+
 #include "zip.moc"
@@ -40,6 +40,10 @@ class ZipHandlerFileEntry;
  *   to leak information of how intermediate versions of files in the zip
  *   were looking.
  *
+ *   Archives and entries larger than 4 GiB, or with more than 65535 entries,
+ *   are handled with the ZIP64 extensions. When writing, the size passed to
+ *   prepareWriting() decides whether an entry gets a ZIP64 local header.
+ *
  *   For more information on the zip fileformat go to
  *   http://www.pkware.com/products/enterprise/white_papers/appnote.html
  * @author Holger Schroeder <holger-kde@holgis.net>
@@ -107,6 +111,45 @@ public:
      */
     Compression compression() const;
 
+    /**
+     * Call this before open() to write the archive in a single sequential
+     * pass: local headers then carry general purpose flag bit 3 and each
+     * entry's crc and sizes follow its data in a data descriptor, so no
+     * backward seek is ever needed. Those entries carry a ZIP64 extra field
+     * and 64-bit sizes in their data descriptor, whatever their size.
+     * This is always done when writing to a sequential device,
+     * such as a pipe, a socket or a QProcess.
+     * @param streaming true to always use data descriptors
+     * @see isStreaming()
+     */
+    void setStreaming( bool streaming );
+
+    /**
+     * Whether the archive is always written in streaming mode.
+     * @return true if data descriptors are used even for random-access devices
+     * @see setStreaming()
+     */
+    bool isStreaming() const;
+
+    /**
+     * Call this before writing files to deflate several of them at once.
+     * Files up to 64 MiB which are to be compressed are then buffered in
+     * memory and deflated on a pool of @p count threads, while the archive
+     * still gets written in the order the files were added. Up to twice
+     * @p count files may be held in memory at any time.
+     * @param count the number of worker threads, 1 (the default) to
+     * compress in the calling thread
+     * @see workerCount()
+     */
+    void setWorkerCount( int count );
+
+    /**
+     * The number of threads used to compress files.
+     * @return the number of worker threads
+     * @see setWorkerCount()
+     */
+    int workerCount() const;
+
     /**
      * Write data to a file that has been created using prepareWriting().
      * @param data a pointer to the data
@@ -152,6 +195,7 @@ protected:
     virtual void virtual_hook( int id, void* data );
 
 private:
+    friend class ZipHandlerFileEntry;
     class ZipHandlerPrivate;
     ZipHandlerPrivate * const d;
 };
@@ -193,6 +237,14 @@ public:
     /// Name with complete path - KArchiveFile::name() is the filename only (no path)
     const QString &path() const;
 
+    /**
+     * When reading, the position is first estimated from the central
+     * directory and only read from the local header when the data is
+     * accessed for the first time.
+     * @param resolved false if position() still needs to be read from the local header
+     */
+    void setPositionResolved(bool resolved);
+
     /**
      * @return the content of this file.
      * Call data() with care (only once per file), this data isn't cached.
@@ -208,7 +260,12 @@ public:
      */
     virtual QIODevice* createDevice() const;
 
+protected:
+    virtual void virtual_hook( int id, void* data );
+
 private:
+    bool resolvePosition() const;
+
     class ZipHandlerFileEntryPrivate;
     ZipHandlerFileEntryPrivate * const d;
 };
@@ -0,0 +1,2 @@
+/* Set to 1 if the archive handlers are built into the library */
+#cmakedefine01 KARCHIVE_STATIC_HANDLERS
@@ -0,0 +1,5 @@
+/* Set to 1 if you have copy_file_range() */
+#cmakedefine01 HAVE_COPY_FILE_RANGE
+
+/* Set to 1 if you have sendfile() */
+#cmakedefine01 HAVE_SENDFILE
@@ -22,8 +22,13 @@
 #include "karchive.h"
 #include "karchivehandler.h"
 #include "karchivehandlerplugin.h"
+#include "karchiveentryarena_p.h"
 #include "klimitediodevice_p.h"
 
+#include <config-compression.h>
+#include <config-handlers.h>
+#include <config-io.h>
+
 #include <qplatformdefs.h> // QT_STATBUF, QT_LSTAT
 
 #include <qsavefile.h>
@@ -34,9 +39,19 @@
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
 #include <QtCore/QFile>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonObject>
 #include <QtCore/QMimeDatabase>
 #include <QtCore/QMimeType>
+#include <QtCore/QMutex>
+#include <QtCore/QPair>
 #include <QtCore/QPluginLoader>
+#include <QtCore/QtPlugin>
+#include <QtCore/QRunnable>
+#include <QtCore/QSet>
+#include <QtCore/QThreadPool>
+#include <QtCore/QVarLengthArray>
+#include <QtCore/QVector>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,6 +65,9 @@
 #include <sys/stat.h>
 #ifdef Q_OS_UNIX
 #include <limits.h>  // PATH_MAX
+#if HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 #endif
 
 class KArchivePrivate
@@ -66,6 +84,109 @@ public:
     KArchiveHandler *handler;
 };
 
+#if KARCHIVE_STATIC_HANDLERS
+Q_IMPORT_PLUGIN(TarPlugin)
+Q_IMPORT_PLUGIN(ZipPlugin)
+Q_IMPORT_PLUGIN(ArPlugin)
+#if HAVE_XZ_SUPPORT
+Q_IMPORT_PLUGIN(SevenZipPlugin)
+#endif
+#endif
+
+/**
+ * Process-wide map of the archive handler plugins, built once from
+ * the MIME Types listed in their metadata, so that only the plugin
+ * handling a given MIME Type ever gets loaded.
+ * Handlers built into the library are looked up first, the plugin
+ * directories are only scanned for MIME Types none of them handles.
+ */
+class KArchiveHandlerRegistry
+{
+public:
+    KArchiveHandlerRegistry()
+        : scanned( false )
+    {
+        foreach (const QStaticPlugin &plugin, QPluginLoader::staticPlugins()) {
+            const QJsonObject metaData = plugin.metaData();
+            if (metaData.value(QLatin1String("IID")).toString() !=
+                    QLatin1String(KArchiveHandlerFactoryInterface_iid))
+                continue;
+
+            const QJsonArray mimeTypes = metaData.value(QLatin1String("MetaData")).toObject()
+                .value(QLatin1String("MimeTypes")).toArray();
+            foreach (const QJsonValue &mimeType, mimeTypes) {
+                const QString name = mimeType.toString();
+                if (!builtins.contains(name))
+                    builtins.insert(name, plugin.instance);
+            }
+        }
+    }
+    ~KArchiveHandlerRegistry()
+    {
+        // Plugins are never unloaded, handlers might outlive us
+        qDeleteAll( ownedLoaders );
+    }
+
+    void scan();
+
+    // Filled once at construction, read without locking
+    QHash<QString, QtPluginInstanceFunction> builtins; // MIME Type -> factory
+
+    QMutex mutex;
+    bool scanned;
+    QHash<QString, QPluginLoader *> loaders; // MIME Type -> plugin
+    QList<QPluginLoader *> unknownLoaders; // plugins without MIME Types
+    QList<QPluginLoader *> ownedLoaders;
+};
+
+void KArchiveHandlerRegistry::scan()
+{
+    if ( scanned )
+        return;
+    scanned = true;
+
+    QSet<QString> seenFiles;
+    const QStringList libPaths = QCoreApplication::libraryPaths();
+    const QString pathSuffix = QLatin1String("/karchivehandlers/");
+    foreach (const QString &libPath, libPaths) {
+        QDir dir(libPath + pathSuffix);
+        if (!dir.exists())
+            continue;
+
+        foreach (const QString &fileName, dir.entryList(QDir::Files)) {
+            const QString filePath = dir.absoluteFilePath(fileName);
+            if (seenFiles.contains(filePath))
+                continue;
+            seenFiles.insert(filePath);
+
+            // Reading the metadata doesn't load the library
+            QPluginLoader *loader = new QPluginLoader(filePath);
+            const QJsonObject metaData = loader->metaData();
+            if (metaData.value(QLatin1String("IID")).toString() !=
+                    QLatin1String(KArchiveHandlerFactoryInterface_iid)) {
+                delete loader;
+                continue;
+            }
+            ownedLoaders.append(loader);
+
+            const QJsonArray mimeTypes = metaData.value(QLatin1String("MetaData")).toObject()
+                .value(QLatin1String("MimeTypes")).toArray();
+            if (mimeTypes.isEmpty()) {
+                unknownLoaders.append(loader);
+                continue;
+            }
+            foreach (const QJsonValue &mimeType, mimeTypes) {
+                // The first plugin found in the library paths wins
+                const QString name = mimeType.toString();
+                if (!loaders.contains(name))
+                    loaders.insert(name, loader);
+            }
+        }
+    }
+}
+
+Q_GLOBAL_STATIC(KArchiveHandlerRegistry, s_handlerRegistry)
+
 ////////////////////////////////////////////////////////////////////////
 /////////////////////////// KArchive ///////////////////////////////////
 ////////////////////////////////////////////////////////////////////////
@@ -75,33 +196,41 @@ KArchive::KArchive( const QString& fileName )
 {
     Q_ASSERT( !fileName.isEmpty() );
 
-    // Detect the MIME Type
-    QMimeDatabase db;
-    QMimeType mime;
-    if (QFile::exists(fileName)) {
-        QFile file(fileName);
-        if (file.open(QIODevice::ReadOnly)) {
-            mime= db.mimeTypeForData(&file);
-            file.close();
-        }
+    // Detect the MIME Type from the archive signature, the shared MIME
+    // database is only queried for formats we don't know about
+    QString mimeType;
+    QByteArray header;
+    QFile file(fileName);
+    if (file.open(QIODevice::ReadOnly)) {
+        header = file.read(KArchiveHandler::headerSize());
+        file.close();
+        mimeType = KArchiveHandler::mimeTypeForHeader(header, fileName);
     }
 
-    // Unable to determine MIME Type from contents so get it from file name
-    if (!mime.isValid())
-        mime = db.mimeTypeForFile(fileName, QMimeDatabase::MatchExtension);
-
-    // If we still can't determine it, raise a fatal error
-    if (!mime.isValid())
-        qFatal("Could not determine the MIME Type for %s, cannot continue!",
-               qPrintable(fileName));
+    if (mimeType.isEmpty()) {
+        QMimeDatabase db;
+        QMimeType mime;
+        if (!header.isEmpty())
+            mime = db.mimeTypeForData(header);
+
+        // Unable to determine MIME Type from contents so get it from file name
+        if (!mime.isValid() || mime.isDefault())
+            mime = db.mimeTypeForFile(fileName, QMimeDatabase::MatchExtension);
+
+        // If we still can't determine it, raise a fatal error
+        if (!mime.isValid())
+            qFatal("Could not determine the MIME Type for %s, cannot continue!",
+                   qPrintable(fileName));
+        mimeType = mime.name();
+    }
 
     // Find the appropriate plugin
-    KArchiveHandler *handler = loadPlugin(mime.name());
+    KArchiveHandler *handler = loadPlugin(mimeType);
 
     // We cannot continue if no archive handler have been found
     if (!handler)
         qFatal("No archive handler have been found for %s, cannot continue!",
-               qPrintable(mime.name()));
+               qPrintable(mimeType));
 
     d->handler = handler;
     d->handler->setArchive(this);
@@ -112,18 +241,43 @@ KArchive::KArchive( QIODevice * dev )
 	: d(new KArchivePrivate)
 {
     // Detect the MIME Type
-    QMimeDatabase db;
-    QMimeType mime = db.mimeTypeForData(dev);
-    if (!mime.isValid())
-        qFatal("Could not determine the MIME Type for device, cannot continue!");
+    QString mimeType;
+    if (dev->isOpen() && dev->isReadable()) {
+        QFile *file = qobject_cast<QFile *>(dev);
+        mimeType = KArchiveHandler::mimeTypeForHeader(dev->peek(KArchiveHandler::headerSize()),
+                                                      file ? file->fileName() : QString());
+    }
+    if (mimeType.isEmpty()) {
+        QMimeDatabase db;
+        QMimeType mime = db.mimeTypeForData(dev);
+        if (!mime.isValid())
+            qFatal("Could not determine the MIME Type for device, cannot continue!");
+        mimeType = mime.name();
+    }
 
     // Find the appropriate plugin
-    KArchiveHandler *handler = loadPlugin(mime.name());
+    KArchiveHandler *handler = loadPlugin(mimeType);
 
     // We cannot continue if no archive handler have been found
     if (!handler)
         qFatal("No archive handler have been found for %s, cannot continue!",
-               qPrintable(mime.name()));
+               qPrintable(mimeType));
+
+    d->handler = handler;
+    d->handler->setArchive(this);
+    d->handler->setDevice(dev);
+}
+
+KArchive::KArchive( QIODevice * dev, const QString &mimeType )
+	: d(new KArchivePrivate)
+{
+    // Find the appropriate plugin
+    KArchiveHandler *handler = loadPlugin(mimeType);
+
+    // We cannot continue if no archive handler have been found
+    if (!handler)
+        qFatal("No archive handler have been found for %s, cannot continue!",
+               qPrintable(mimeType));
 
     d->handler = handler;
     d->handler->setArchive(this);
@@ -296,10 +450,8 @@ bool KArchive::writeFile( const QString& name, const QString& user,
 
 bool KArchive::writeData( const char* data, qint64 size )
 {
-    bool ok = device()->write( data, size ) == size;
-    if ( !ok )
-        d->handler->abortWriting();
-    return ok;
+    // The handler may compress the data or compute checksums
+    return d->handler->writeData( data, size );
 }
 
 // The writeDir -> doWriteDir pattern allows to avoid propagating the default
@@ -375,30 +527,57 @@ QString KArchive::fileName() const
     return d->handler->fileName();
 }
 
+KArchiveHandler * KArchive::handler() const
+{
+    return d->handler;
+}
+
 KArchiveHandler *KArchive::loadPlugin( const QString &mimeType )
 {
-    KArchiveHandler *handler = 0;
+    KArchiveHandlerRegistry *registry = s_handlerRegistry();
+
+    QtPluginInstanceFunction builtin = registry->builtins.value( mimeType );
+    if (builtin) {
+        KArchiveHandlerPlugin *plugin = qobject_cast<KArchiveHandlerPlugin *>(builtin());
+        if (plugin) {
+            KArchiveHandler *handler = plugin->create(mimeType);
+            if (handler)
+                return handler;
+        }
+    }
 
-    const QStringList libPaths = QCoreApplication::libraryPaths();
-    const QString pathSuffix = QLatin1String("/karchivehandlers/");
-    foreach (const QString &libPath, libPaths) {
-        QDir dir(libPath + pathSuffix);
-        if (!dir.exists())
-            continue;
+    QPluginLoader *loader = 0;
+    QList<QPluginLoader *> unknownLoaders;
+    {
+        QMutexLocker locker( &registry->mutex );
+        registry->scan();
+        loader = registry->loaders.value( mimeType );
+        unknownLoaders = registry->unknownLoaders;
+    }
 
-        foreach (const QString &fileName, dir.entryList(QDir::Files)) {
-            QPluginLoader loader(fileName);
-            KArchiveHandlerPlugin *plugin =
-                qobject_cast<KArchiveHandlerPlugin *>(loader.instance());
-            if (plugin) {
-                handler = plugin->create(mimeType);
-                if (handler)
-                    break;
-            }
+    if (loader) {
+        // QPluginLoader::instance() is thread-safe and only loads once
+        KArchiveHandlerPlugin *plugin =
+            qobject_cast<KArchiveHandlerPlugin *>(loader->instance());
+        if (plugin) {
+            KArchiveHandler *handler = plugin->create(mimeType);
+            if (handler)
+                return handler;
+        }
+    }
+
+    // Plugins that don't list their MIME Types have to be asked
+    foreach (QPluginLoader *unknown, unknownLoaders) {
+        KArchiveHandlerPlugin *plugin =
+            qobject_cast<KArchiveHandlerPlugin *>(unknown->instance());
+        if (plugin) {
+            KArchiveHandler *handler = plugin->create(mimeType);
+            if (handler)
+                return handler;
         }
     }
 
-    return handler;
+    return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -428,16 +607,55 @@ public:
     KArchive* archive;
 };
 
+/**
+ * Allocates the private data of @p entry from @p arena when the entry was
+ * allocated there (see KArchiveEntry::operator new()), so that it gets
+ * released along with it. The entry being under construction, this is
+ * the case when it is the last entry allocated from the arena.
+ */
+static void *allocatePrivate( size_t size, KArchiveEntryArena *arena, const void *entry )
+{
+    return KArchiveEntryArena::allocate( size, arena && arena->holdsLastEntry( entry ) ? arena : 0 );
+}
+
+template<typename T>
+static void destroyPrivate( T *d )
+{
+    d->~T();
+    KArchiveEntryArena::release( d );
+}
+
 KArchiveEntry::KArchiveEntry( KArchive* t, const QString& name, int access, int date,
                       const QString& user, const QString& group, const
                       QString& symlink) :
-    d(new KArchiveEntryPrivate(t,name,access,date,user,group,symlink))
+    d(new (allocatePrivate(sizeof(KArchiveEntryPrivate), t ? t->handler()->entryArena() : 0, this))
+          KArchiveEntryPrivate(t,name,access,date,user,group,symlink))
 {
 }
 
 KArchiveEntry::~KArchiveEntry()
 {
-    delete d;
+    destroyPrivate(d);
+}
+
+void *KArchiveEntry::operator new( size_t size )
+{
+    return KArchiveEntryArena::allocate( size, 0 );
+}
+
+void *KArchiveEntry::operator new( size_t size, KArchive *archive )
+{
+    return KArchiveEntryArena::allocateEntry( size, archive ? archive->handler()->entryArena() : 0 );
+}
+
+void KArchiveEntry::operator delete( void *ptr )
+{
+    KArchiveEntryArena::release( ptr );
+}
+
+void KArchiveEntry::operator delete( void *ptr, KArchive * )
+{
+    KArchiveEntryArena::release( ptr );
 }
 
 QDateTime KArchiveEntry::datetime() const
@@ -512,13 +730,14 @@ KArchiveFile::KArchiveFile( KArchive* t, const QString& name, int access, int da
                             const QString & symlink,
                             qint64 pos, qint64 size )
   : KArchiveEntry( t, name, access, date, user, group, symlink ),
-    d( new KArchiveFilePrivate(pos, size) )
+    d( new (allocatePrivate(sizeof(KArchiveFilePrivate), t ? t->handler()->entryArena() : 0, this))
+           KArchiveFilePrivate(pos, size) )
 {
 }
 
 KArchiveFile::~KArchiveFile()
 {
-    delete d;
+    destroyPrivate(d);
 }
 
 qint64 KArchiveFile::position() const
@@ -526,6 +745,11 @@ qint64 KArchiveFile::position() const
   return d->pos;
 }
 
+void KArchiveFile::setPosition( qint64 pos )
+{
+    d->pos = pos;
+}
+
 qint64 KArchiveFile::size() const
 {
   return d->size;
@@ -538,16 +762,20 @@ void KArchiveFile::setSize( qint64 s )
 
 QByteArray KArchiveFile::data() const
 {
-  bool ok = archive()->device()->seek( d->pos );
-  if (!ok) {
-      //qWarning() << "Failed to sync to" << d->pos << "to read" << name();
+  // Stored straight in a mapped archive file: no copy
+  KArchiveHandler* handler = archive()->handler();
+  if ( handler && d->size ) {
+      const QByteArray mapped = handler->mappedData( d->pos, d->size );
+      if ( !mapped.isNull() )
+          return mapped;
   }
 
-  // Read content
+  // Read content, without moving the shared position of the archive device
   QByteArray arr;
   if ( d->size )
   {
-    arr = archive()->device()->read( d->size );
+    KLimitedIODevice dev( archive()->device(), d->pos, d->size );
+    arr = dev.read( d->size );
     Q_ASSERT( arr.size() == d->size );
   }
   return arr;
@@ -568,25 +796,97 @@ void KArchiveFile::copyTo(const QString& dest) const
   QFile f( dest + QLatin1Char('/')  + name() );
   if ( f.open( QIODevice::ReadWrite | QIODevice::Truncate ) )
   {
-      QIODevice* inputDev = createDevice();
-
-      // Read and write data in chunks to minimize memory usage
-      const qint64 chunkSize = 1024 * 1024;
-      qint64 remainingSize = d->size;
-      QByteArray array;
-      array.resize( int( qMin( chunkSize, remainingSize ) ) );
-
-      while ( remainingSize > 0 ) {
-          const qint64 currentChunkSize = qMin( chunkSize, remainingSize );
-          const qint64 n = inputDev->read( array.data(), currentChunkSize );
-          Q_ASSERT( n == currentChunkSize );
-          f.write( array.data(), currentChunkSize );
-          remainingSize -= currentChunkSize;
-      }
+      if ( !writeToDescriptor( f.handle() ) )
+          qWarning() << "Failed to extract" << name() << "to" << f.fileName();
       f.close();
+  }
+  else
+      qWarning() << "Couldn't create" << f.fileName() << ":" << f.errorString();
+}
 
-      delete inputDev;
+#if HAVE_COPY_FILE_RANGE || HAVE_SENDFILE
+/**
+ * Copies @p size bytes from @p offset in @p in to @p out within the kernel.
+ * @return the number of bytes copied, the caller copies the rest
+ */
+static qint64 kernelCopy( int in, qint64 offset, int out, qint64 size )
+{
+  // Stay below the limit of a single sendfile() call
+  const qint64 maxChunk = 1 << 30;
+  qint64 done = 0;
+#if HAVE_COPY_FILE_RANGE
+  // Can reflink, but needs Linux 5.3 to copy across filesystems
+  while ( done < size ) {
+      loff_t off = offset + done;
+      const ssize_t n = ::copy_file_range( in, &off, out, NULL, qMin( maxChunk, size - done ), 0 );
+      if ( n < 0 && errno == EINTR )
+          continue;
+      if ( n <= 0 )
+          break;
+      done += n;
   }
+#endif
+#if HAVE_SENDFILE
+  while ( done < size ) {
+      off_t off = offset + done;
+      const ssize_t n = ::sendfile( out, in, &off, qMin( maxChunk, size - done ) );
+      if ( n < 0 && errno == EINTR )
+          continue;
+      if ( n <= 0 )
+          break;
+      done += n;
+  }
+#endif
+  return done;
+}
+#endif
+
+bool KArchiveFile::writeToDescriptor( int fd ) const
+{
+  QIODevice* inputDev = createDevice();
+  if ( !inputDev )
+      return false;
+
+  qint64 done = 0;
+#if HAVE_COPY_FILE_RANGE || HAVE_SENDFILE
+  // Stored data read straight from the archive file
+  StoredData stored = { -1, 0 };
+  const_cast<KArchiveFile *>( this )->virtual_hook( StoredDataHook, &stored );
+  if ( stored.fd >= 0 )
+      done = kernelCopy( stored.fd, stored.offset, fd, d->size );
+#endif
+
+  bool ok = done == d->size || inputDev->seek( done );
+
+  // Read and write data in chunks to minimize memory usage
+  const qint64 chunkSize = 1024 * 1024;
+  qint64 remainingSize = d->size - done;
+  QByteArray array;
+  array.resize( int( qMin( chunkSize, remainingSize ) ) );
+
+  while ( ok && remainingSize > 0 ) {
+      const qint64 currentChunkSize = qMin( chunkSize, remainingSize );
+      const qint64 n = inputDev->read( array.data(), currentChunkSize );
+      if ( n <= 0 ) {
+          ok = false;
+          break;
+      }
+      qint64 written = 0;
+      while ( written < n ) {
+          const ssize_t w = QT_WRITE( fd, array.constData() + written, n - written );
+          if ( w < 0 && errno == EINTR )
+              continue;
+          if ( w <= 0 ) {
+              ok = false;
+              break;
+          }
+          written += w;
+      }
+      remainingSize -= n;
+  }
+
+  delete inputDev;
+  return ok;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -596,25 +896,97 @@ void KArchiveFile::copyTo(const QString& dest) const
 class KArchiveDirectoryPrivate
 {
 public:
+    KArchiveDirectoryPrivate()
+        : root( 0 )
+    {}
     ~KArchiveDirectoryPrivate()
     {
         qDeleteAll(entries);
     }
+
+    /**
+     * The directory holding the path index, this one if it
+     * hasn't been added to another directory.
+     */
+    KArchiveDirectoryPrivate *indexOwner()
+    {
+        return root ? root : this;
+    }
+
+    void adopt( KArchiveDirectoryPrivate *owner, const QString &fullPath );
+    void unindex( KArchiveDirectoryPrivate *owner );
+    void detach();
+
     QHash<QString, KArchiveEntry *> entries;
+    QVector<KArchiveEntry *> ordered; // The same entries, in the order they were added
+
+    KArchiveDirectoryPrivate *root;
+    QString path; // Full path from the root, without leading or trailing slash
+    QHash<QString, KArchiveEntry *> index; // Full path -> entry, in the root only
 };
 
+/**
+ * Moves this directory and everything below it under the index of @p owner.
+ */
+void KArchiveDirectoryPrivate::adopt( KArchiveDirectoryPrivate *owner, const QString &fullPath )
+{
+    root = owner;
+    path = fullPath;
+    index.clear();
+
+    QHash<QString, KArchiveEntry *>::const_iterator it = entries.constBegin();
+    for ( ; it != entries.constEnd(); ++it ) {
+        const QString childPath = path + QLatin1Char('/') + it.key();
+        owner->index.insert( childPath, it.value() );
+        if ( it.value()->isDirectory() )
+            static_cast<KArchiveDirectory *>( it.value() )->d->adopt( owner, childPath );
+    }
+}
+
+/**
+ * Removes everything below this directory from the index of @p owner.
+ */
+void KArchiveDirectoryPrivate::unindex( KArchiveDirectoryPrivate *owner )
+{
+    QHash<QString, KArchiveEntry *>::const_iterator it = entries.constBegin();
+    for ( ; it != entries.constEnd(); ++it ) {
+        owner->index.remove( path + QLatin1Char('/') + it.key() );
+        if ( it.value()->isDirectory() )
+            static_cast<KArchiveDirectory *>( it.value() )->d->unindex( owner );
+    }
+}
+
+/**
+ * Makes this directory the root of its own index again,
+ * once removed from its parent.
+ */
+void KArchiveDirectoryPrivate::detach()
+{
+    root = 0;
+    path.clear();
+    index.clear();
+
+    QHash<QString, KArchiveEntry *>::const_iterator it = entries.constBegin();
+    for ( ; it != entries.constEnd(); ++it ) {
+        index.insert( it.key(), it.value() );
+        if ( it.value()->isDirectory() )
+            static_cast<KArchiveDirectory *>( it.value() )->d->adopt( this, it.key() );
+    }
+}
+
 KArchiveDirectory::KArchiveDirectory( KArchive* t, const QString& name, int access,
                               int date,
                               const QString& user, const QString& group,
                               const QString &symlink)
   : KArchiveEntry( t, name, access, date, user, group, symlink ),
-    d( new KArchiveDirectoryPrivate )
+    d( new (allocatePrivate(sizeof(KArchiveDirectoryPrivate), t ? t->handler()->entryArena() : 0, this))
+           KArchiveDirectoryPrivate )
 {
 }
 
 KArchiveDirectory::~KArchiveDirectory()
 {
-  delete d;
+  destroyPrivate(d);
 }
 
 QStringList KArchiveDirectory::entries() const
@@ -624,38 +996,64 @@ QStringList KArchiveDirectory::entries() const
 
 const KArchiveEntry* KArchiveDirectory::entry( const QString& _name ) const
 {
+    KArchiveDirectoryPrivate *owner = d->indexOwner();
+
+    // Fast path: an already normalized path, looked up from the root
+    if ( owner == d ) {
+        const KArchiveEntry* e = owner->index.value( _name );
+        if ( e )
+            return e;
+    }
+
     QString name = QDir::cleanPath(_name);
-    int pos = name.indexOf( QLatin1Char('/') );
-  if ( pos == 0 ) // ouch absolute path (see also KArchive::findOrCreate)
-  {
-    if (name.length()>1)
-    {
-      name = name.mid( 1 ); // remove leading slash
-      pos = name.indexOf( QLatin1Char('/') ); // look again
+    if ( name.startsWith( QLatin1Char('/') ) ) // ouch absolute path (see also KArchive::findOrCreate)
+        name.remove( 0, 1 ); // remove leading slash
+    if ( name.endsWith( QLatin1Char('/') ) ) // trailing slash ? -> remove
+        name.chop( 1 );
+    if ( name.isEmpty() ) {
+        if ( _name.isEmpty() )
+            return 0;
+        return this; // "/"
     }
-    else // "/"
-      return this;
-  }
-  // trailing slash ? -> remove
-  if ( pos != -1 && pos == name.length()-1 )
-  {
-    name = name.left( pos );
-    pos = name.indexOf( QLatin1Char('/') ); // look again
-  }
-  if ( pos != -1 )
-  {
-    const QString left = name.left(pos);
-    const QString right = name.mid(pos + 1);
 
-    //qDebug() << "left=" << left << "right=" << right;
+    if ( d->path.isEmpty() )
+        return owner->index.value( name );
+    return owner->index.value( d->path + QLatin1Char('/') + name );
+}
 
-    const KArchiveEntry* e = d->entries.value( left );
-    if ( !e || !e->isDirectory() )
-      return 0;
-    return static_cast<const KArchiveDirectory*>(e)->entry( right );
-  }
+KArchiveEntryVisitor::~KArchiveEntryVisitor()
+{
+}
+
+int KArchiveDirectory::count() const
+{
+    return d->ordered.count();
+}
+
+const KArchiveEntry* KArchiveDirectory::entryAt( int index ) const
+{
+    return d->ordered.at( index );
+}
 
-  return d->entries.value( name );
+bool KArchiveDirectory::visit( KArchiveEntryVisitor* visitor, bool recursive ) const
+{
+    // The directories being walked, with the index of their next entry
+    QVarLengthArray<QPair<const KArchiveDirectory *, int>, 64> stack;
+    stack.append( qMakePair( this, 0 ) );
+    while ( !stack.isEmpty() ) {
+        QPair<const KArchiveDirectory *, int> &top = stack.last();
+        const KArchiveDirectory *dir = top.first;
+        if ( top.second == dir->d->ordered.count() ) {
+            stack.resize( stack.size() - 1 );
+            continue;
+        }
+        const KArchiveEntry *entry = dir->d->ordered.at( top.second++ );
+        if ( !visitor->visitEntry( entry, dir ) )
+            return false;
+        if ( recursive && entry->isDirectory() )
+            stack.append( qMakePair( static_cast<const KArchiveDirectory *>( entry ), 0 ) );
+    }
+    return true;
 }
 
 void KArchiveDirectory::addEntry( KArchiveEntry* entry )
@@ -669,6 +1067,34 @@ void KArchiveDirectory::addEntry( KArchiveEntry* entry )
       return;
   }
   d->entries.insert( entry->name(), entry );
+  d->ordered.append( entry );
+
+  // Keep the archive-wide path index up to date
+  KArchiveDirectoryPrivate *owner = d->indexOwner();
+  const QString fullPath = d->path.isEmpty() ? entry->name()
+                                             : d->path + QLatin1Char('/') + entry->name();
+  owner->index.insert( fullPath, entry );
+  if ( entry->isDirectory() )
+      static_cast<KArchiveDirectory *>( entry )->d->adopt( owner, fullPath );
+}
+
+void KArchiveDirectory::removeEntry( KArchiveEntry* entry )
+{
+  if ( !entry || d->entries.value( entry->name() ) != entry )
+    return;
+
+  d->entries.remove( entry->name() );
+  d->ordered.remove( d->ordered.indexOf( entry ) );
+
+  KArchiveDirectoryPrivate *owner = d->indexOwner();
+  const QString fullPath = d->path.isEmpty() ? entry->name()
+                                             : d->path + QLatin1Char('/') + entry->name();
+  owner->index.remove( fullPath );
+  if ( entry->isDirectory() ) {
+      KArchiveDirectoryPrivate *dirPrivate = static_cast<KArchiveDirectory *>( entry )->d;
+      dirPrivate->unindex( owner );
+      dirPrivate->detach();
+  }
 }
 
 bool KArchiveDirectory::isDirectory() const
@@ -676,16 +1102,47 @@ bool KArchiveDirectory::isDirectory() const
     return true;
 }
 
-static bool sortByPosition( const KArchiveFile* file1, const KArchiveFile* file2 ) {
-    return file1->position() < file2->position();
+typedef QPair<const KArchiveFile*, QString> KArchiveFileCopy;
+
+static bool sortByPosition( const KArchiveFileCopy& file1, const KArchiveFileCopy& file2 ) {
+    return file1.first->position() < file2.first->position();
 }
 
+/**
+ * Extracts files on a worker thread. The workers share the list of files,
+ * each taking the next one, so that reading stays roughly in order.
+ */
+class KArchiveCopyJob : public QRunnable
+{
+public:
+    KArchiveCopyJob( const QList<KArchiveFileCopy>& files, QAtomicInt& next )
+        : m_files( files ), m_next( next )
+    {
+    }
+
+    virtual void run()
+    {
+        int i;
+        while ( ( i = m_next.fetchAndAddOrdered( 1 ) ) < m_files.size() ) {
+            m_files.at( i ).first->copyTo( m_files.at( i ).second );
+        }
+    }
+
+private:
+    const QList<KArchiveFileCopy>& m_files;
+    QAtomicInt& m_next;
+};
+
 void KArchiveDirectory::copyTo(const QString& dest, bool recursiveCopy ) const
+{
+  copyTo( dest, recursiveCopy, 1 );
+}
+
+void KArchiveDirectory::copyTo(const QString& dest, bool recursiveCopy, int workers ) const
 {
   QDir root;
 
-  QList<const KArchiveFile*> fileList;
-  QMap<qint64, QString> fileToDir;
+  QList<KArchiveFileCopy> fileList;
 
   // placeholders for iterated items
   QStack<const KArchiveDirectory *> dirStack;
@@ -698,9 +1155,8 @@ void KArchiveDirectory::copyTo(const QString& dest, bool recursiveCopy ) const
     const QString curDirName = dirNameStack.pop();
     root.mkdir(curDirName);
 
-    const QStringList dirEntries = curDir->entries();
-    for ( QStringList::const_iterator it = dirEntries.begin(); it != dirEntries.end(); ++it ) {
-      const KArchiveEntry* curEntry = curDir->entry(*it);
+    for ( int i = 0; i < curDir->count(); ++i ) {
+      const KArchiveEntry* curEntry = curDir->entryAt(i);
       if (!curEntry->symLinkTarget().isEmpty()) {
           const QString linkName = curDirName+QLatin1Char('/')+curEntry->name();
           // To create a valid link on Windows, linkName must have a .lnk file extension.
@@ -717,8 +1173,7 @@ void KArchiveDirectory::copyTo(const QString& dest, bool recursiveCopy ) const
           if ( curEntry->isFile() ) {
               const KArchiveFile* curFile = dynamic_cast<const KArchiveFile*>( curEntry );
               if (curFile) {
-                  fileList.append( curFile );
-                  fileToDir.insert( curFile->position(), curDirName );
+                  fileList.append( KArchiveFileCopy( curFile, curDirName ) );
               }
           }
 
@@ -735,11 +1190,22 @@ void KArchiveDirectory::copyTo(const QString& dest, bool recursiveCopy ) const
 
   qSort( fileList.begin(), fileList.end(), sortByPosition );  // sort on d->pos, so we have a linear access
 
-  for ( QList<const KArchiveFile*>::const_iterator it = fileList.constBegin(), end = fileList.constEnd() ;
+  // Entries can only be read at once from a file, see KLimitedIODevice
+  const QFileDevice* file = qobject_cast<const QFileDevice *>( archive()->device() );
+  if ( workers > 1 && fileList.size() > 1 && file && file->openMode() == QIODevice::ReadOnly ) {
+      QAtomicInt next( 0 );
+      QThreadPool pool;
+      pool.setMaxThreadCount( workers );
+      for ( int i = 0; i < qMin( workers, fileList.size() ); ++i ) {
+          pool.start( new KArchiveCopyJob( fileList, next ) );
+      }
+      pool.waitForDone();
+      return;
+  }
+
+  for ( QList<KArchiveFileCopy>::const_iterator it = fileList.constBegin(), end = fileList.constEnd() ;
         it != end ; ++it ) {
-      const KArchiveFile* f = *it;
-      qint64 pos = f->position();
-      f->copyTo( fileToDir[pos] );
+      it->first->copyTo( it->second );
   }
 }
 
@@ -750,7 +1216,19 @@ void KArchiveEntry::virtual_hook( int, void* )
 { /*BASE::virtual_hook( id, data );*/ }
 
 void KArchiveFile::virtual_hook( int id, void* data )
-{ KArchiveEntry::virtual_hook( id, data ); }
+{
+    if ( id == StoredDataHook ) {
+        // Same condition as KLimitedIODevice for reading with pread()
+        StoredData* stored = static_cast<StoredData *>( data );
+        const QFileDevice* file = qobject_cast<const QFileDevice *>( archive()->device() );
+        if ( file && file->openMode() == QIODevice::ReadOnly && !file->isSequential() ) {
+            stored->fd = file->handle();
+            stored->offset = d->pos;
+        }
+        return;
+    }
+    KArchiveEntry::virtual_hook( id, data );
+}
 
 void KArchiveDirectory::virtual_hook( int id, void* data )
 { KArchiveEntry::virtual_hook( id, data ); }
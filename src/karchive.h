@@ -66,6 +66,14 @@ public:
      */
     KArchive( QIODevice * dev );
 
+    /**
+     * Constructor for devices whose contents can't be used to guess the
+     * MIME Type, for instance a pipe or a socket opened for writing.
+     * @param dev the I/O device where the archive reads or writes its data
+     * @param mimeType the MIME Type of the archive, e.g. "application/zip"
+     */
+    KArchive( QIODevice * dev, const QString &mimeType );
+
 public:
     virtual ~KArchive();
 
@@ -112,6 +120,13 @@ public:
      */
     QString fileName() const;
 
+    /**
+     * The handler taking care of this archive's format, for access
+     * to format specific options such as ZipHandler::setStreaming().
+     * @return the archive handler
+     */
+    KArchiveHandler * handler() const;
+
     /**
      * If an archive is opened for reading, then the contents
      * of the archive can be accessed via this function.
@@ -212,7 +227,7 @@ public:
      * Call prepareWriting(), then call writeData()
      * as many times as wanted then call finishWriting( totalSize ).
      * For tar.gz files, you need to know the size before hand, it is needed in the header!
-     * For zip files, size isn't used.
+     * For zip files, size is only used to decide whether the entry needs ZIP64 extensions.
      *
      * This method also allows some file metadata to be
      * set. However, depending on the archive type not all metadata might be
@@ -377,6 +392,24 @@ public:
 
     virtual ~KArchiveEntry();
 
+    /**
+     * Allocates an entry on the heap.
+     */
+    static void *operator new( size_t size );
+
+    /**
+     * Allocates an entry, and its private data, along with the other
+     * entries of @p archive. Handlers use this for the entries they create
+     * while opening an archive. The entries are still destroyed one by one
+     * when the archive gets closed, releasing what they own, but their
+     * memory is then released all at once.
+     * @warning the entry must not be deleted after the archive was closed
+     */
+    static void *operator new( size_t size, KArchive *archive );
+
+    static void operator delete( void *ptr );
+    static void operator delete( void *ptr, KArchive *archive );
+
     /**
      * Creation date of the file.
      * @return the creation date
@@ -475,6 +508,12 @@ public:
      * @return the position of the file
      */
     qint64 position() const;
+    /**
+     * Set position of the data, for handlers that only know it
+     * once the entry is first accessed.
+     * @param pos the new position of the file
+     */
+    void setPosition( qint64 pos );
     /**
      * Size of the data.
      * @return the size of the file
@@ -517,13 +556,47 @@ public:
      */
     void copyTo(const QString& dest) const;
 
+    /**
+     * Writes the content of the file to the file descriptor @p fd, at its
+     * current offset. Data stored without compression in an archive file
+     * is copied by the kernel where possible (copy_file_range or sendfile).
+     * @param fd the descriptor to write to
+     * @return true on success
+     */
+    bool writeToDescriptor(int fd) const;
+
 protected:
+    /**
+     * The ids of the virtual_hook() calls made by KArchiveFile.
+     */
+    enum VirtualHookId {
+        /**
+         * Asks where the data of the file lies as is in the archive file,
+         * for writeToDescriptor() to let the kernel copy it. @c data
+         * points to a StoredData, whose descriptor is left to -1 when the
+         * data can't be read straight from the archive file.
+         * The default implementation answers for the data read by
+         * KArchiveFile::createDevice(), subclasses decoding the data in
+         * createDevice() have to reimplement it.
+         */
+        StoredDataHook = 1
+    };
+    /**
+     * Where the data of a file lies in the archive file.
+     * @see StoredDataHook
+     */
+    struct StoredData {
+        int fd; ///< the descriptor of the archive file, or -1
+        qint64 offset; ///< the position of the data in the archive file
+    };
+
     virtual void virtual_hook( int id, void* data );
 private:
     KArchiveFilePrivate* const d;
 };
 
 class KArchiveDirectoryPrivate;
+class KArchiveEntryVisitor;
 /**
  * Represents a directory entry in a KArchive.
  * @short A directory in an archive.
@@ -561,16 +634,52 @@ public:
     /**
      * Returns the entry with the given name.
      * @param name may be "test1", "mydir/test3", "mydir/mysubdir/test3", etc.
+     * Paths are resolved with a single lookup in an index of the whole
+     * archive, with no string allocation when called on the root directory
+     * with a clean path.
      * @return a pointer to the entry in the directory.
      */
     const KArchiveEntry* entry( const QString& name ) const;
 
+    /**
+     * Returns the number of sub-entries.
+     * @see entryAt()
+     */
+    int count() const;
+
+    /**
+     * Returns the sub-entry at @p index. Entries are kept in the order
+     * they were added, which is their order in the archive when reading.
+     * Unlike going through entries(), this builds no list and looks up
+     * no name.
+     * @param index the index of the entry, from 0 to count() - 1
+     * @return a pointer to the entry
+     */
+    const KArchiveEntry* entryAt( int index ) const;
+
+    /**
+     * Walks over the sub-entries in the order of entryAt(), calling
+     * @p visitor for each of them. With @p recursive, the entries of
+     * a subdirectory are visited right after the subdirectory itself.
+     * @param visitor the visitor called for each entry
+     * @param recursive if set to true, subdirectories are walked as well
+     * @return false if the visitor stopped the walk, true otherwise
+     */
+    bool visit( KArchiveEntryVisitor* visitor, bool recursive = true ) const;
+
     /**
      * @internal
      * Adds a new entry to the directory.
      */
     void addEntry( KArchiveEntry* );
 
+    /**
+     * @internal
+     * Removes an entry from the directory, without deleting it.
+     * @param entry the entry to remove, which the caller then owns
+     */
+    void removeEntry( KArchiveEntry* entry );
+
     /**
      * Checks whether this entry is a directory.
      * @return true, since this entry is a directory
@@ -585,10 +694,40 @@ public:
      */
      void copyTo(const QString& dest, bool recursive = true) const;
 
+    /**
+     * Extracts all entries in this archive directory to the directory
+     * @p dest, on up to @p workers threads. Each thread reads its own
+     * entry, in order of position in the archive.
+     * Entries can only be read in parallel from archives opened read-only
+     * on a file, others get extracted one after another.
+     * @param dest the directory to extract to
+     * @param recursive if set to true, subdirectories are extracted as well
+     * @param workers the number of threads extracting files
+     */
+     void copyTo(const QString& dest, bool recursive, int workers) const;
+
 protected:
     virtual void virtual_hook( int id, void* data );
 private:
+    friend class KArchiveDirectoryPrivate;
     KArchiveDirectoryPrivate* const d;
 };
 
+/**
+ * An object called on the entries of a directory by KArchiveDirectory::visit().
+ */
+class KARCHIVE_EXPORT KArchiveEntryVisitor
+{
+public:
+    virtual ~KArchiveEntryVisitor();
+
+    /**
+     * Called for every entry walked over.
+     * @param entry the entry
+     * @param parent the directory holding @p entry
+     * @return true to go on walking, false to stop
+     */
+    virtual bool visitEntry( const KArchiveEntry* entry, const KArchiveDirectory* parent ) = 0;
+};
+
 #endif
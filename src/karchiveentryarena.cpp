@@ -0,0 +1,114 @@
+/* This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "karchiveentryarena_p.h"
+
+#include <stdlib.h>
+
+// The tag in front of every allocation, padded to keep the memory
+// after it aligned for any type
+static const size_t s_tagSize = 16;
+static const size_t s_heapTag = 0;
+static const size_t s_arenaTag = 1;
+
+static const size_t s_blockSize = 64 * 1024;
+
+KArchiveEntryArena::KArchiveEntryArena()
+    : m_block( 0 ), m_next( 0 ), m_left( 0 ), m_lastEntry( 0 ), m_lastEntryEnd( 0 )
+{
+}
+
+KArchiveEntryArena::~KArchiveEntryArena()
+{
+    clear();
+}
+
+//static
+void *KArchiveEntryArena::allocate( size_t size, KArchiveEntryArena *arena )
+{
+    const size_t total = ( size + s_tagSize + s_tagSize - 1 ) & ~( s_tagSize - 1 );
+
+    char *mem;
+    size_t tag;
+    if ( arena && total <= s_blockSize / 4 ) {
+        mem = static_cast<char *>( arena->allocateFromBlock( total ) );
+        tag = s_arenaTag;
+    } else {
+        // No arena, or too big to be worth keeping there
+        mem = static_cast<char *>( malloc( total ) );
+        Q_CHECK_PTR( mem );
+        tag = s_heapTag;
+    }
+    *reinterpret_cast<size_t *>( mem ) = tag;
+    return mem + s_tagSize;
+}
+
+//static
+void *KArchiveEntryArena::allocateEntry( size_t size, KArchiveEntryArena *arena )
+{
+    char *mem = static_cast<char *>( allocate( size, arena ) );
+    if ( arena && *reinterpret_cast<size_t *>( mem - s_tagSize ) == s_arenaTag ) {
+        arena->m_lastEntry = mem;
+        arena->m_lastEntryEnd = mem + size;
+    }
+    return mem;
+}
+
+//static
+void KArchiveEntryArena::release( void *ptr )
+{
+    if ( !ptr )
+        return;
+    char *mem = static_cast<char *>( ptr ) - s_tagSize;
+    if ( *reinterpret_cast<size_t *>( mem ) == s_heapTag )
+        free( mem );
+}
+
+bool KArchiveEntryArena::holdsLastEntry( const void *ptr ) const
+{
+    const quintptr p = reinterpret_cast<quintptr>( ptr );
+    return m_lastEntry && p >= reinterpret_cast<quintptr>( m_lastEntry )
+                       && p < reinterpret_cast<quintptr>( m_lastEntryEnd );
+}
+
+void KArchiveEntryArena::clear()
+{
+    foreach ( char *block, m_blocks )
+        free( block );
+    m_blocks.clear();
+    m_block = 0;
+    m_next = 0;
+    m_left = 0;
+    m_lastEntry = 0;
+    m_lastEntryEnd = 0;
+}
+
+void *KArchiveEntryArena::allocateFromBlock( size_t size )
+{
+    if ( size > m_left ) {
+        char *block = static_cast<char *>( malloc( s_blockSize ) );
+        Q_CHECK_PTR( block );
+        m_blocks.append( block );
+        m_block = block;
+        m_next = block;
+        m_left = s_blockSize;
+    }
+    void *mem = m_next;
+    m_next += size;
+    m_left -= size;
+    return mem;
+}
@@ -0,0 +1,86 @@
+/* This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef karchiveentryarena_p_h
+#define karchiveentryarena_p_h
+
+#include <QtCore/QList>
+
+#include <stddef.h>
+
+/**
+ * Memory for the entries of an open archive, and their private data.
+ * Allocations are carved out of large blocks, which are all released
+ * at once by clear(), once the entry tree has been deleted.
+ *
+ * Every allocation, from the arena or from the heap, starts with a tag
+ * saying where it comes from, so that deleting an entry only gives the
+ * memory back to the heap when it was allocated there.
+ * @internal - used by KArchiveHandler and KArchiveEntry
+ */
+class KArchiveEntryArena
+{
+public:
+    KArchiveEntryArena();
+    ~KArchiveEntryArena();
+
+    /**
+     * Allocates @p size bytes from @p arena, or from the heap when
+     * @p arena is 0. Not thread-safe.
+     * @return the memory, suitably aligned for any entry
+     */
+    static void *allocate( size_t size, KArchiveEntryArena *arena );
+
+    /**
+     * Same as allocate(), for an entry: the arena remembers the last
+     * entry it holds, for the entry's private data to be allocated
+     * there as well.
+     * @see holdsLastEntry()
+     */
+    static void *allocateEntry( size_t size, KArchiveEntryArena *arena );
+
+    /**
+     * Releases memory returned by allocate(). Memory from an arena
+     * is only released by clear().
+     */
+    static void release( void *ptr );
+
+    /**
+     * Whether @p ptr lies in the last entry allocated from this arena
+     * with allocateEntry(), i.e. whether an entry under construction
+     * is in the arena.
+     */
+    bool holdsLastEntry( const void *ptr ) const;
+
+    /**
+     * Releases all the memory allocated from this arena.
+     * The objects living there must have been destroyed first.
+     */
+    void clear();
+
+private:
+    void *allocateFromBlock( size_t size );
+
+    QList<char *> m_blocks;
+    char *m_block;
+    char *m_next;
+    size_t m_left;
+    char *m_lastEntry; // The memory of the last entry allocated here
+    char *m_lastEntryEnd;
+};
+
+#endif
@@ -0,0 +1,201 @@
+/* This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "karchiveentrytable.h"
+
+#include <QtCore/QDataStream>
+#include <QtCore/QHash>
+#include <QtCore/QStringList>
+#include <QtCore/QVector>
+
+#include <limits.h>
+
+class KArchiveEntryTablePrivate
+{
+public:
+    KArchiveEntryTablePrivate()
+    {
+        pathOffsets.append( 0 );
+    }
+
+    int ownerId( const QString &owner );
+
+    QVector<qint64> positions;
+    QVector<qint64> sizes;
+    QVector<mode_t> modes;
+    QVector<int> dates;
+    QVector<int> pathOffsets; // Where each path starts in paths, plus the end
+    QByteArray paths; // All the paths, UTF-8 encoded, one after another, up to INT_MAX bytes
+    QVector<int> userIds; // Index in owners, -1 if unknown
+    QVector<int> groupIds;
+    QStringList owners; // The names of the users and groups
+    QHash<QString, int> ownerIds;
+    QHash<int, QString> symlinks; // Few entries are symlinks
+};
+
+int KArchiveEntryTablePrivate::ownerId( const QString &owner )
+{
+    // An empty name, as found in some tar headers, is kept as is
+    if ( owner.isNull() )
+        return -1;
+    QHash<QString, int>::const_iterator it = ownerIds.constFind( owner );
+    if ( it != ownerIds.constEnd() )
+        return it.value();
+    const int id = owners.count();
+    owners.append( owner );
+    ownerIds.insert( owner, id );
+    return id;
+}
+
+KArchiveEntryTable::KArchiveEntryTable()
+    : d( new KArchiveEntryTablePrivate )
+{
+}
+
+KArchiveEntryTable::~KArchiveEntryTable()
+{
+    delete d;
+}
+
+int KArchiveEntryTable::count() const
+{
+    return d->positions.count();
+}
+
+QString KArchiveEntryTable::path( int row ) const
+{
+    const int start = d->pathOffsets.at( row );
+    return QString::fromUtf8( d->paths.constData() + start, d->pathOffsets.at( row + 1 ) - start );
+}
+
+QByteArray KArchiveEntryTable::rawPath( int row ) const
+{
+    const int start = d->pathOffsets.at( row );
+    return QByteArray::fromRawData( d->paths.constData() + start, d->pathOffsets.at( row + 1 ) - start );
+}
+
+QString KArchiveEntryTable::symlink( int row ) const
+{
+    return d->symlinks.value( row );
+}
+
+QString KArchiveEntryTable::user( int row ) const
+{
+    const int id = d->userIds.at( row );
+    return id < 0 ? QString() : d->owners.at( id );
+}
+
+QString KArchiveEntryTable::group( int row ) const
+{
+    const int id = d->groupIds.at( row );
+    return id < 0 ? QString() : d->owners.at( id );
+}
+
+bool KArchiveEntryTable::isDirectory( int row ) const
+{
+    return S_ISDIR( d->modes.at( row ) );
+}
+
+const qint64 *KArchiveEntryTable::positions() const
+{
+    return d->positions.constData();
+}
+
+const qint64 *KArchiveEntryTable::sizes() const
+{
+    return d->sizes.constData();
+}
+
+const mode_t *KArchiveEntryTable::modes() const
+{
+    return d->modes.constData();
+}
+
+const int *KArchiveEntryTable::dates() const
+{
+    return d->dates.constData();
+}
+
+bool KArchiveEntryTable::append( const QString &path, mode_t mode, int date, qint64 position, qint64 size,
+                                 const QString &user, const QString &group, const QString &symlink )
+{
+    const QByteArray utf8Path = path.toUtf8();
+    if ( utf8Path.size() > INT_MAX - d->paths.size() )
+        return false;
+    if ( !symlink.isEmpty() )
+        d->symlinks.insert( count(), symlink );
+    d->positions.append( position );
+    d->sizes.append( size );
+    d->modes.append( mode );
+    d->dates.append( date );
+    d->paths.append( utf8Path );
+    d->pathOffsets.append( d->paths.size() );
+    d->userIds.append( d->ownerId( user ) );
+    d->groupIds.append( d->ownerId( group ) );
+    return true;
+}
+
+void KArchiveEntryTable::clear()
+{
+    d->positions.clear();
+    d->sizes.clear();
+    d->modes.clear();
+    d->dates.clear();
+    d->pathOffsets.clear();
+    d->pathOffsets.append( 0 );
+    d->paths.clear();
+    d->userIds.clear();
+    d->groupIds.clear();
+    d->owners.clear();
+    d->ownerIds.clear();
+    d->symlinks.clear();
+}
+
+void KArchiveEntryTable::save( QDataStream &stream ) const
+{
+    stream << d->positions << d->sizes << d->modes << d->dates
+           << d->pathOffsets << d->paths
+           << d->userIds << d->groupIds << d->owners << d->symlinks;
+}
+
+bool KArchiveEntryTable::load( QDataStream &stream )
+{
+    clear();
+    stream >> d->positions >> d->sizes >> d->modes >> d->dates
+           >> d->pathOffsets >> d->paths
+           >> d->userIds >> d->groupIds >> d->owners >> d->symlinks;
+
+    // Check that the rows are consistent before trusting any offset
+    const int rows = d->positions.count();
+    bool valid = stream.status() == QDataStream::Ok
+        && d->sizes.count() == rows && d->modes.count() == rows && d->dates.count() == rows
+        && d->pathOffsets.count() == rows + 1 && d->pathOffsets.last() == d->paths.size()
+        && d->userIds.count() == rows && d->groupIds.count() == rows;
+    for ( int row = 0; valid && row < rows; ++row ) {
+        valid = d->pathOffsets.at( row ) <= d->pathOffsets.at( row + 1 )
+             && d->userIds.at( row ) >= -1 && d->userIds.at( row ) < d->owners.count()
+             && d->groupIds.at( row ) >= -1 && d->groupIds.at( row ) < d->owners.count();
+    }
+    if ( !valid || d->pathOffsets.first() != 0 ) {
+        clear();
+        return false;
+    }
+
+    for ( int id = 0; id < d->owners.count(); ++id )
+        d->ownerIds.insert( d->owners.at( id ), id );
+    return true;
+}
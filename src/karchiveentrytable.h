@@ -0,0 +1,153 @@
+/* This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+#ifndef KARCHIVEENTRYTABLE_H
+#define KARCHIVEENTRYTABLE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+#include <karchive_export.h>
+
+class QDataStream;
+class KArchiveEntryTablePrivate;
+
+/**
+ * A compact listing of the entries of an archive, one row per entry in
+ * the order they appear in the archive. Each property is kept in its own
+ * array and the paths are stored one after another in a single buffer,
+ * so that going over all the entries is a walk over contiguous memory,
+ * e.g. to sum their sizes:
+ * @code
+ * const KArchiveEntryTable &table = handler->entryTable();
+ * const qint64 *sizes = table.sizes();
+ * qint64 total = 0;
+ * for (int row = 0; row < table.count(); ++row)
+ *     total += sizes[row];
+ * @endcode
+ *
+ * @see KArchiveHandler::setDeferredEntries()
+ */
+class KARCHIVE_EXPORT KArchiveEntryTable
+{
+public:
+    KArchiveEntryTable();
+    ~KArchiveEntryTable();
+
+    /**
+     * The number of rows.
+     */
+    int count() const;
+
+    /**
+     * The full path of the entry in the archive, without leading slash.
+     */
+    QString path( int row ) const;
+
+    /**
+     * The full path of the entry in the archive, UTF-8 encoded.
+     * It is a view on the table, only valid until the table changes.
+     */
+    QByteArray rawPath( int row ) const;
+
+    /**
+     * The symlink target of the entry, or QString() if it is no symlink.
+     */
+    QString symlink( int row ) const;
+
+    /**
+     * The user owning the entry, or QString() if unknown.
+     * An empty name given to append() is returned as is.
+     */
+    QString user( int row ) const;
+
+    /**
+     * The group owning the entry, or QString() if unknown.
+     * An empty name given to append() is returned as is.
+     */
+    QString group( int row ) const;
+
+    /**
+     * Whether the entry is a directory.
+     */
+    bool isDirectory( int row ) const;
+
+    /**
+     * The positions of the data of all the entries in the archive,
+     * indexed by row.
+     */
+    const qint64 *positions() const;
+
+    /**
+     * The sizes of the data of all the entries, indexed by row.
+     * Directories have a size of 0.
+     */
+    const qint64 *sizes() const;
+
+    /**
+     * The permissions of all the entries in unix format, indexed by row.
+     */
+    const mode_t *modes() const;
+
+    /**
+     * The modification times of all the entries, in seconds since 1970,
+     * indexed by row.
+     */
+    const int *dates() const;
+
+    /**
+     * Adds a row, called by the archive handlers while reading an archive.
+     * @param path the full path of the entry
+     * @param mode the permissions, including S_IFDIR for directories
+     * @param date the modification time of the entry
+     * @param position the position of the data of the entry in the archive
+     * @param size the size of the data of the entry
+     * @param user the user owning the entry, or QString() if unknown
+     * @param group the group owning the entry, or QString() if unknown
+     * @param symlink the symlink target, or QString()
+     * @return false if the row can't be added, the paths of all the rows
+     * being limited to 2 GiB in total
+     */
+    bool append( const QString &path, mode_t mode, int date, qint64 position, qint64 size,
+                 const QString &user, const QString &group, const QString &symlink );
+
+    /**
+     * Removes all the rows.
+     */
+    void clear();
+
+    /**
+     * Writes the table to @p stream.
+     * @see load()
+     */
+    void save( QDataStream &stream ) const;
+
+    /**
+     * Replaces the rows with a table written by save().
+     * @return false if the stream holds no valid table, the table
+     * being then empty
+     */
+    bool load( QDataStream &stream );
+
+private:
+    Q_DISABLE_COPY(KArchiveEntryTable)
+    KArchiveEntryTablePrivate* const d;
+};
+
+#endif
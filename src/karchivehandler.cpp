@@ -22,16 +22,25 @@
 
 #include <qsavefile.h>
 
+#include <QtCore/QBuffer>
+#include <QtCore/QDataStream>
+#include <QtCore/QDateTime>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QMimeDatabase>
 
 #include "karchive.h"
 #include "karchivehandler.h"
+#include "karchiveentryarena_p.h"
+#include "kcompressiondevice.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
+#include <limits.h>
+#include <string.h>
 
 class KArchiveHandlerPrivate
 {
@@ -44,6 +53,11 @@ public:
         , fileName()
         , mode( QIODevice::NotOpen )
         , deviceOwned( false )
+        , memoryMapping( false )
+        , map( 0 )
+        , mapSize( 0 )
+        , deferredEntries( false )
+        , creatingEntries( false )
     {}
     ~KArchiveHandlerPrivate()
     {
@@ -60,6 +74,15 @@ public:
     QString fileName;
     QIODevice::OpenMode mode;
     bool deviceOwned;
+    bool memoryMapping;
+    QHash<QByteArray, QString> strings; // Interned strings, by their encoded value
+    KArchiveEntryArena entryArena; // The entries below rootDir
+    bool deferredEntries;
+    bool creatingEntries;
+    KArchiveEntryTable entryTable;
+    QString indexFileName;
+    uchar *map;
+    qint64 mapSize;
 };
 
 void KArchiveHandlerPrivate::abortWriting()
@@ -119,7 +142,28 @@ bool KArchiveHandler::open( QIODevice::OpenMode mode )
     Q_ASSERT( !d->rootDir );
     d->rootDir = 0;
 
-    return openArchive( mode );
+    // The listing of archive files opened read-only can be kept in an index
+    const bool indexed = !d->indexFileName.isEmpty() && !d->fileName.isEmpty()
+                         && mode == QIODevice::ReadOnly && supportsIndex();
+    if ( !indexed || !loadIndex() ) {
+        const bool deferred = d->deferredEntries;
+        d->deferredEntries = deferred || indexed;
+        const bool ok = openArchive( mode );
+        d->deferredEntries = deferred;
+        if ( !ok )
+            return false;
+        if ( indexed && d->entryTable.count() > 0 )
+            saveIndex();
+    }
+
+    // Map the archive once parsed, the handler may have replaced the device
+    QFile *file = qobject_cast<QFile *>( d->dev );
+    if ( d->memoryMapping && mode == QIODevice::ReadOnly && file && file->size() > 0 ) {
+        d->map = file->map( 0, file->size() );
+        if ( d->map )
+            d->mapSize = file->size();
+    }
+    return true;
 }
 
 bool KArchiveHandler::close()
@@ -137,6 +181,14 @@ bool KArchiveHandler::close()
             d->abortWriting();
     }
 
+    if ( d->map ) {
+        QFile *file = qobject_cast<QFile *>( d->dev );
+        if ( file )
+            file->unmap( d->map );
+        d->map = 0;
+        d->mapSize = 0;
+    }
+
     if (d->dev && d->dev != d->saveFile) {
         d->dev->close();
     }
@@ -152,6 +204,9 @@ bool KArchiveHandler::close()
 
     delete d->rootDir;
     d->rootDir = 0;
+    d->entryArena.clear();
+    d->entryTable.clear();
+    d->strings.clear();
     d->mode = QIODevice::NotOpen;
     d->dev = 0;
     return closeSucceeded;
@@ -196,8 +251,197 @@ void KArchiveHandler::setDevice( QIODevice * dev )
     d->deviceOwned = false;
 }
 
+void KArchiveHandler::setMemoryMapping( bool enable )
+{
+    d->memoryMapping = enable;
+}
+
+bool KArchiveHandler::memoryMapping() const
+{
+    return d->memoryMapping;
+}
+
+QByteArray KArchiveHandler::mappedData( qint64 offset, qint64 size ) const
+{
+    if ( !d->map || offset < 0 || size < 0 || size > INT_MAX || offset > d->mapSize - size )
+        return QByteArray();
+    return QByteArray::fromRawData( reinterpret_cast<const char *>( d->map + offset ), size );
+}
+
+static bool headerStartsWith( const QByteArray &header, int offset, const char *magic, int size )
+{
+    return header.size() >= offset + size && memcmp( header.constData() + offset, magic, size ) == 0;
+}
+
+// A compressed stream only holds a tar archive if the decompressed
+// header says so, or if the file name says so when the beginning of the
+// archive doesn't decompress to a whole tar header (bzip2 compresses
+// whole blocks, for instance)
+static QString compressedTarMimeType( const QByteArray &header, KCompressionDevice::CompressionType type,
+                                      const QString &fileName, const char *tarMimeType )
+{
+    QByteArray data( header );
+    QBuffer buffer( &data );
+    KCompressionDevice dev( &buffer, false, type );
+    if ( dev.open( QIODevice::ReadOnly ) ) {
+        const QByteArray decompressed = dev.read( KArchiveHandler::headerSize() );
+        if ( decompressed.size() >= 257 + 5 ) {
+            if ( headerStartsWith( decompressed, 257, "ustar", 5 ) )
+                return QString::fromLatin1( tarMimeType );
+            return QString();
+        }
+    }
+    if ( !fileName.isEmpty() ) {
+        QMimeDatabase db;
+        if ( db.mimeTypeForFile( fileName, QMimeDatabase::MatchExtension ).name() == QLatin1String( tarMimeType ) )
+            return QString::fromLatin1( tarMimeType );
+    }
+    return QString();
+}
+
+//static
+QString KArchiveHandler::mimeTypeForHeader( const QByteArray &header, const QString &fileName )
+{
+    if ( headerStartsWith( header, 0, "PK\003\004", 4 ) || headerStartsWith( header, 0, "PK\005\006", 4 ) )
+        return QString::fromLatin1( "application/zip" );
+    if ( headerStartsWith( header, 0, "\037\213", 2 ) )
+        return compressedTarMimeType( header, KCompressionDevice::GZip, fileName, "application/x-compressed-tar" );
+    if ( headerStartsWith( header, 0, "BZh", 3 ) )
+        return compressedTarMimeType( header, KCompressionDevice::BZip2, fileName, "application/x-bzip-compressed-tar" );
+    if ( headerStartsWith( header, 0, "\375" "7zXZ\000", 6 ) )
+        return compressedTarMimeType( header, KCompressionDevice::Xz, fileName, "application/x-xz-compressed-tar" );
+    if ( headerStartsWith( header, 0, "7z\274\257\047\034", 6 ) )
+        return QString::fromLatin1( "application/x-7z-compressed" );
+    if ( headerStartsWith( header, 0, "!<arch>\n", 8 ) )
+        return QString::fromLatin1( "application/x-archive" );
+    // POSIX ("ustar\0") and GNU ("ustar  ") tar headers
+    if ( headerStartsWith( header, 257, "ustar", 5 ) )
+        return QString::fromLatin1( "application/x-tar" );
+    return QString();
+}
+
+//static
+int KArchiveHandler::headerSize()
+{
+    return 512;
+}
+
+KArchiveEntryArena *KArchiveHandler::entryArena()
+{
+    return &d->entryArena;
+}
+
+void KArchiveHandler::setDeferredEntries( bool enable )
+{
+    d->deferredEntries = enable;
+}
+
+bool KArchiveHandler::deferredEntries() const
+{
+    return d->deferredEntries;
+}
+
+const KArchiveEntryTable &KArchiveHandler::entryTable() const
+{
+    return d->entryTable;
+}
+
+KArchiveEntryTable &KArchiveHandler::entryTable()
+{
+    return d->entryTable;
+}
+
+void KArchiveHandler::setIndexFileName( const QString &fileName )
+{
+    d->indexFileName = fileName;
+}
+
+QString KArchiveHandler::indexFileName() const
+{
+    return d->indexFileName;
+}
+
+// "KAIX", then the version of the format
+static const quint32 s_indexMagic = 0x4b414958;
+static const quint32 s_indexVersion = 1;
+
+bool KArchiveHandler::loadIndex()
+{
+    QFile file( d->indexFileName );
+    if ( !file.open( QIODevice::ReadOnly ) )
+        return false;
+
+    QDataStream stream( &file );
+    stream.setVersion( QDataStream::Qt_5_0 );
+    quint32 magic, version;
+    stream >> magic >> version;
+    if ( magic != s_indexMagic || version != s_indexVersion )
+        return false;
+
+    // Only trust an index written for this very archive file
+    QString path;
+    qint64 size, mtime;
+    stream >> path >> size >> mtime;
+    const QFileInfo info( d->fileName );
+    if ( stream.status() != QDataStream::Ok || path != info.absoluteFilePath()
+         || size != info.size() || mtime != info.lastModified().toMSecsSinceEpoch() ) {
+        //qDebug() << "Index" << d->indexFileName << "is out of date";
+        return false;
+    }
+
+    if ( !d->entryTable.load( stream ) )
+        return false;
+    if ( !loadIndexData( stream ) || stream.status() != QDataStream::Ok ) {
+        d->entryTable.clear();
+        return false;
+    }
+    return true;
+}
+
+void KArchiveHandler::saveIndex() const
+{
+    QSaveFile file( d->indexFileName );
+    if ( !file.open( QIODevice::WriteOnly ) ) {
+        //qWarning() << "Couldn't write index" << d->indexFileName;
+        return;
+    }
+
+    const QFileInfo info( d->fileName );
+    QDataStream stream( &file );
+    stream.setVersion( QDataStream::Qt_5_0 );
+    stream << s_indexMagic << s_indexVersion;
+    stream << info.absoluteFilePath() << info.size() << info.lastModified().toMSecsSinceEpoch();
+    d->entryTable.save( stream );
+    saveIndexData( stream );
+    file.commit();
+}
+
+bool KArchiveHandler::supportsIndex() const
+{
+    return false;
+}
+
+void KArchiveHandler::saveIndexData( QDataStream & ) const
+{
+}
+
+bool KArchiveHandler::loadIndexData( QDataStream & )
+{
+    return true;
+}
+
+KArchiveFile *KArchiveHandler::createFileEntry( const QString &name, int access, int date,
+                                                const QString &user, const QString &group,
+                                                const QString &symlink, qint64 position, qint64 size )
+{
+    return new ( d->archive ) KArchiveFile( d->archive, name, access, date, user, group, symlink, position, size );
+}
+
 KArchiveDirectory * KArchiveHandler::rootDir()
 {
+    if ( !d->rootDir && !d->creatingEntries && d->entryTable.count() > 0 )
+        createEntries();
+
     if ( !d->rootDir )
     {
         //qDebug() << "Making root dir ";
@@ -206,11 +450,58 @@ KArchiveDirectory * KArchiveHandler::rootDir()
         QString username = pw ? QFile::decodeName(pw->pw_name) : QString::number( getuid() );
         QString groupname = grp ? QFile::decodeName(grp->gr_name) : QString::number( getgid() );
 
-        d->rootDir = new KArchiveDirectory( d->archive, QLatin1String("/"), (int)(0777 + S_IFDIR), 0, username, groupname, QString() );
+        d->rootDir = new ( d->archive ) KArchiveDirectory( d->archive, QLatin1String("/"), (int)(0777 + S_IFDIR), 0, username, groupname, QString() );
     }
     return d->rootDir;
 }
 
+void KArchiveHandler::createEntries()
+{
+    const KArchiveEntryTable &table = d->entryTable;
+    const qint64 *positions = table.positions();
+    const qint64 *sizes = table.sizes();
+    const mode_t *modes = table.modes();
+    const int *dates = table.dates();
+    d->creatingEntries = true;
+
+    // A "." directory describes the root, as in tar files
+    for ( int row = 0; row < table.count(); ++row ) {
+        if ( table.rawPath( row ) == "." && table.isDirectory( row ) ) {
+            d->rootDir = new ( d->archive ) KArchiveDirectory( d->archive, QLatin1String("."), modes[row], dates[row],
+                                                               table.user( row ), table.group( row ), QString() );
+            break;
+        }
+    }
+    KArchiveDirectory *root = rootDir();
+
+    for ( int row = 0; row < table.count(); ++row ) {
+        const QString path = table.path( row );
+        if ( path == QLatin1String(".") )
+            continue;
+        const int pos = path.lastIndexOf( QLatin1Char('/') );
+        const QString name = ( pos == -1 ) ? path : path.mid( pos + 1 );
+        // Entries of unknown owner get the one of the root, like in findOrCreate,
+        // an empty owner read from the archive is kept
+        const QString user = table.user( row ).isNull() ? root->user() : table.user( row );
+        const QString group = table.group( row ).isNull() ? root->group() : table.group( row );
+
+        KArchiveEntry *e;
+        if ( table.isDirectory( row ) )
+            e = new ( d->archive ) KArchiveDirectory( d->archive, name, modes[row], dates[row],
+                                                      user, group, table.symlink( row ) );
+        else
+            e = createFileEntry( name, modes[row], dates[row], user, group,
+                                 table.symlink( row ), positions[row], sizes[row] );
+
+        KArchiveDirectory *parent = ( pos == -1 ) ? root : findOrCreate( path.left( pos ) );
+        const int count = parent->count();
+        parent->addEntry( e );
+        if ( parent->count() == count ) // duplicate or empty name
+            delete e;
+    }
+    d->creatingEntries = false;
+}
+
 void KArchiveHandler::setRootDir( KArchiveDirectory *rootDir )
 {
     Q_ASSERT( !d->rootDir ); // Call setRootDir only once during parsing please ;)
@@ -269,13 +560,26 @@ KArchiveDirectory * KArchiveHandler::findOrCreate( const QString & path )
 
     //qDebug() << "found parent " << parent->name() << " adding " << dirname << " to ensure " << path;
     // Found -> add the missing piece
-    KArchiveDirectory * e = new KArchiveDirectory( d->archive, dirname, d->rootDir->permissions(),
-                                                   d->rootDir->date(), d->rootDir->user(),
-                                                   d->rootDir->group(), QString() );
+    KArchiveDirectory * e = new ( d->archive ) KArchiveDirectory( d->archive, dirname, d->rootDir->permissions(),
+                                                                  d->rootDir->date(), d->rootDir->user(),
+                                                                  d->rootDir->group(), QString() );
     parent->addEntry( e );
     return e; // now a directory to <path> exists
 }
 
+QString KArchiveHandler::internLocal8Bit( const char *str, int maxSize )
+{
+    // Look up the raw bytes first, so that known values cost no allocation
+    const QByteArray key = QByteArray::fromRawData( str, qstrnlen( str, maxSize ) );
+    QHash<QByteArray, QString>::const_iterator it = d->strings.constFind( key );
+    if ( it != d->strings.constEnd() )
+        return it.value();
+
+    const QString value = QString::fromLocal8Bit( key.constData(), key.size() );
+    d->strings.insert( QByteArray( key.constData(), key.size() ), value );
+    return value;
+}
+
 bool KArchiveHandler::createDevice( QIODevice::OpenMode mode )
 {
     switch( mode ) {
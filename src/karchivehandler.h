@@ -25,16 +25,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <QtCore/QByteArray>
 #include <QtCore/QDate>
 #include <QtCore/QString>
 #include <QtCore/QStringList>
 #include <QtCore/QHash>
 
 #include <karchive_export.h>
+#include <karchiveentrytable.h>
 
 class KArchive;
 class KArchiveDirectory;
 class KArchiveFile;
+class KArchiveEntryArena;
+class QDataStream;
 
 class KArchiveHandlerPrivate;
 
@@ -112,6 +116,102 @@ public:
      */
     QIODevice * device() const;
 
+    /**
+     * Call this before open() to map archives read from a file into memory.
+     * KArchiveFile::data() then returns a view on the mapping for data
+     * stored without compression, and compressed data gets decompressed
+     * straight from it.
+     * @warning the data returned by KArchiveFile::data() is then only
+     * valid until the archive is closed
+     * @param enable true to map the archive file when it is opened
+     * read-only, false (the default) to read it
+     * @see mappedData()
+     */
+    void setMemoryMapping( bool enable );
+
+    /**
+     * Whether archive files opened read-only are mapped into memory.
+     * @return true if memory mapping is enabled
+     * @see setMemoryMapping()
+     */
+    bool memoryMapping() const;
+
+    /**
+     * Call this before open() to only list the entries of archives opened
+     * read-only in entryTable(), without creating any KArchiveEntry.
+     * The directory tree then gets built from the table the first time
+     * rootDir() is called.
+     * Handlers that don't support it (all but tar, ar and 7z) ignore it.
+     * @param enable true to defer the creation of the entries, false
+     * (the default) to create them while opening the archive
+     * @see entryTable()
+     */
+    void setDeferredEntries( bool enable );
+
+    /**
+     * Whether the entries only get listed in entryTable() when opening.
+     * @return true if the creation of the entries is deferred
+     * @see setDeferredEntries()
+     */
+    bool deferredEntries() const;
+
+    /**
+     * The entries of the open archive, filled when their creation is
+     * deferred and the handler supports it, empty otherwise.
+     * @see setDeferredEntries()
+     */
+    const KArchiveEntryTable &entryTable() const;
+
+    /**
+     * Call this before open() to keep the listing of an archive file in
+     * the index file @p fileName, so that opening the archive again later
+     * doesn't parse it again.
+     * When the archive is opened read-only, the listing is loaded from the
+     * index if it was written for the same file, size and modification
+     * time, and the index gets written otherwise. Creating the entries
+     * is then deferred, see setDeferredEntries().
+     * Only handlers reimplementing supportsIndex() (tar, ar and 7z) use an index.
+     * @param fileName the path of the index file, QString() (the default)
+     * for none
+     */
+    void setIndexFileName( const QString &fileName );
+
+    /**
+     * The path of the index file the listing of the archive is kept in.
+     * @see setIndexFileName()
+     */
+    QString indexFileName() const;
+
+    /**
+     * A view on the mapped archive file, which doesn't copy the data.
+     * It is only valid until the archive is closed.
+     * @param offset the position of the data in the archive file
+     * @param size the size of the data
+     * @return the data, or a null QByteArray if the archive isn't mapped
+     * into memory or the range is out of the file
+     * @see setMemoryMapping()
+     */
+    QByteArray mappedData( qint64 offset, qint64 size ) const;
+
+    /**
+     * Guesses the MIME Type of an archive from the signature at the
+     * beginning of its data, without involving the shared MIME database.
+     * A gzip, bzip2 or xz stream is only reported as a compressed tar
+     * archive when its decompressed beginning is a tar header, or when
+     * that can't be told from @p header and @p fileName has the
+     * extension of a compressed tar archive.
+     * @param header the first bytes of the archive, up to headerSize()
+     * @param fileName the name of the archive file, if any
+     * @return the MIME Type, or an empty string if no known signature
+     * was found
+     */
+    static QString mimeTypeForHeader( const QByteArray &header, const QString &fileName = QString() );
+
+    /**
+     * The number of bytes mimeTypeForHeader() looks at.
+     */
+    static int headerSize();
+
     /**
      * Retrieves or create the root directory.
      * The default implementation assumes that openArchive() did the parsing,
@@ -212,6 +312,62 @@ protected:
      */
     KArchiveDirectory * findOrCreate( const QString & path );
 
+    /**
+     * The table to list the entries in while reading an archive,
+     * when deferredEntries() is set.
+     */
+    KArchiveEntryTable &entryTable();
+
+    /**
+     * Decodes a local 8-bit string that repeats across entries, like the
+     * name of a user or group. Every string of the same value decoded
+     * while the archive is open shares the same data, so it only gets
+     * decoded and stored once.
+     * @param str the string, NUL-terminated or @p maxSize bytes long
+     * @param maxSize the maximum number of bytes to read from @p str
+     * @return the decoded string
+     */
+    QString internLocal8Bit( const char *str, int maxSize );
+
+    /**
+     * Whether the handler can be opened from an index file, instead of
+     * calling openArchive(). Handlers reimplement it to return true when
+     * openArchive() fills the entry table when deferring the creation of
+     * the entries, and loadIndexData() restores all the other state
+     * openArchive() sets up when reading.
+     * The default implementation returns false.
+     * @see setIndexFileName()
+     */
+    virtual bool supportsIndex() const;
+
+    /**
+     * Can be reimplemented to keep data of the handler in the index file,
+     * along with the entry table, e.g. to seek faster in the archive.
+     * Called after openArchive() when the index gets written.
+     * @see setIndexFileName()
+     */
+    virtual void saveIndexData( QDataStream &stream ) const;
+
+    /**
+     * Reads back the data written by saveIndexData(). Called instead of
+     * openArchive() when opening the archive from its index.
+     * @return false to parse the archive instead
+     */
+    virtual bool loadIndexData( QDataStream &stream );
+
+    /**
+     * Creates the entry of a file listed in the entry table, when the
+     * directory tree gets built from it. Can be reimplemented by handlers
+     * whose files don't read their data straight from the archive.
+     * The default implementation creates a KArchiveFile reading @p size
+     * bytes at @p position in the archive, allocated from the entries of
+     * the archive (see KArchiveEntry::operator new()).
+     * @see entryTable()
+     */
+    virtual KArchiveFile *createFileEntry( const QString &name, int access, int date,
+                                           const QString &user, const QString &group,
+                                           const QString &symlink, qint64 position, qint64 size );
+
     /**
      * Can be reimplemented in order to change the creation of the device
      * (when using the fileName constructor). By default this method uses
@@ -251,6 +407,23 @@ protected:
 
     void abortWriting();
 
+private:
+    /**
+     * Builds the directory tree from the entry table.
+     */
+    void createEntries();
+
+    bool loadIndex();
+    void saveIndex() const;
+
+    friend class KArchiveEntry;
+    friend class KArchiveFile;
+    friend class KArchiveDirectory;
+    /**
+     * The memory the entries of the open archive are allocated from.
+     */
+    KArchiveEntryArena *entryArena();
+
 protected:
     virtual void virtual_hook( int id, void* data );
 private:
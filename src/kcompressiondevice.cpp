@@ -27,6 +27,7 @@
 
 #include "kgzipfilter.h"
 #include "knonefilter.h"
+#include "kparallelgzipwriter_p.h"
 
 #if HAVE_BZIP2_SUPPORT
 #include "kbzip2filter.h"
@@ -45,7 +46,10 @@ public:
     Private() : bNeedHeader(true), bSkipHeaders(false),
                 bOpenedUnderlyingDevice(false),
                 bIgnoreData(false),
-                type(KCompressionDevice::None) {}
+                type(KCompressionDevice::None),
+                threadCount(1),
+                parallelWriter(0),
+                accessPointSpan(0) {}
     bool bNeedHeader;
     bool bSkipHeaders;
     bool bOpenedUnderlyingDevice;
@@ -55,6 +59,9 @@ public:
     KFilterBase::Result result;
     KFilterBase *filter;
     KCompressionDevice::CompressionType type;
+    int threadCount;
+    KParallelGzipWriter *parallelWriter; // replaces the filter when writing gzip with several threads
+    qint64 accessPointSpan;
 };
 
 KFilterBase* KCompressionDevice::filterForCompressionType(KCompressionDevice::CompressionType type)
@@ -140,9 +147,15 @@ bool KCompressionDevice::open( QIODevice::OpenMode mode )
     }
     d->bNeedHeader = !d->bSkipHeaders;
     d->filter->setFilterFlags(d->bSkipHeaders ? KFilterBase::NoHeaders : KFilterBase::WithHeaders);
+#if HAVE_XZ_SUPPORT
+    if ( d->type == Xz )
+        static_cast<KXzFilter *>(d->filter)->setThreadCount( d->threadCount );
+#endif
     if (!d->filter->init(mode)) {
         return false;
     }
+    if ( d->type == GZip )
+        static_cast<KGzipFilter *>(d->filter)->setAccessPointSpan( mode == QIODevice::ReadOnly ? d->accessPointSpan : 0 );
     d->bOpenedUnderlyingDevice = !d->filter->device()->isOpen();
     bool ret = d->bOpenedUnderlyingDevice ? d->filter->device()->open( mode ) : true;
     d->result = KFilterBase::Ok;
@@ -151,6 +164,8 @@ bool KCompressionDevice::open( QIODevice::OpenMode mode )
         //qWarning() << "KCompressionDevice::open: Couldn't open underlying device";
     } else {
         setOpenMode( mode );
+        if ( mode == QIODevice::WriteOnly && d->type == GZip && d->threadCount > 1 )
+            d->parallelWriter = new KParallelGzipWriter( d->filter->device(), d->threadCount, d->bSkipHeaders );
     }
 
     return ret;
@@ -162,6 +177,8 @@ void KCompressionDevice::close()
         return;
     if ( d->filter->mode() == QIODevice::WriteOnly )
         write( 0L, 0 ); // finish writing
+    delete d->parallelWriter;
+    d->parallelWriter = 0;
     //qDebug() << "Calling terminate().";
 
     if (!d->filter->terminate()) {
@@ -193,7 +210,28 @@ bool KCompressionDevice::seek( qint64 pos )
         return d->filter->device()->reset();
     }
 
-    if ( ioIndex > pos ) // we can start from here
+    if ( d->type == GZip && d->accessPointSpan > 0 )
+    {
+        // Resume from the closest access point when going back, or when
+        // it saves decompressing at least one span. The latter also makes
+        // sure it is past the data QIODevice may have buffered.
+        KGzipFilter *gzipFilter = static_cast<KGzipFilter *>(d->filter);
+        const qint64 pointPos = gzipFilter->accessPointBefore( pos );
+        if ( pointPos > 0 && ( pos < ioIndex || pointPos >= ioIndex + d->accessPointSpan ) )
+        {
+            //qDebug() << "resuming at access point" << pointPos;
+            if ( !gzipFilter->seekToAccessPoint( pointPos ) )
+                return false;
+            d->bNeedHeader = false;
+            d->result = KFilterBase::Ok;
+            QIODevice::seek( pointPos );
+            ioIndex = pointPos;
+            if ( ioIndex == pos )
+                return true;
+        }
+    }
+
+    if ( ioIndex < pos ) // we can start from here
         pos = pos - ioIndex;
     else
     {
@@ -203,12 +241,12 @@ bool KCompressionDevice::seek( qint64 pos )
             return false;
     }
 
+    // read() moves the position forward by the number of skipped bytes
     //qDebug() << "reading " << pos << " dummy bytes";
     QByteArray dummy( qMin( pos, (qint64)3*BUFFER_SIZE ), 0 );
     d->bIgnoreData = true;
     bool result = ( read( dummy.data(), pos ) == pos );
     d->bIgnoreData = false;
-    QIODevice::seek(pos);
     return result;
 }
 
@@ -318,6 +356,19 @@ qint64 KCompressionDevice::writeData( const char *data /*0 to finish*/, qint64 l
         return 0;
 
     bool finish = (data == 0L);
+    if ( d->parallelWriter )
+    {
+        bool ok = true;
+        if ( d->bNeedHeader )
+        {
+            ok = d->parallelWriter->writeHeader( d->origFileName );
+            d->bNeedHeader = false;
+        }
+        if ( ok )
+            ok = finish ? d->parallelWriter->finish() : d->parallelWriter->write( data, len );
+        d->result = !ok ? KFilterBase::Error : finish ? KFilterBase::End : KFilterBase::Ok;
+        return ( ok && !finish ) ? len : 0;
+    }
     if (!finish)
     {
         filter->setInBuffer( data, len );
@@ -398,6 +449,41 @@ void KCompressionDevice::setSkipHeaders()
     d->bSkipHeaders = true;
 }
 
+void KCompressionDevice::setThreadCount( int count )
+{
+    d->threadCount = qMax( 1, count );
+}
+
+int KCompressionDevice::threadCount() const
+{
+    return d->threadCount;
+}
+
+void KCompressionDevice::setAccessPointSpan( qint64 span )
+{
+    // Smaller spans would fall within QIODevice's read buffer, see seek()
+    d->accessPointSpan = span > 0 ? qMax( span, qint64( 64 * 1024 ) ) : 0;
+}
+
+qint64 KCompressionDevice::accessPointSpan() const
+{
+    return d->accessPointSpan;
+}
+
+QByteArray KCompressionDevice::accessPoints() const
+{
+    if ( d->type != GZip || !isOpen() || !( openMode() & QIODevice::ReadOnly ) )
+        return QByteArray();
+    return static_cast<KGzipFilter *>(d->filter)->saveAccessPoints();
+}
+
+bool KCompressionDevice::setAccessPoints( const QByteArray &data )
+{
+    if ( d->type != GZip || !isOpen() || d->accessPointSpan <= 0 )
+        return false;
+    return static_cast<KGzipFilter *>(d->filter)->restoreAccessPoints( data );
+}
+
 KFilterBase* KCompressionDevice::filterBase()
 {
     return d->filter;
@@ -88,7 +88,70 @@ public:
     void setSkipHeaders();
 
     /**
-     * That one can be quite slow, when going back. Use with care.
+     * Call this before open() to process data on @p count threads.
+     *
+     * For gzip, written data is cut into 128 KiB blocks which are deflated
+     * in parallel and joined into a standard gzip stream, at the cost of a
+     * slightly bigger output. Reading gzip data stays single threaded.
+     *
+     * For xz, liblzma's multi-threaded encoder is used, which writes
+     * the stream as independent blocks. Such multi-block .xz files are
+     * also decoded in parallel, with liblzma 5.4 or newer.
+     *
+     * Other compression types ignore it.
+     * @param count the number of threads, 1 (the default) to work
+     * in the calling thread
+     */
+    void setThreadCount( int count );
+
+    /**
+     * The number of threads used to compress or uncompress data.
+     * @see setThreadCount()
+     */
+    int threadCount() const;
+
+    /**
+     * Call this before open() to make seeking in gzip or raw deflate data
+     * fast. While reading, an access point is then recorded about every
+     * @p span bytes of uncompressed data. Each one keeps the 32 KiB window
+     * needed to resume decompressing there, so seek() only needs to
+     * decompress from the closest access point instead of from the start
+     * of the stream. Access points only exist for data that has been read
+     * once since open().
+     * Decompressing from an access point doesn't check the CRC and the
+     * size in the gzip trailer, only reading the data from the start does.
+     * It has no effect for other compression types.
+     * @param span distance between access points, at least 64 KiB,
+     * 0 (the default) to disable them
+     */
+    void setAccessPointSpan( qint64 span );
+
+    /**
+     * The distance between access points.
+     * @see setAccessPointSpan()
+     */
+    qint64 accessPointSpan() const;
+
+    /**
+     * The access points recorded so far, serialized so that they can be
+     * restored with setAccessPoints() when the same data is read again,
+     * e.g. in a later run. Empty unless reading gzip data.
+     * @see setAccessPointSpan()
+     */
+    QByteArray accessPoints() const;
+
+    /**
+     * Call this after open() to seek with access points saved by
+     * accessPoints() for the same data, without reading it first.
+     * @return false if the access points could not be restored, e.g.
+     * because they aren't in increasing order or point past the end of
+     * the compressed data
+     */
+    bool setAccessPoints( const QByteArray &data );
+
+    /**
+     * That one can be quite slow, when going back. Use with care,
+     * or enable access points with setAccessPointSpan().
      */
     virtual bool seek( qint64 );
 
@@ -107,7 +170,7 @@ public:
     static KFilterBase* filterForCompressionType(CompressionType type);
 
 protected:
-    friend class K7Zip;
+    friend class SevenZipHandler;
 
     virtual qint64 readData( char *data, qint64 maxlen );
     virtual qint64 writeData( const char *data, qint64 len );
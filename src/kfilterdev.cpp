@@ -53,12 +53,23 @@ static KCompressionDevice::CompressionType findCompressionByFileName( const QStr
 
 static KCompressionDevice::CompressionType findCompressionTypeByMimeType( const QString & mimeType )
 {
-    if (mimeType == QLatin1String("application/x-gzip")) {
+    // Check the common names, including the compressed tar ones,
+    // before loading the MIME database for inheritance
+    if (mimeType == QLatin1String("application/x-gzip")
+        || mimeType == QLatin1String("application/x-compressed-tar")
+       ) {
         return KCompressionDevice::GZip;
     }
+    if (mimeType == QLatin1String("application/x-tar")
+        || mimeType == QLatin1String("application/zip")
+        || mimeType == QLatin1String("application/x-archive")
+       ) {
+        return KCompressionDevice::None;
+    }
 #if HAVE_BZIP2_SUPPORT
     if (mimeType == QLatin1String("application/x-bzip")
         || mimeType == QLatin1String("application/x-bzip2") // old name, kept for compatibility
+        || mimeType == QLatin1String("application/x-bzip-compressed-tar")
        ) {
         return KCompressionDevice::BZip2;
     }
@@ -66,6 +77,8 @@ static KCompressionDevice::CompressionType findCompressionTypeByMimeType( const
 #if HAVE_XZ_SUPPORT
     if ( mimeType == QLatin1String( "application/x-lzma" ) // legacy name, still used
         || mimeType == QLatin1String( "application/x-xz" ) // current naming
+        || mimeType == QLatin1String( "application/x-lzma-compressed-tar" )
+        || mimeType == QLatin1String( "application/x-xz-compressed-tar" )
        ) {
         return KCompressionDevice::Xz;
     }
@@ -22,7 +22,9 @@
 #include <time.h>
 #include <zlib.h>
 #include <QDebug>
+#include <QtCore/QDataStream>
 #include <QtCore/QIODevice>
+#include <QtCore/QVector>
 
 
 /* gzip flag byte */
@@ -35,11 +37,25 @@
 
 // #define DEBUG_GZIP
 
+// inflateGetDictionary, needed to save the window of access points, appeared in 1.2.7.1
+#define HAVE_ACCESS_POINTS (ZLIB_VERNUM >= 0x1271)
+
+#define WINDOW_SIZE 32768
+
+struct KGzipAccessPoint
+{
+    qint64 in;          // offset of the first complete byte in the compressed input
+    qint64 out;         // corresponding offset in the uncompressed output
+    int bits;           // number of bits (1-7) from the byte before, or 0
+    QByteArray window;  // preceding 32K of uncompressed data
+};
+
 class KGzipFilter::Private
 {
 public:
     Private()
-    : headerWritten(false), footerWritten(false), compressed(false), mode(0), crc(0), isInitialized(false)
+    : headerWritten(false), footerWritten(false), compressed(false), mode(0), crc(0), isInitialized(false),
+      flag(KGzipFilter::GZipHeader), accessPointSpan(0), totalIn(0), totalOut(0), resumed(false)
     {
         zStream.zalloc = (alloc_func)0;
         zStream.zfree = (free_func)0;
@@ -53,8 +69,40 @@ public:
     int mode;
     ulong crc;
     bool isInitialized;
+    KGzipFilter::Flag flag;
+
+    void addAccessPoint();
+    qint64 accessPointSpan;
+    QVector<KGzipAccessPoint> accessPoints; // sorted by output offset
+    // Positions of the zStream in the input and output, since the start
+    qint64 totalIn;
+    qint64 totalOut;
+    bool resumed; // the zStream is a raw inflate started from an access point
 };
 
+void KGzipFilter::Private::addAccessPoint()
+{
+#if HAVE_ACCESS_POINTS
+    // Only at the end of a block header, and not for the last block
+    if ( !( zStream.data_type & 128 ) || ( zStream.data_type & 64 ) )
+        return;
+    const qint64 last = accessPoints.isEmpty() ? 0 : accessPoints.last().out;
+    if ( totalOut - last < accessPointSpan )
+        return;
+
+    KGzipAccessPoint point;
+    point.in = totalIn;
+    point.out = totalOut;
+    point.bits = zStream.data_type & 7;
+    point.window.resize( WINDOW_SIZE );
+    uInt windowSize = WINDOW_SIZE;
+    if ( inflateGetDictionary( &zStream, (Bytef *) point.window.data(), &windowSize ) != Z_OK )
+        return;
+    point.window.resize( windowSize );
+    accessPoints.append( point );
+#endif
+}
+
 KGzipFilter::KGzipFilter()
     : d(new Private)
 {
@@ -89,6 +137,11 @@ bool KGzipFilter::init(int mode, Flag flag)
     }
     d->zStream.next_in = Z_NULL;
     d->zStream.avail_in = 0;
+    d->flag = flag;
+    d->totalIn = 0;
+    d->totalOut = 0;
+    d->resumed = false;
+    d->accessPoints.clear();
     if ( mode == QIODevice::ReadOnly )
     {
         const int windowBits = (flag == RawDeflate)
@@ -149,7 +202,23 @@ bool KGzipFilter::terminate()
 
 void KGzipFilter::reset()
 {
-    if ( d->mode == QIODevice::ReadOnly )
+    d->totalIn = 0;
+    d->totalOut = 0;
+    if ( d->mode == QIODevice::ReadOnly && d->resumed )
+    {
+        // Back to parsing the headers, as set up by init
+        inflateEnd(&d->zStream);
+        const int windowBits = (d->flag == RawDeflate) ? -MAX_WBITS
+                               : (d->flag == GZipHeader) ? MAX_WBITS + 32 : MAX_WBITS;
+        d->zStream.next_in = Z_NULL;
+        d->zStream.avail_in = 0;
+        int result = inflateInit2(&d->zStream, windowBits);
+        if ( result != Z_OK ) {
+            //qDebug() << "inflateInit2 returned " << result;
+        }
+        d->resumed = false;
+    }
+    else if ( d->mode == QIODevice::ReadOnly )
     {
         int result = inflateReset(&d->zStream);
         if ( result != Z_OK ) {
@@ -350,7 +419,15 @@ KGzipFilter::Result KGzipFilter::uncompress()
         qDebug() << "Calling inflate with avail_in=" << inBufferAvailable() << " avail_out=" << outBufferAvailable();
         qDebug() << "    next_in=" << d->zStream.next_in;
 #endif
-        int result = inflate(&d->zStream, Z_SYNC_FLUSH);
+        const uInt availIn = d->zStream.avail_in;
+        const uInt availOut = d->zStream.avail_out;
+        // Z_BLOCK stops at block boundaries, where access points can be recorded
+        const bool indexing = HAVE_ACCESS_POINTS && d->accessPointSpan > 0;
+        int result = inflate(&d->zStream, indexing ? Z_BLOCK : Z_SYNC_FLUSH);
+        d->totalIn += availIn - d->zStream.avail_in;
+        d->totalOut += availOut - d->zStream.avail_out;
+        if ( indexing && result == Z_OK )
+            d->addAccessPoint();
 #ifdef DEBUG_GZIP
         qDebug() << " -> inflate returned " << result;
         qDebug() << " now avail_in=" << inBufferAvailable() << " avail_out=" << outBufferAvailable();
@@ -365,6 +442,109 @@ KGzipFilter::Result KGzipFilter::uncompress()
         return uncompress_noop();
 }
 
+void KGzipFilter::setAccessPointSpan( qint64 span )
+{
+    d->accessPointSpan = qMax( qint64( 0 ), span );
+}
+
+qint64 KGzipFilter::accessPointBefore( qint64 pos ) const
+{
+    for ( int i = d->accessPoints.count() - 1 ; i >= 0 ; --i ) {
+        if ( d->accessPoints.at( i ).out <= pos )
+            return d->accessPoints.at( i ).out;
+    }
+    return -1;
+}
+
+bool KGzipFilter::seekToAccessPoint( qint64 pos )
+{
+#if HAVE_ACCESS_POINTS
+    int i = d->accessPoints.count() - 1;
+    while ( i >= 0 && d->accessPoints.at( i ).out != pos )
+        --i;
+    if ( i < 0 || d->mode != QIODevice::ReadOnly )
+        return false;
+    const KGzipAccessPoint point = d->accessPoints.at( i );
+
+    // The point is in the middle of the deflate data, so no more headers
+    inflateEnd( &d->zStream );
+    d->zStream.next_in = Z_NULL;
+    d->zStream.avail_in = 0;
+    if ( inflateInit2( &d->zStream, -MAX_WBITS ) != Z_OK )
+        return false;
+    d->resumed = true;
+
+    QIODevice *dev = device();
+    if ( !dev->seek( point.in - ( point.bits ? 1 : 0 ) ) )
+        return false;
+    if ( point.bits ) {
+        char c;
+        if ( !dev->getChar( &c ) )
+            return false;
+        inflatePrime( &d->zStream, point.bits, uchar( c ) >> ( 8 - point.bits ) );
+    }
+    if ( inflateSetDictionary( &d->zStream, (const Bytef *) point.window.constData(), point.window.size() ) != Z_OK )
+        return false;
+
+    d->totalIn = point.in;
+    d->totalOut = point.out;
+    return true;
+#else
+    Q_UNUSED( pos );
+    return false;
+#endif
+}
+
+QByteArray KGzipFilter::saveAccessPoints() const
+{
+    QByteArray data;
+    QDataStream stream( &data, QIODevice::WriteOnly );
+    stream << qint32( d->accessPoints.count() );
+    foreach ( const KGzipAccessPoint &point, d->accessPoints )
+        stream << point.in << point.out << qint32( point.bits ) << point.window;
+    return data;
+}
+
+bool KGzipFilter::restoreAccessPoints( const QByteArray &data )
+{
+#if HAVE_ACCESS_POINTS
+    if ( d->mode != QIODevice::ReadOnly )
+        return false;
+    QDataStream stream( data );
+    qint32 count;
+    stream >> count;
+    if ( stream.status() != QDataStream::Ok || count < 0 )
+        return false;
+    // Access points for other data would make seek() return garbage, so
+    // at least make sure they fit in the compressed data of the device
+    QIODevice *dev = device();
+    const qint64 deviceSize = ( dev && !dev->isSequential() ) ? dev->size() : -1;
+    QVector<KGzipAccessPoint> points;
+    for ( qint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i ) {
+        KGzipAccessPoint point;
+        qint32 bits;
+        stream >> point.in >> point.out >> bits >> point.window;
+        point.bits = bits;
+        if ( point.bits < 0 || point.bits > 7 || point.window.size() > WINDOW_SIZE )
+            return false;
+        if ( point.in < ( point.bits ? 1 : 0 ) || point.out <= 0 )
+            return false;
+        if ( deviceSize >= 0 && point.in > deviceSize )
+            return false;
+        if ( !points.isEmpty() && ( point.in <= points.last().in || point.out <= points.last().out ) )
+            return false;
+        points.append( point );
+    }
+    if ( stream.status() != QDataStream::Ok )
+        return false;
+    d->accessPoints = points;
+    return true;
+#else
+    Q_UNUSED( data );
+    return false;
+#endif
+}
+
 KGzipFilter::Result KGzipFilter::compress( bool finish )
 {
     Q_ASSERT ( d->compressed );
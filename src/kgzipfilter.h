@@ -64,6 +64,42 @@ public:
     virtual Result uncompress();
     virtual Result compress( bool finish );
 
+    /**
+     * Call this before reading to record an access point about every
+     * @p span bytes of uncompressed data, in the style of zlib's zran.c:
+     * each one holds the input and output positions, the bit offset and
+     * the 32 KiB window needed to resume inflating from there.
+     * Access points are kept until the next init().
+     * @param span distance between access points, 0 to disable them
+     */
+    void setAccessPointSpan( qint64 span );
+    /**
+     * @return the uncompressed position of the last access point
+     * at or before @p pos, or -1 if there is none
+     */
+    qint64 accessPointBefore( qint64 pos ) const;
+    /**
+     * Resumes inflating at the access point found at the uncompressed
+     * position @p pos, which repositions the device.
+     * The data is then inflated as raw deflate data, so the CRC and the
+     * size in the gzip trailer are not checked when reaching the end of
+     * the stream. Only reading the data from the start, without seeking
+     * to an access point, checks them.
+     */
+    bool seekToAccessPoint( qint64 pos );
+    /**
+     * @return the access points recorded so far, serialized
+     */
+    QByteArray saveAccessPoints() const;
+    /**
+     * Replaces the access points with ones saved by saveAccessPoints()
+     * for the same compressed data. Call this after init().
+     * @return false, keeping the current access points, if @p data can't
+     * be parsed or the access points aren't in increasing order within
+     * the size of the device
+     */
+    bool restoreAccessPoints( const QByteArray &data );
+
 private:
     Result uncompress_noop();
     class Private;
@@ -18,13 +18,71 @@
 
 #include "klimitediodevice_p.h"
 
+#include <QtCore/QFileDevice>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+// One mutex per shared device, serializing its positioning and reading,
+// so that devices reading from different archives don't wait for each other.
+// Recursive as a shared device may itself read through a KLimitedIODevice
+struct SharedDeviceMutex
+{
+    SharedDeviceMutex() : mutex( QMutex::Recursive ), refs( 0 ) {}
+    QMutex mutex;
+    int refs;
+};
+typedef QHash<const QIODevice *, SharedDeviceMutex *> SharedDeviceMutexes;
+Q_GLOBAL_STATIC(SharedDeviceMutexes, s_sharedDeviceMutexes)
+// Only held while looking up the mutex of a device
+Q_GLOBAL_STATIC(QMutex, s_sharedDeviceMutexesMutex)
+
+static QMutex *acquireSharedDeviceMutex( const QIODevice *dev )
+{
+    QMutexLocker locker( s_sharedDeviceMutexesMutex() );
+    SharedDeviceMutex *&shared = (*s_sharedDeviceMutexes())[dev];
+    if ( !shared )
+        shared = new SharedDeviceMutex;
+    ++shared->refs;
+    return &shared->mutex;
+}
+
+static void releaseSharedDeviceMutex( const QIODevice *dev )
+{
+    QMutexLocker locker( s_sharedDeviceMutexesMutex() );
+    SharedDeviceMutexes::iterator it = s_sharedDeviceMutexes()->find( dev );
+    Q_ASSERT( it != s_sharedDeviceMutexes()->end() );
+    if ( --it.value()->refs == 0 ) {
+        delete it.value();
+        s_sharedDeviceMutexes()->erase( it );
+    }
+}
+
 KLimitedIODevice::KLimitedIODevice( QIODevice *dev, qint64 start, qint64 length )
-    : m_dev( dev ), m_start( start ), m_length( length )
+    : m_dev( dev ), m_fd( -1 ), m_mutex( 0 ), m_start( start ), m_length( length )
 {
     //qDebug() << "start=" << start << "length=" << length;
+#ifdef Q_OS_UNIX
+    // Unflushed writes aren't visible to pread(), only use it on files opened for reading
+    QFileDevice* file = qobject_cast<QFileDevice *>( dev );
+    if ( file && file->openMode() == QIODevice::ReadOnly && !file->isSequential() )
+        m_fd = file->handle();
+#endif
+    if ( m_fd < 0 )
+        m_mutex = acquireSharedDeviceMutex( m_dev );
     open( QIODevice::ReadOnly ); //krazy:exclude=syscalls
 }
 
+KLimitedIODevice::~KLimitedIODevice()
+{
+    if ( m_mutex )
+        releaseSharedDeviceMutex( m_dev );
+}
+
 bool KLimitedIODevice::open( QIODevice::OpenMode m )
 {
     //qDebug() << "m=" << m;
@@ -35,7 +93,10 @@ bool KLimitedIODevice::open( QIODevice::OpenMode m )
           else
           ok = m_dev->open( m );
           if ( ok )*/
-        m_dev->seek( m_start ); // No concurrent access !
+        if ( m_fd < 0 ) {
+            QMutexLocker locker( m_mutex );
+            m_dev->seek( m_start );
+        }
     } else {
         //qWarning() << "KLimitedIODevice::open only supports QIODevice::ReadOnly!";
     }
@@ -55,6 +116,26 @@ qint64 KLimitedIODevice::size() const
 qint64 KLimitedIODevice::readData( char * data, qint64 maxlen )
 {
     maxlen = qMin( maxlen, m_length - pos() ); // Apply upper limit
+#ifdef Q_OS_UNIX
+    if ( m_fd >= 0 ) {
+        qint64 done = 0;
+        while ( done < maxlen ) {
+            const ssize_t n = ::pread( m_fd, data + done, maxlen - done, m_start + pos() + done );
+            if ( n < 0 && errno == EINTR )
+                continue;
+            if ( n < 0 )
+                return done > 0 ? done : -1;
+            if ( n == 0 )
+                break; // end of file
+            done += n;
+        }
+        return done;
+    }
+#endif
+    // Other readers may have moved the device since the last read
+    QMutexLocker locker( m_mutex );
+    if ( !m_dev->isSequential() && m_dev->pos() != m_start + pos() )
+        m_dev->seek( m_start + pos() );
     return m_dev->read( data, maxlen );
 }
 
@@ -62,6 +143,9 @@ bool KLimitedIODevice::seek( qint64 pos )
 {
     Q_ASSERT( pos <= m_length );
     pos = qMin( pos, m_length ); // Apply upper limit
+    if ( m_fd >= 0 )
+        return QIODevice::seek( pos );
+    QMutexLocker locker( m_mutex );
     bool ret = m_dev->seek( m_start + pos );
     if ( ret ) {
         QIODevice::seek( pos );
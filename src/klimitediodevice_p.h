@@ -21,10 +21,19 @@
 
 #include <QtCore/QDebug>
 #include <QtCore/QIODevice>
+
+class QMutex;
 /**
  * A readonly device that reads from an underlying device
  * from a given point to another (e.g. to give access to a single
  * file inside an archive).
+ *
+ * When the underlying device is a file opened for reading only, the data
+ * is read with positional reads on its descriptor, so that any number of
+ * these devices can be read at once, from several threads as well.
+ * Other devices have a single position, which gets set before every read,
+ * while holding a mutex shared by the devices reading from the same
+ * underlying device.
  * @author David Faure <faure@kde.org>
  * @internal - used by KArchive
  */
@@ -39,7 +48,7 @@ public:
      * @param length the length of the data to read (in bytes)
      */
     KLimitedIODevice( QIODevice *dev, qint64 start, qint64 length );
-    virtual ~KLimitedIODevice() {}
+    virtual ~KLimitedIODevice();
 
     virtual bool isSequential() const;
 
@@ -57,6 +66,8 @@ public:
     virtual qint64 bytesAvailable() const;
 private:
     QIODevice* m_dev;
+    int m_fd; // -1 unless reading with pread()
+    QMutex* m_mutex; // shared with the devices reading from m_dev, unless reading with pread()
     qint64 m_start;
     qint64 m_length;
 };
@@ -0,0 +1,211 @@
+/* This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "kparallelgzipwriter_p.h"
+
+#include <QtCore/QIODevice>
+#include <QtCore/QList>
+#include <QtCore/QRunnable>
+#include <QtCore/QSemaphore>
+#include <QtCore/QThreadPool>
+
+#include <time.h>
+#include <string.h>
+#include <zlib.h>
+
+#define BLOCK_SIZE 128*1024
+#define DICTIONARY_SIZE 32*1024
+
+/* gzip flag byte, see kgzipfilter.cpp */
+#define ORIG_NAME    0x08 /* bit 3 set: original file name present */
+
+class KParallelGzipBlock : public QRunnable
+{
+public:
+    KParallelGzipBlock()
+        : last( false ), length( 0 ), crc( 0 ), ok( false )
+    {
+        setAutoDelete( false );
+    }
+
+    virtual void run()
+    {
+        length = input.size();
+        crc = crc32( 0L, Z_NULL, 0 );
+        crc = crc32( crc, (const Bytef *) input.constData(), input.size() );
+
+        z_stream zStream;
+        memset( &zStream, 0, sizeof( zStream ) );
+        ok = deflateInit2( &zStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY ) == Z_OK;
+        if ( ok && !dictionary.isEmpty() )
+            ok = deflateSetDictionary( &zStream, (const Bytef *) dictionary.constData(), dictionary.size() ) == Z_OK;
+        if ( ok ) {
+            // deflateBound() covers Z_FINISH, a sync flush adds at most an empty stored block
+            output.resize( deflateBound( &zStream, input.size() ) + 16 );
+            zStream.next_in = (Bytef *) input.data();
+            zStream.avail_in = input.size();
+            zStream.next_out = (Bytef *) output.data();
+            zStream.avail_out = output.size();
+            const int result = deflate( &zStream, last ? Z_FINISH : Z_SYNC_FLUSH );
+            ok = last ? result == Z_STREAM_END : ( result == Z_OK && zStream.avail_in == 0 );
+            output.resize( output.size() - zStream.avail_out );
+        }
+        deflateEnd( &zStream );
+        input.clear();
+        dictionary.clear();
+        done.release();
+    }
+
+    bool last;
+    QByteArray input;
+    QByteArray dictionary;  // tail of the previous block
+    QByteArray output;      // raw deflate data
+    qint64 length;          // of the input
+    ulong crc;              // of the input
+    bool ok;
+    QSemaphore done;        // released once run() is over
+};
+
+class KParallelGzipWriter::Private
+{
+public:
+    Private() : dev( 0 ), threadCount( 1 ), rawDeflate( false ),
+                crc( crc32( 0L, Z_NULL, 0 ) ), totalIn( 0 ) {}
+
+    bool submit( bool last );
+    bool flush( int maxPending );
+
+    QIODevice *dev;
+    int threadCount;
+    bool rawDeflate;
+    QThreadPool pool;
+    QList<KParallelGzipBlock*> pending; // in stream order
+    QByteArray current;                 // data of the next block
+    QByteArray dictionary;
+    ulong crc;
+    quint32 totalIn;                    // modulo 2^32, as in the gzip trailer
+};
+
+bool KParallelGzipWriter::Private::submit( bool last )
+{
+    KParallelGzipBlock *block = new KParallelGzipBlock;
+    block->last = last;
+    block->dictionary = dictionary;
+    dictionary = current.right( DICTIONARY_SIZE );
+    block->input = current;
+    current.clear();
+    current.reserve( BLOCK_SIZE );
+
+    pending.append( block );
+    pool.start( block );
+    // Bound the memory held by queued blocks
+    return flush( 2 * threadCount );
+}
+
+bool KParallelGzipWriter::Private::flush( int maxPending )
+{
+    while ( !pending.isEmpty() ) {
+        KParallelGzipBlock *block = pending.first();
+        if ( pending.count() > maxPending )
+            block->done.acquire();
+        else if ( !block->done.tryAcquire() )
+            break;
+
+        pending.removeFirst();
+        bool ok = block->ok;
+        if ( ok ) {
+            crc = crc32_combine( crc, block->crc, block->length );
+            totalIn += quint32( block->length );
+            ok = dev->write( block->output ) == block->output.size();
+        }
+        delete block;
+        if ( !ok )
+            return false;
+    }
+    return true;
+}
+
+KParallelGzipWriter::KParallelGzipWriter( QIODevice *dev, int threadCount, bool rawDeflate )
+    : d(new Private)
+{
+    d->dev = dev;
+    d->threadCount = qMax( 1, threadCount );
+    d->rawDeflate = rawDeflate;
+    d->pool.setMaxThreadCount( d->threadCount );
+    d->current.reserve( BLOCK_SIZE );
+}
+
+KParallelGzipWriter::~KParallelGzipWriter()
+{
+    d->pool.waitForDone();
+    qDeleteAll( d->pending );
+    delete d;
+}
+
+bool KParallelGzipWriter::writeHeader( const QByteArray &fileName )
+{
+    if ( d->rawDeflate )
+        return true;
+
+    // Same header as KGzipFilter::writeHeader
+    QByteArray header( 10, 0 );
+    header[ 0 ] = char(0x1f);
+    header[ 1 ] = char(0x8b);
+    header[ 2 ] = Z_DEFLATED;
+    header[ 3 ] = ORIG_NAME;
+    const quint32 mtime = time( 0L ); // Modification time (in unix format)
+    header[ 4 ] = char(mtime);
+    header[ 5 ] = char(mtime >> 8);
+    header[ 6 ] = char(mtime >> 16);
+    header[ 7 ] = char(mtime >> 24);
+    header[ 8 ] = 0; // Extra flags (2=max compress, 4=fastest compress)
+    header[ 9 ] = 3; // Unix
+    header += fileName;
+    header += '\0';
+    return d->dev->write( header ) == header.size();
+}
+
+bool KParallelGzipWriter::write( const char *data, qint64 len )
+{
+    while ( len > 0 ) {
+        const int chunk = int( qMin( len, qint64( BLOCK_SIZE - d->current.size() ) ) );
+        d->current.append( data, chunk );
+        data += chunk;
+        len -= chunk;
+        if ( d->current.size() == BLOCK_SIZE && !d->submit( false ) )
+            return false;
+    }
+    // Write out whatever got compressed meanwhile
+    return d->flush( 2 * d->threadCount );
+}
+
+bool KParallelGzipWriter::finish()
+{
+    if ( !d->submit( true ) || !d->flush( 0 ) )
+        return false;
+
+    if ( d->rawDeflate )
+        return true;
+
+    char trailer[ 8 ];
+    const quint32 crc = d->crc;
+    for ( int i = 0 ; i < 4 ; ++i ) {
+        trailer[ i ] = char(crc >> ( 8 * i ));
+        trailer[ 4 + i ] = char(d->totalIn >> ( 8 * i ));
+    }
+    return d->dev->write( trailer, 8 ) == 8;
+}
@@ -0,0 +1,72 @@
+/* This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef kparallelgzipwriter_p_h
+#define kparallelgzipwriter_p_h
+
+#include <QtCore/QByteArray>
+
+class QIODevice;
+
+/**
+ * Writes a gzip stream using several threads, the way pigz does.
+ *
+ * The input is cut into fixed size blocks which are deflated concurrently,
+ * each one primed with the last 32 KiB of the previous block as dictionary
+ * so that the compression ratio stays close to a single stream.
+ * All blocks but the last one end with a sync flush, which makes their
+ * concatenation a single valid deflate stream. The CRC of the whole data
+ * is assembled with crc32_combine().
+ *
+ * @internal - used by KCompressionDevice
+ */
+class KParallelGzipWriter
+{
+public:
+    /**
+     * @param dev the device receiving the compressed data, already opened
+     * @param threadCount the number of blocks to compress at once
+     * @param rawDeflate true to write neither gzip header nor trailer
+     */
+    KParallelGzipWriter( QIODevice *dev, int threadCount, bool rawDeflate );
+    ~KParallelGzipWriter();
+
+    /**
+     * Writes the gzip header, does nothing for raw deflate streams.
+     * @param fileName the original file name to store in the header
+     */
+    bool writeHeader( const QByteArray &fileName );
+
+    /**
+     * Queues data for compression, blocks that are ready get written out.
+     * @return false if writing to the device failed
+     */
+    bool write( const char *data, qint64 len );
+
+    /**
+     * Compresses the remaining data, waits for all blocks and writes
+     * the gzip trailer.
+     * @return false if compressing or writing failed
+     */
+    bool finish();
+
+private:
+    class Private;
+    Private* const d;
+};
+
+#endif
@@ -33,12 +33,24 @@ extern "C" {
 
 #include <qiodevice.h>
 
+#include <string.h>
+
+// lzma_stream_encoder_mt() is stable since 5.2.0, lzma_stream_decoder_mt() since 5.4.0
+#define KXZ_HAVE_MT_ENCODER (LZMA_VERSION >= 50020002)
+#define KXZ_HAVE_MT_DECODER (LZMA_VERSION >= 50040002)
+
+/* We set the memlimit for decompression to 100MiB which should be
+* more than enough to be sufficient for level 9 which requires 65 MiB.
+*/
+static const uint64_t decoderMemLimit = 100<<20;
+
 
 class KXzFilter::Private
 {
 public:
     Private()
-    : isInitialized(false)
+    : isInitialized(false),
+      threadCount(1)
     {
         memset(&zStream, 0, sizeof(zStream));
         mode = 0;
@@ -50,6 +62,8 @@ public:
     int mode;
     bool isInitialized;
     KXzFilter::Flag flag;
+    QVector<unsigned char> properties; // as given to init, for reset
+    uint32_t threadCount;
 };
 
 KXzFilter::KXzFilter()
@@ -76,16 +90,15 @@ bool KXzFilter::init( int mode, Flag flag, const QVector<unsigned char>& propert
     }
 
     d->flag = flag;
+    d->properties = properties;
     lzma_ret result;
     d->zStream.next_in = 0;
     d->zStream.avail_in = 0;
     if ( mode == QIODevice::ReadOnly ) {
         switch (flag) {
         case AUTO:
-            /* We set the memlimit for decompression to 100MiB which should be
-            * more than enough to be sufficient for level 9 which requires 65 MiB.
-            */
-            result = lzma_auto_decoder(&d->zStream, 100<<20, 0);
+            // The multi-threaded decoder only knows .xz, see readHeader
+            result = lzma_auto_decoder(&d->zStream, decoderMemLimit, 0);
             if (result != LZMA_OK) {
                 qWarning() << "lzma_auto_decoder returned" << result;
                 return false;
@@ -166,7 +179,19 @@ bool KXzFilter::init( int mode, Flag flag, const QVector<unsigned char>& propert
         }
 
     } else if ( mode == QIODevice::WriteOnly ) {
-        if (flag == AUTO) {
+        if (flag == AUTO && d->threadCount > 1) {
+#if KXZ_HAVE_MT_ENCODER
+            // Writes a stream of independent blocks, which can be decoded in parallel as well
+            lzma_mt mt;
+            memset(&mt, 0, sizeof(mt));
+            mt.threads = d->threadCount;
+            mt.preset = LZMA_PRESET_DEFAULT;
+            mt.check = LZMA_CHECK_CRC32;
+            result = lzma_stream_encoder_mt(&d->zStream, &mt);
+#else
+            result = lzma_easy_encoder(&d->zStream, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC32);
+#endif
+        } else if (flag == AUTO) {
             result = lzma_easy_encoder(&d->zStream, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC32);
         } else {
             if (LZMA2) {
@@ -215,7 +240,59 @@ void KXzFilter::reset()
     //qDebug() << "KXzFilter::reset";
     // liblzma doesn't have a reset call...
     terminate();
-    init( d->mode );
+    init( d->mode, d->flag, d->properties );
+}
+
+bool KXzFilter::readHeader()
+{
+#if KXZ_HAVE_MT_DECODER
+    static const uint8_t xzMagic[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+    if (d->mode != QIODevice::ReadOnly || d->flag != AUTO || d->threadCount <= 1)
+        return true;
+    if (d->zStream.avail_in < sizeof(xzMagic) || memcmp(d->zStream.next_in, xzMagic, sizeof(xzMagic)) != 0)
+        return true; // .lzma, stays with the auto decoder
+
+    // Nothing was decoded yet, the input buffer is kept as is
+    const uint8_t *next_in = d->zStream.next_in;
+    const size_t avail_in = d->zStream.avail_in;
+    uint8_t *next_out = d->zStream.next_out;
+    const size_t avail_out = d->zStream.avail_out;
+    lzma_end(&d->zStream);
+    memset(&d->zStream, 0, sizeof(d->zStream));
+    d->zStream.next_in = next_in;
+    d->zStream.avail_in = avail_in;
+    d->zStream.next_out = next_out;
+    d->zStream.avail_out = avail_out;
+
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = d->threadCount;
+    // Above the threading limit liblzma falls back to a single thread,
+    // so allow a quarter of the RAM for the thread buffers
+    mt.memlimit_stop = qMax(decoderMemLimit, lzma_physmem() / 4);
+    mt.memlimit_threading = mt.memlimit_stop;
+    lzma_ret result = lzma_stream_decoder_mt(&d->zStream, &mt);
+    if (result != LZMA_OK) {
+        qWarning() << "lzma_stream_decoder_mt returned" << result;
+        // The previous decoder is gone, decode on a single thread again
+        memset(&d->zStream, 0, sizeof(d->zStream));
+        d->zStream.next_in = next_in;
+        d->zStream.avail_in = avail_in;
+        d->zStream.next_out = next_out;
+        d->zStream.avail_out = avail_out;
+        result = lzma_auto_decoder(&d->zStream, decoderMemLimit, 0);
+        if (result != LZMA_OK) {
+            qWarning() << "lzma_auto_decoder returned" << result;
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+void KXzFilter::setThreadCount( int count )
+{
+    d->threadCount = qMax(1, count);
 }
 
 void KXzFilter::setOutBuffer( char * data, uint maxlen )
@@ -57,7 +57,11 @@ public:
     virtual int mode() const;
     virtual bool terminate();
     virtual void reset();
-    virtual bool readHeader() { return true; } // lzma handles it by itself ! Cool !
+    /**
+     * lzma handles the headers by itself ! Cool !
+     * Only used to switch to the multi-threaded decoder for .xz streams.
+     */
+    virtual bool readHeader();
     virtual bool writeHeader( const QByteArray & ) { return true; }
     virtual void setOutBuffer( char * data, uint maxlen );
     virtual void setInBuffer( const char * data, uint size );
@@ -65,6 +69,13 @@ public:
     virtual int  outBufferAvailable() const;
     virtual Result uncompress();
     virtual Result compress( bool finish );
+
+    /**
+     * Call this before init() to use the multi-threaded encoder and
+     * decoder of liblzma for the .xz format (AUTO flag).
+     * @param count the number of threads, 1 for the single-threaded coders
+     */
+    void setThreadCount( int count );
 private:
     class Private;
     Private* const d;
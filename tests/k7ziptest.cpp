@@ -16,7 +16,7 @@
  *  Boston, MA 02110-1301, USA.
  */
 
-#include "k7zip.h"
+#include "karchive.h"
 #include <stdio.h>
 #include <QtCore/QDebug>
 
@@ -50,7 +50,7 @@ void recursive_print( const KArchiveDirectory * dir, const QString & path )
   }
 }
 
-// See karchivetest.cpp for the unittest that covers K7Zip.
+// See karchivetest.cpp for the unittest that covers 7z archives.
 
 int main( int argc, char** argv )
 {
@@ -62,7 +62,7 @@ int main( int argc, char** argv )
         return 1;
     }
 
-    K7Zip k7z( argv[1] );
+    KArchive k7z( argv[1] );
 
     if ( !k7z.open( QIODevice::ReadOnly ) )
     {